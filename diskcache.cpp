@@ -0,0 +1,234 @@
+#include "diskcache.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#ifndef _WIN32
+# include <dirent.h>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+// each file starts with a header, so that a read can check that the file is complete
+struct FileHeader {
+	char magic[8];
+	uint64_t size; // of the image which follows
+};
+static const char FILE_MAGIC[8] = {'E', 'F', 'C', 'A', 'C', 'H', 'E', '1'};
+static const char IMAGE_SUFFIX[] = ".efc";
+static const char TEMP_SUFFIX[] = ".tmp";
+// temporary files older than this are assumed to be left over from a process which died whilst writing
+static const time_t STALE_TEMP_SECONDS = 3600;
+
+static bool endsWith(const char* name, const char* suffix) {
+	size_t len = strlen(name), suffixLen = strlen(suffix);
+	return len >= suffixLen && memcmp(name + len - suffixLen, suffix, suffixLen) == 0;
+}
+
+DiskCache::DiskCache() : active(false), capacity(0), used(0), hits(0), misses(0) {}
+
+std::string DiskCache::path(const ImageCacheKey& key) const {
+	char name[64];
+	snprintf(name, sizeof(name), "/%016llx%016llx-%016llx%s",
+		(unsigned long long)key.content[0], (unsigned long long)key.content[1], (unsigned long long)key.params, IMAGE_SUFFIX);
+	return directory + name;
+}
+
+#ifndef _WIN32
+
+// last modified time, which reads update, in nanoseconds, as many images can be written within a second
+static int64_t lastUsedTime(const struct stat& st) {
+#ifdef __APPLE__
+	return int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+	return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+static void releaseMapping(void* data) {
+	FileHeader* header = reinterpret_cast<FileHeader*>(static_cast<uint8_t*>(data) - sizeof(FileHeader));
+	munmap(header, header->size + sizeof(FileHeader));
+}
+
+static bool writeAll(int fd, const void* data, size_t size) {
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	while(size) {
+		ssize_t written = write(fd, p, size);
+		if(written < 0) {
+			if(errno == EINTR) continue;
+			return false;
+		}
+		p += written;
+		size -= written;
+	}
+	return true;
+}
+
+bool DiskCache::lookup(const ImageCacheKey& key, uint8_t*& data, size_t& size, void (*&release)(void*)) {
+	if(!enabled()) return false;
+	std::string file;
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		if(directory.empty()) return false;
+		file = path(key);
+	}
+	
+	int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		misses++;
+		return false;
+	}
+	struct stat st;
+	void* map = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && size_t(st.st_size) > sizeof(FileHeader))
+		map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(map != MAP_FAILED)
+		futimens(fd, nullptr); // mark as recently used, for eviction
+	close(fd);
+	if(map == MAP_FAILED) {
+		misses++;
+		return false;
+	}
+	
+	const FileHeader* header = static_cast<const FileHeader*>(map);
+	if(memcmp(header->magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 || header->size != uint64_t(st.st_size) - sizeof(FileHeader)) {
+		// not something this wrote, or truncated by a crash
+		munmap(map, st.st_size);
+		unlink(file.c_str());
+		misses++;
+		return false;
+	}
+	data = static_cast<uint8_t*>(map) + sizeof(FileHeader);
+	size = header->size;
+	release = releaseMapping;
+	hits++;
+	return true;
+}
+
+void DiskCache::insert(const ImageCacheKey& key, const uint8_t* data, size_t size) {
+	if(!enabled()) return;
+	std::string file;
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		// an image taking more than a quarter of the cache would push out too much else
+		if(directory.empty() || size + sizeof(FileHeader) > capacity / 4) return;
+		file = path(key);
+	}
+	if(access(file.c_str(), F_OK) == 0) return; // written by another thread or process in the meantime
+	
+	// the temporary name is unique to this process and write, so concurrent writers don't clash
+	static std::atomic<unsigned> counter(0);
+	std::string temp = file + "." + std::to_string(getpid()) + "." + std::to_string(counter++) + TEMP_SUFFIX;
+	int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if(fd < 0) return;
+	FileHeader header;
+	memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+	header.size = size;
+	bool ok = writeAll(fd, &header, sizeof(header)) && writeAll(fd, data, size);
+	ok = close(fd) == 0 && ok;
+	if(!ok || rename(temp.c_str(), file.c_str()) != 0) {
+		unlink(temp.c_str());
+		return;
+	}
+	
+	std::lock_guard<std::mutex> lk(mutex);
+	used += size + sizeof(FileHeader);
+	// trim a little below the limit, so that each insert doesn't need a scan
+	if(used > capacity)
+		evict(capacity - capacity/8);
+}
+
+void DiskCache::evict(size_t limit) {
+	struct File {
+		std::string name;
+		int64_t lastUsed;
+		size_t size;
+	};
+	DIR* dir = opendir(directory.c_str());
+	if(!dir) return;
+	std::vector<File> files;
+	size_t total = 0;
+	time_t now = time(nullptr);
+	while(struct dirent* entry = readdir(dir)) {
+		bool image = endsWith(entry->d_name, IMAGE_SUFFIX);
+		if(!image && !endsWith(entry->d_name, TEMP_SUFFIX)) continue;
+		struct stat st;
+		if(fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) continue;
+		if(!image) {
+			// another process may be writing this, unless it's old
+			if(now - st.st_mtime > STALE_TEMP_SECONDS)
+				unlinkat(dirfd(dir), entry->d_name, 0);
+			else
+				total += st.st_size;
+			continue;
+		}
+		files.push_back({entry->d_name, lastUsedTime(st), size_t(st.st_size)});
+		total += st.st_size;
+	}
+	
+	if(total > limit) {
+		std::sort(files.begin(), files.end(), [](const File& a, const File& b) {
+			return a.lastUsed < b.lastUsed;
+		});
+		// another process may remove the same files at the same time, which is harmless
+		for(size_t i=0; i<files.size() && total > limit; i++) {
+			unlinkat(dirfd(dir), files[i].name.c_str(), 0);
+			total -= files[i].size;
+		}
+	}
+	closedir(dir);
+	used = total;
+}
+
+bool DiskCache::setDirectory(const std::string& dir, size_t bytes, std::string& error) {
+	std::lock_guard<std::mutex> lk(mutex);
+	if(dir.empty()) {
+		active = false;
+		directory.clear();
+		return true;
+	}
+	if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		error = "Failed to create cache directory: " + std::string(strerror(errno));
+		return false;
+	}
+	struct stat st;
+	if(stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+		error = "Cache path is not a directory";
+		return false;
+	}
+	directory = dir;
+	capacity = bytes;
+	evict(capacity);
+	active = true;
+	return true;
+}
+
+#else
+
+bool DiskCache::lookup(const ImageCacheKey&, uint8_t*&, size_t&, void (*&)(void*)) {
+	return false;
+}
+void DiskCache::insert(const ImageCacheKey&, const uint8_t*, size_t) {}
+void DiskCache::evict(size_t) {}
+bool DiskCache::setDirectory(const std::string& dir, size_t, std::string& error) {
+	if(dir.empty()) return true;
+	error = "Disk cache isn't supported on Windows";
+	return false;
+}
+
+#endif
+
+DiskCache::Stats DiskCache::stats() {
+	std::lock_guard<std::mutex> lk(mutex);
+	return {hits, misses, used};
+}
+
+DiskCache& DiskCache::global() {
+	static DiskCache cache;
+	return cache;
+}
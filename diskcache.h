@@ -0,0 +1,51 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "imagecache.h"
+
+// cache of encoded images in a directory, one file per image, named after its key, so that it persists across
+// restarts and can be shared by processes on the same host
+// files are written to a temporary name and renamed into place, so readers never see a partial image, and are read
+// through mmap, which stays valid even if another process evicts the file
+// (not supported on Windows)
+class DiskCache {
+	std::mutex mutex;
+	std::string directory; // empty = disabled
+	std::atomic<bool> active;
+	size_t capacity; // in bytes
+	size_t used;     // as of the last scan, plus images this process has written since
+	std::atomic<uint64_t> hits, misses;
+	
+	std::string path(const ImageCacheKey& key) const;
+	// recount the directory, removing the least recently used files (and stale temporary files) until it's under
+	// `limit`; called with the mutex held
+	void evict(size_t limit);
+public:
+	DiskCache();
+	DiskCache(const DiskCache&) = delete;
+	DiskCache& operator=(const DiskCache&) = delete;
+	
+	bool enabled() const { return active.load(std::memory_order_relaxed); }
+	// on a hit, `data` points into a read-only mapping of the file, which must be released with `release`
+	bool lookup(const ImageCacheKey& key, uint8_t*& data, size_t& size, void (*&release)(void*));
+	void insert(const ImageCacheKey& key, const uint8_t* data, size_t size);
+	// uses `dir` (created if it doesn't exist) with up to `bytes` of images; an empty `dir` disables the cache,
+	// leaving its files in place
+	bool setDirectory(const std::string& dir, size_t bytes, std::string& error);
+	
+	struct Stats {
+		uint64_t hits, misses;
+		size_t bytes;
+	};
+	Stats stats();
+	
+	static DiskCache& global();
+};
+
+#endif
@@ -1,617 +1,2173 @@
 #include <VapourSynth4.h>
 #include <VSHelper4.h>
+#include <algorithm>
+#include <climits>
+#include <cmath>
 #include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
+#include "diskcache.h"
 #include "fpnge/fpnge.h"
+#include "imagecache.h"
+#include "interleave.h"
+#include "scratch.h"
+#include "threadpool.h"
 #ifdef HAVE_JPEG
 #include <turbojpeg.h>
+#include <jconfig.h> // LIBJPEG_TURBO_VERSION_NUMBER, for the disk cache key
 #endif
 #ifdef HAVE_WEBP
 #include <webp/encode.h>
 #endif
 
-// requires SSE4.1 minimum
-#ifdef __AVX2__
-# include <immintrin.h>
-# define MWORD_SIZE 32  // sizeof(__m256i)
-# define MM(f) _mm256_##f
-# define MMSI(f) _mm256_##f##_si256
-# define MIVEC __m256i
-# define BCAST128 _mm256_broadcastsi128_si256
-# define SWAP_MID64(x) _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3,1,2,0))
-#else
-# include <smmintrin.h>
-# define MWORD_SIZE 16  // sizeof(__m128i)
-# define MM(f) _mm_##f
-# define MMSI(f) _mm_##f##_si128
-# define MIVEC __m128i
-# define BCAST128(v) (v)
-# define SWAP_MID64(x) (x)
-#endif
+// alignment for buffers passed to the SIMD kernels; enough for any instruction set they're built for
+#define MWORD_SIZE 64
 
 /// planar -> interleaved conversion
 
-static inline void copy1x16b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, int width, int bits, bool endianSwap) {
-	uint16_t* d16 = reinterpret_cast<uint16_t*>(dst);
-	const uint16_t* s0_16 = reinterpret_cast<const uint16_t*>(src0);
-	int shl = endianSwap ? (24-bits) : (16-bits);
-	int shr = endianSwap ? (bits-8) : (bits*2 - 16);
-	__m128i vshl = _mm_set_epi32(0, shr, 0, shl);
-	__m128i vshr = _mm_unpackhi_epi64(vshl, vshl);
-	
-	int x = 0;
-	for(; x<width-MWORD_SIZE/2+1; x+=MWORD_SIZE/2) {
-		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s0_16 + x));
-		s0 = MMSI(or)(MM(sll_epi16)(s0, vshl), MM(srl_epi16)(s0, vshr));
-		MMSI(store)(reinterpret_cast<MIVEC*>(d16 + x), s0);
-	}
-	for(; x<width; x++) {
-		d16[x] = (s0_16[x] << shl) | (s0_16[x] >> shr);
+// kernels for the best instruction set the CPU supports, or null if it lacks the minimum (SSE4.1)
+static const InterleaveKernels* selectKernels() {
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq")) {
+		if(__builtin_cpu_supports("avx512vbmi"))
+			return &interleaveKernels_avx512vbmi;
+		return &interleaveKernels_avx512;
 	}
+	if(__builtin_cpu_supports("avx2"))
+		return &interleaveKernels_avx2;
+	if(__builtin_cpu_supports("sse4.1"))
+		return &interleaveKernels_sse41;
+	return nullptr;
 }
+static const InterleaveKernels* const kernels = selectKernels();
 
-static inline void interleave2x8b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, int width) {
-	int x = 0;
-	for(; x<width-MWORD_SIZE+1; x+=MWORD_SIZE) {
-		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src0 + x));
-		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src1 + x));
-		
-		s0 = SWAP_MID64(s0);
-		s1 = SWAP_MID64(s1);
-		
-		MIVEC* d = reinterpret_cast<MIVEC*>(dst + x*2);
-		MMSI(store)(d+0, MM(unpacklo_epi8)(s0, s1));
-		MMSI(store)(d+1, MM(unpackhi_epi8)(s0, s1));
-	}
-	for(; x<width; x++) {
-		dst[x*2 +0] = src0[x];
-		dst[x*2 +1] = src1[x];
-	}
-}
-static inline void interleave2x16b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, int width, int bits, bool endianSwap) {
-	uint16_t* d16 = reinterpret_cast<uint16_t*>(dst);
-	const uint16_t* s0_16 = reinterpret_cast<const uint16_t*>(src0);
-	const uint16_t* s1_16 = reinterpret_cast<const uint16_t*>(src1);
-	int shl = endianSwap ? (24-bits) : (16-bits);
-	int shr = endianSwap ? (bits-8) : (bits*2 - 16);
-	__m128i vshl = _mm_set_epi32(0, shr, 0, shl);
-	__m128i vshr = _mm_unpackhi_epi64(vshl, vshl);
-	
-	int x = 0;
-	for(; x<width-MWORD_SIZE/2+1; x+=MWORD_SIZE/2) {
-		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s0_16 + x));
-		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s1_16 + x));
-		
-		s0 = MMSI(or)(MM(sll_epi16)(s0, vshl), MM(srl_epi16)(s0, vshr));
-		s1 = MMSI(or)(MM(sll_epi16)(s1, vshl), MM(srl_epi16)(s1, vshr));
-		
-		s0 = SWAP_MID64(s0);
-		s1 = SWAP_MID64(s1);
-		
-		MIVEC* d = reinterpret_cast<MIVEC*>(d16 + x*2);
-		MMSI(store)(d+0, MM(unpacklo_epi16)(s0, s1));
-		MMSI(store)(d+1, MM(unpackhi_epi16)(s0, s1));
-	}
-	for(; x<width; x++) {
-		d16[x*2 +0] = (s0_16[x] << shl) | (s0_16[x] >> shr);
-		d16[x*2 +1] = (s1_16[x] << shl) | (s1_16[x] >> shr);
-	}
-}
-static inline void interleave3x8b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, int width) {
-	int x = 0;
-	MIVEC blend1 = BCAST128(_mm_set_epi32(0x0000ff00, 0x00ff0000, 0xff0000ff, 0x0000ff00));
-	MIVEC blend2 = MMSI(slli)(blend1, 1);
-	MIVEC shuf0 = BCAST128(_mm_set_epi32(0x050a0f04, 0x090e0308, 0x0d02070c, 0x01060b00));
-	MIVEC shuf1 = MM(alignr_epi8)(shuf0, shuf0, 15);
-	MIVEC shuf2 = MM(alignr_epi8)(shuf0, shuf0, 14);
-	for(; x<width-MWORD_SIZE+1; x+=MWORD_SIZE) {
-		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src0 + x));
-		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src1 + x));
-		MIVEC s2 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src2 + x));
-		
-		// re-arrange into groups of 3
-		s0 = MM(shuffle_epi8)(s0, shuf0);
-		s1 = MM(shuffle_epi8)(s1, shuf1);
-		s2 = MM(shuffle_epi8)(s2, shuf2);
-		
-		// blend together
-		MIVEC d0 = MM(blendv_epi8)(s0, s1, blend1);
-		MIVEC d1 = MM(blendv_epi8)(s1, s2, blend1);
-		MIVEC d2 = MM(blendv_epi8)(s2, s0, blend1);
-		d0 = MM(blendv_epi8)(d0, s2, blend2);
-		d1 = MM(blendv_epi8)(d1, s0, blend2);
-		d2 = MM(blendv_epi8)(d2, s1, blend2);
-		
-#ifdef __AVX2__
-		s0 = _mm256_permute2x128_si256(d0, d1, 0x20);
-		s1 = _mm256_permute2x128_si256(d2, d0, 0x30);
-		s2 = _mm256_permute2x128_si256(d1, d2, 0x31);
-		d0 = s0;
-		d1 = s1;
-		d2 = s2;
-#endif
-		
-		MIVEC* d = reinterpret_cast<MIVEC*>(dst + x*3);
-		MMSI(store)(d+0, d0);
-		MMSI(store)(d+1, d1);
-		MMSI(store)(d+2, d2);
-	}
-	for(; x<width; x++) {
-		dst[x*3 +0] = src0[x];
-		dst[x*3 +1] = src1[x];
-		dst[x*3 +2] = src2[x];
-	}
-}
-static inline void interleave3x16b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, int width, int bits, bool endianSwap) {
-	uint16_t* d16 = reinterpret_cast<uint16_t*>(dst);
-	const uint16_t* s0_16 = reinterpret_cast<const uint16_t*>(src0);
-	const uint16_t* s1_16 = reinterpret_cast<const uint16_t*>(src1);
-	const uint16_t* s2_16 = reinterpret_cast<const uint16_t*>(src2);
-	int shl = endianSwap ? (24-bits) : (16-bits);
-	int shr = endianSwap ? (bits-8) : (bits*2 - 16);
-	__m128i vshl = _mm_set_epi32(0, shr, 0, shl);
-	__m128i vshr = _mm_unpackhi_epi64(vshl, vshl);
-	
-	MIVEC shuf0 = BCAST128(_mm_set_epi32(0x0b0a0504, 0x0f0e0908, 0x03020d0c, 0x07060100));
-	MIVEC shuf1 = MM(alignr_epi8)(shuf0, shuf0, 14);
-	MIVEC shuf2 = MM(alignr_epi8)(shuf0, shuf0, 12);
-	int x = 0;
-	for(; x<width-MWORD_SIZE/2+1; x+=MWORD_SIZE/2) {
-		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s0_16 + x));
-		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s1_16 + x));
-		MIVEC s2 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s2_16 + x));
-		
-		s0 = MMSI(or)(MM(sll_epi16)(s0, vshl), MM(srl_epi16)(s0, vshr));
-		s1 = MMSI(or)(MM(sll_epi16)(s1, vshl), MM(srl_epi16)(s1, vshr));
-		s2 = MMSI(or)(MM(sll_epi16)(s2, vshl), MM(srl_epi16)(s2, vshr));
-		
-		// re-arrange into groups of 3
-		s0 = MM(shuffle_epi8)(s0, shuf0);
-		s1 = MM(shuffle_epi8)(s1, shuf1);
-		s2 = MM(shuffle_epi8)(s2, shuf2);
-		
-		// blend together
-		MIVEC d0 = MM(blend_epi16)(s0, s1, 0b10010010);
-		MIVEC d1 = MM(blend_epi16)(s2, s0, 0b10010010);
-		MIVEC d2 = MM(blend_epi16)(s1, s2, 0b10010010);
-		d0 = MM(blend_epi16)(d0, s2, 0b00100100);
-		d1 = MM(blend_epi16)(d1, s1, 0b00100100);
-		d2 = MM(blend_epi16)(d2, s0, 0b00100100);
-		
-#ifdef __AVX2__
-		s0 = _mm256_permute2x128_si256(d0, d1, 0x20);
-		s1 = _mm256_permute2x128_si256(d2, d0, 0x30);
-		s2 = _mm256_permute2x128_si256(d1, d2, 0x31);
-		d0 = s0;
-		d1 = s1;
-		d2 = s2;
-#endif
-		
-		MIVEC* d = reinterpret_cast<MIVEC*>(d16 + x*3);
-		MMSI(store)(d+0, d0);
-		MMSI(store)(d+1, d1);
-		MMSI(store)(d+2, d2);
-	}
-	for(; x<width; x++) {
-		d16[x*3 +0] = (s0_16[x] << shl) | (s0_16[x] >> shr);
-		d16[x*3 +1] = (s1_16[x] << shl) | (s1_16[x] >> shr);
-		d16[x*3 +2] = (s2_16[x] << shl) | (s2_16[x] >> shr);
-	}
-}
-static inline void interleave4x8b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, const uint8_t* VS_RESTRICT src3, int width) {
-	int x = 0;
-	for(; x<width-MWORD_SIZE+1; x+=MWORD_SIZE) {
-		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src0 + x));
-		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src1 + x));
-		MIVEC s2 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src2 + x));
-		MIVEC s3 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src3 + x));
-		
-		MIVEC mix0 = MM(unpacklo_epi8)(s0, s1);
-		MIVEC mix1 = MM(unpackhi_epi8)(s0, s1);
-		MIVEC mix2 = MM(unpacklo_epi8)(s2, s3);
-		MIVEC mix3 = MM(unpackhi_epi8)(s2, s3);
-		
-		s0 = MM(unpacklo_epi16)(mix0, mix2);
-		s1 = MM(unpackhi_epi16)(mix0, mix2);
-		s2 = MM(unpacklo_epi16)(mix1, mix3);
-		s3 = MM(unpackhi_epi16)(mix1, mix3);
-		
-#ifdef __AVX2__
-		mix0 = _mm256_permute2x128_si256(s0, s1, 0x20);
-		mix1 = _mm256_permute2x128_si256(s2, s3, 0x20);
-		mix2 = _mm256_permute2x128_si256(s0, s1, 0x31);
-		mix3 = _mm256_permute2x128_si256(s2, s3, 0x31);
-		s0 = mix0;
-		s1 = mix1;
-		s2 = mix2;
-		s3 = mix3;
-#endif
-		
-		MIVEC* d = reinterpret_cast<MIVEC*>(dst + x*4);
-		MMSI(store)(d+0, s0);
-		MMSI(store)(d+1, s1);
-		MMSI(store)(d+2, s2);
-		MMSI(store)(d+3, s3);
-	}
-	for(; x<width; x++) {
-		dst[x*4 +0] = src0[x];
-		dst[x*4 +1] = src1[x];
-		dst[x*4 +2] = src2[x];
-		dst[x*4 +3] = src3[x];
-	}
-}
-static inline void interleave4x16b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, const uint8_t* VS_RESTRICT src3, int width, int bits, bool endianSwap) {
-	uint16_t* d16 = reinterpret_cast<uint16_t*>(dst);
-	const uint16_t* s0_16 = reinterpret_cast<const uint16_t*>(src0);
-	const uint16_t* s1_16 = reinterpret_cast<const uint16_t*>(src1);
-	const uint16_t* s2_16 = reinterpret_cast<const uint16_t*>(src2);
-	const uint16_t* s3_16 = reinterpret_cast<const uint16_t*>(src3);
-	int shl = endianSwap ? (24-bits) : (16-bits);
-	int shr = endianSwap ? (bits-8) : (bits*2 - 16);
-	__m128i vshl = _mm_set_epi32(0, shr, 0, shl);
-	__m128i vshr = _mm_unpackhi_epi64(vshl, vshl);
-	
-	int x = 0;
-	for(; x<width-MWORD_SIZE/2+1; x+=MWORD_SIZE/2) {
-		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s0_16 + x));
-		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s1_16 + x));
-		MIVEC s2 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s2_16 + x));
-		MIVEC s3 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s3_16 + x));
-		
-		s0 = MMSI(or)(MM(sll_epi16)(s0, vshl), MM(srl_epi16)(s0, vshr));
-		s1 = MMSI(or)(MM(sll_epi16)(s1, vshl), MM(srl_epi16)(s1, vshr));
-		s2 = MMSI(or)(MM(sll_epi16)(s2, vshl), MM(srl_epi16)(s2, vshr));
-		s3 = MMSI(or)(MM(sll_epi16)(s3, vshl), MM(srl_epi16)(s3, vshr));
-		
-		MIVEC mix0 = MM(unpacklo_epi16)(s0, s1);
-		MIVEC mix1 = MM(unpackhi_epi16)(s0, s1);
-		MIVEC mix2 = MM(unpacklo_epi16)(s2, s3);
-		MIVEC mix3 = MM(unpackhi_epi16)(s2, s3);
-		
-		s0 = MM(unpacklo_epi32)(mix0, mix2);
-		s1 = MM(unpackhi_epi32)(mix0, mix2);
-		s2 = MM(unpacklo_epi32)(mix1, mix3);
-		s3 = MM(unpackhi_epi32)(mix1, mix3);
-		
-#ifdef __AVX2__
-		mix0 = _mm256_permute2x128_si256(s0, s1, 0x20);
-		mix1 = _mm256_permute2x128_si256(s2, s3, 0x20);
-		mix2 = _mm256_permute2x128_si256(s0, s1, 0x31);
-		mix3 = _mm256_permute2x128_si256(s2, s3, 0x31);
-		s0 = mix0;
-		s1 = mix1;
-		s2 = mix2;
-		s3 = mix3;
-#endif
-		
-		MIVEC* d = reinterpret_cast<MIVEC*>(d16 + x*4);
-		MMSI(store)(d+0, s0);
-		MMSI(store)(d+1, s1);
-		MMSI(store)(d+2, s2);
-		MMSI(store)(d+3, s3);
-	}
-	for(; x<width; x++) {
-		d16[x*4 +0] = (s0_16[x] << shl) | (s0_16[x] >> shr);
-		d16[x*4 +1] = (s1_16[x] << shl) | (s1_16[x] >> shr);
-		d16[x*4 +2] = (s2_16[x] << shl) | (s2_16[x] >> shr);
-		d16[x*4 +3] = (s3_16[x] << shl) | (s3_16[x] >> shr);
-	}
+static void interleaveRowCallback(void* opaque, size_t y, unsigned char* dst) {
+	kernels->interleaveRow(*static_cast<const PlanarSource*>(opaque), y, dst);
 }
 
 
-/// VapourSynth function
+/// encoding parameters
 
-static void VS_CC encodeFrame(const VSMap* in, VSMap* out, void*, VSCore*, const VSAPI* vsapi) {
-	int err = 0;
+enum ImgFormat {
+	IMGFMT_PNG,
+	IMGFMT_JPEG,
+	IMGFMT_WEBP,      // lossless WebP
+	IMGFMT_WEBP_VP8   // lossy WebP
+};
+
+// Huffman codes of the last PNG encoded for a sequence of frames (see EncodeParams::temporal), held by whatever
+// encodes the sequence, so that frames only take codes from their own sequence, whichever thread encodes them
+struct PngHistory {
+	std::mutex mutex;
+	std::vector<FPNGEHistory> stripes;
+};
+
+struct EncodeParams {
+	ImgFormat format;
+	int quality;
+	int effort;
+	int stripes; // PNG/JPEG: number of stripes to encode in parallel (0 = auto)
+	bool temporal; // PNG: reuse Huffman tables from the sequence's previous frame where they fit
+	PngHistory* history; // sequence which `temporal` applies to, set by its owner; null for single frames
+	bool reduce; // PNG: losslessly store as palette/grayscale/no alpha/8-bit where the frame allows
 	
+	// encoder configuration, prepared from the above
+	struct FPNGEOptions pngOptions;
+#ifdef HAVE_WEBP
+	WebPConfig webpConfig;
+#endif
+};
+
+// `target` selects the entry of an imgformat list to parse; quality/effort lists with a single entry apply to all targets
+static bool parseParams(const VSMap* in, EncodeParams& params, std::string& error, const VSAPI* vsapi, int target = 0) {
 	int no_quality = 0, no_effort = 0;
-	int quality = vsapi->mapGetInt(in, "quality", 0, &no_quality);
-	int effort = vsapi->mapGetInt(in, "effort", 0, &no_effort);
-	if(no_quality) quality = 75;
+	params.quality = vsapi->mapGetIntSaturated(in, "quality", vsapi->mapNumElements(in, "quality") > 1 ? target : 0, &no_quality);
+	params.effort = vsapi->mapGetIntSaturated(in, "effort", vsapi->mapNumElements(in, "effort") > 1 ? target : 0, &no_effort);
+	if(no_quality) params.quality = 75;
+	int no_stripes = 0;
+	params.stripes = vsapi->mapGetIntSaturated(in, "stripes", 0, &no_stripes);
+	int no_temporal = 0;
+	params.temporal = vsapi->mapGetIntSaturated(in, "temporal", 0, &no_temporal) != 0;
+	params.history = nullptr;
+	int no_reduce = 0;
+	params.reduce = vsapi->mapGetIntSaturated(in, "reduce", 0, &no_reduce) != 0;
 	
-	std::string imgFormat = vsapi->mapGetData(in, "imgformat", 0, nullptr);
-	if(imgFormat != "PNG"
+	std::string imgFormat = vsapi->mapGetData(in, "imgformat", target, nullptr);
+	if(imgFormat == "PNG")
+		params.format = IMGFMT_PNG;
 #ifdef HAVE_JPEG
-	 && imgFormat != "JPEG"
+	else if(imgFormat == "JPEG")
+		params.format = IMGFMT_JPEG;
 #endif
 #ifdef HAVE_WEBP
-	 && imgFormat != "WEBP-VP8" && imgFormat != "WEBP"
+	else if(imgFormat == "WEBP")
+		params.format = IMGFMT_WEBP;
+	else if(imgFormat == "WEBP-VP8")
+		params.format = IMGFMT_WEBP_VP8;
 #endif
-	) {
-		vsapi->mapSetError(out, "EncodeFrame: Format must be PNG"
+	else {
+		error = "Format must be PNG"
 #ifdef HAVE_JPEG
 	 "/JPEG"
 #endif
 #ifdef HAVE_WEBP
 	 "/WEBP/WEBP-VP8"
 #endif
-		);
-		return;
+		;
+		return false;
 	}
 	
-	if(quality < 0 || quality > 100) {
-		vsapi->mapSetError(out, "EncodeFrame: quality must be between 0 and 100");
-		return;
+	// JPEG bands default to automatic (see encodeJpeg)
+	if(no_stripes) params.stripes = params.format == IMGFMT_JPEG ? 0 : 1;
+	if(params.quality < 0 || params.quality > 100) {
+		error = "quality must be between 0 and 100";
+		return false;
+	}
+	if(params.stripes < 0) {
+		error = "stripes cannot be negative";
+		return false;
 	}
-	if(imgFormat == "PNG") {
-		if(no_effort) effort = FPNGE_COMPRESS_LEVEL_DEFAULT;
-		if(effort < 1 || effort > FPNGE_COMPRESS_LEVEL_BEST) {
+	if(params.format == IMGFMT_PNG) {
+		if(no_effort) params.effort = FPNGE_COMPRESS_LEVEL_DEFAULT;
+		if(params.effort < 1 || params.effort > FPNGE_COMPRESS_LEVEL_BEST) {
 			#define _STR_HELPER(i) #i
 			#define _STRINGIFY(i) _STR_HELPER(i)
-			vsapi->mapSetError(out, "EncodeFrame: PNG effort must be between 1 and " _STRINGIFY(FPNGE_COMPRESS_LEVEL_BEST));
+			error = "PNG effort must be between 1 and " _STRINGIFY(FPNGE_COMPRESS_LEVEL_BEST);
 			#undef _STR_HELPER
 			#undef _STRINGIFY
-			return;
+			return false;
 		}
 	}
-	if(imgFormat == "WEBP" || imgFormat == "WEBP-VP8") {
-		if(no_effort) effort = 4;
-		if(effort < 1 || effort > 6) {
-			vsapi->mapSetError(out, "EncodeFrame: WebP effort must be between 1 and 6");
-			return;
+	if(params.format == IMGFMT_WEBP || params.format == IMGFMT_WEBP_VP8) {
+		if(no_effort) params.effort = 4;
+		if(params.effort < 1 || params.effort > 6) {
+			error = "WebP effort must be between 1 and 6";
+			return false;
 		}
 	}
 	
-	const VSFrame* frame = vsapi->mapGetFrame(in, "frame", 0, nullptr);
-	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
-	
-	if((fi->colorFamily != cfRGB && fi->colorFamily != cfGray)
+	if(params.format == IMGFMT_PNG)
+		FPNGEFillOptions(&params.pngOptions, params.effort, 0);
+#ifdef HAVE_WEBP
+	if(params.format == IMGFMT_WEBP || params.format == IMGFMT_WEBP_VP8) {
+		if(!WebPConfigPreset(&params.webpConfig, WEBP_PRESET_DEFAULT, params.quality)) {
+			error = "Failed to initialize WebP";
+			return false;
+		}
+		params.webpConfig.lossless = (params.format == IMGFMT_WEBP ? 1 : 0);
+		params.webpConfig.method = params.effort;
+		// TODO: support other options?
+		
+		if(!WebPValidateConfig(&params.webpConfig)) {
+			error = "Invalid WebP configuration";
+			return false;
+		}
+	}
+#endif
+	return true;
+}
+
+// error for input which can't be encoded to `format`, listing what can
+static std::string unsupportedFormatError(ImgFormat format) {
+	switch(format) {
+		case IMGFMT_JPEG:
+			return "Only constant format 8 bit integer RGB, Grayscale and YUV (4:4:4, 4:2:2 or 4:2:0) input supported for JPEG";
+		case IMGFMT_WEBP:
+			return "Only constant format 8 bit integer RGB input supported for lossless WebP";
+		case IMGFMT_WEBP_VP8:
+			return "Only constant format 8 bit integer RGB, Grayscale and YUV 4:2:0 input supported for lossy WebP";
+		default:
+			return "Only constant format 8-16 bit integer RGB and Grayscale input supported for PNG";
+	}
+}
+
+// checks that a frame (and optional alpha) can be encoded with the given parameters
+static bool checkFormat(const VSVideoFormat* fi, int width, int height, const VSVideoFormat* alphaFi, int alphaWidth, int alphaHeight, const EncodeParams& params, std::string& error) {
+	if((fi->colorFamily != cfRGB && fi->colorFamily != cfGray && fi->colorFamily != cfYUV)
 	    || fi->sampleType == stFloat || fi->bytesPerSample > 2 || fi->bitsPerSample < 8)
 	{
-		vsapi->freeFrame(frame);
-		vsapi->mapSetError(out, "EncodeFrame: Only constant format 8-16 bit integer RGB and Grayscale input supported");
-		return;
+		error = unsupportedFormatError(params.format);
+		return false;
+	}
+	
+	if(fi->colorFamily == cfYUV) {
+		if(params.format == IMGFMT_JPEG) {
+			// 4:4:4, 4:2:2 or 4:2:0
+			if(fi->subSamplingW > 1 || fi->subSamplingH > fi->subSamplingW) {
+				error = "JPEG only supports 4:4:4, 4:2:2 and 4:2:0 YUV input";
+				return false;
+			}
+		} else if(params.format == IMGFMT_WEBP_VP8) {
+			if(fi->subSamplingW != 1 || fi->subSamplingH != 1) {
+				error = "Lossy WebP only supports 4:2:0 YUV input";
+				return false;
+			}
+		} else {
+			error = "YUV input is only supported for JPEG and lossy WebP - please convert to RGB instead";
+			return false;
+		}
 	}
 	
 	// TODO: TurboJPEG 3 supports >8b precision for JPEGs
-	// also consider YUV as a colour source?
-	if((imgFormat == "JPEG" || imgFormat == "WEBP" || imgFormat == "WEBP-VP8") && fi->bytesPerSample > 1) {
-		vsapi->freeFrame(frame);
-		vsapi->mapSetError(out, "EncodeFrame: JPEG/WebP only supports 1 byte per sample");
-		return;
+	if(params.format != IMGFMT_PNG && fi->bytesPerSample > 1) {
+		error = "JPEG/WebP only supports 1 byte per sample";
+		return false;
 	}
-	if((imgFormat == "WEBP" || imgFormat == "WEBP-VP8") && fi->colorFamily == cfGray) {
-		vsapi->freeFrame(frame);
-		vsapi->mapSetError(out, "EncodeFrame: WebP doesn't support grayscale - please convert to RGB(A) instead");
-		return;
+	if(params.format == IMGFMT_WEBP && fi->colorFamily == cfGray) {
+		error = "Lossless WebP doesn't support grayscale - please convert to RGB(A) instead";
+		return false;
 	}
 	
-	int width = vsapi->getFrameWidth(frame, 0);
-	int height = vsapi->getFrameHeight(frame, 0);
-	
-	const VSFrame *alpha = vsapi->mapGetFrame(in, "alpha", 0, &err);
-	if(alpha) {
-		const VSVideoFormat *alphaFi = vsapi->getVideoFrameFormat(alpha);
-		
-		if(width != vsapi->getFrameWidth(alpha, 0) ||
-		   height != vsapi->getFrameHeight(alpha, 0) ||
+	if(alphaFi) {
+		if(width != alphaWidth ||
+		   height != alphaHeight ||
 		   alphaFi->colorFamily != cfGray ||
 		   alphaFi->sampleType != fi->sampleType ||
 		   alphaFi->bitsPerSample != fi->bitsPerSample ||
 		   alphaFi->bytesPerSample != fi->bytesPerSample)
 		{
-			vsapi->freeFrame(frame);
-			vsapi->freeFrame(alpha);
-			vsapi->mapSetError(out, "EncodeFrame: Alpha frame dimensions and color depth don't match the main frame");
-			return;
+			error = "Alpha frame dimensions and color depth don't match the main frame";
+			return false;
 		}
-		if(imgFormat == "JPEG") {
-			vsapi->freeFrame(frame);
-			vsapi->freeFrame(alpha);
-			vsapi->mapSetError(out, "EncodeFrame: JPEG doesn't support alpha");
-			return;
+		if(params.format == IMGFMT_JPEG) {
+			error = "JPEG doesn't support alpha";
+			return false;
 		}
 	}
+	return true;
+}
+
+
+/// per-thread encoder context
+
+// buffers and library handles, reused across all encodes performed by a thread
+struct EncoderContext : public ThreadScratch {
+	ScratchBuffer interleaved; // interleaved source pixels, or a row of colours when looking for a PNG palette
+	ScratchBuffer output;      // encoded image
+	ScratchBuffer pngScratch;  // fpnge working memory
+	ScratchBuffer pngReduced;  // palette indices and 8-bit planes of a reduced PNG
+	std::vector<ScratchBuffer> pngStripes; // encoded PNG stripes, prior to being joined
+	std::vector<FPNGEHistory> pngHistory;  // copy of a PngHistory, whilst encoding with it
+#ifdef HAVE_WEBP
+	ScratchBuffer webpInput;   // WebP ARGB/YUV picture
+#endif
+#ifdef HAVE_JPEG
+	// TurboJPEG handle, along with an output buffer which TurboJPEG grows as needed; the buffer must only be passed
+	// back to the handle which allocated it, as TurboJPEG frees it when growing
+	struct JpegEncoder {
+		tjhandle handle;
+		uint8_t* buffer;
+		unsigned long size;
+	};
+	std::vector<JpegEncoder> jpeg; // one per band being encoded
+#endif
 	
+	EncoderContext() {}
+	~EncoderContext() {
+		detach();
+		trim();
+	}
+protected:
+	void trim() override {
+		interleaved.release();
+		output.release();
+		pngScratch.release();
+		pngReduced.release();
+		pngStripes.clear();
+		pngHistory.clear();
+#ifdef HAVE_WEBP
+		webpInput.release();
+#endif
+#ifdef HAVE_JPEG
+		for(auto& enc : jpeg) {
+			tjDestroy(enc.handle);
+			if(enc.buffer) tjFree(enc.buffer);
+		}
+		jpeg.clear();
+#endif
+	}
+public:
+#ifdef HAVE_JPEG
+	bool reserveJpegEncoders(size_t count) {
+		while(jpeg.size() < count) {
+			tjhandle handle = tjInitCompress();
+			if(!handle) return false;
+			jpeg.push_back({handle, nullptr, 0});
+		}
+		return true;
+	}
+#endif
+};
+
+static EncoderContext& threadContext() {
+	static thread_local EncoderContext ctx;
+	return ctx;
+}
+
+#if defined(HAVE_JPEG) || defined(HAVE_WEBP)
+// frame interleaved once for several encoders (see encodeMulti); kept apart from the EncoderContext, as the thread
+// which fills it goes on to encode with its own context whilst the others read it
+struct SharedInterleaveContext : public ThreadScratch {
+	ScratchBuffer interleaved;
 	
-	/// Interleave colour planes
-	bool isGray = fi->colorFamily == cfGray;
-	int numChannels = isGray ? 1 : 3;
-	if(alpha) numChannels++;
-	
-	unsigned stride = width * fi->bytesPerSample * numChannels;
-	stride = (stride + MWORD_SIZE-1) / MWORD_SIZE * MWORD_SIZE;
-	size_t size = stride * height;
+	SharedInterleaveContext() {}
+	~SharedInterleaveContext() {
+		detach();
+		trim();
+	}
+protected:
+	void trim() override {
+		interleaved.release();
+	}
+};
+
+static SharedInterleaveContext& sharedInterleaveContext() {
+	static thread_local SharedInterleaveContext ctx;
+	return ctx;
+}
+#endif
+
+
+/// encoded output
+
+static void alignedFree(void* p) {
+	VSH_ALIGNED_FREE(p);
+}
+
+// an encoded image; the buffer is either owned, and released with the allocator which created it, or borrowed from
+// a thread's EncoderContext, which stays locked until the image is reset
+// as such, a thread can only hold one borrowed image at a time
+struct EncodedImage {
 	uint8_t* data;
-	VSH_ALIGNED_MALLOC(&data, size, MWORD_SIZE);
+	size_t size;
+	void (*release)(void*);
+	ThreadScratch* context;
 	
-	if(!data) {
-		vsapi->freeFrame(frame);
-		vsapi->freeFrame(alpha);
-		vsapi->mapSetError(out, "EncodeFrame: Failed to allocate intermediary buffer");
-		return;
-	}
+	EncodedImage() : data(nullptr), size(0), release(nullptr), context(nullptr) {}
+	EncodedImage(const EncodedImage&) = delete;
+	EncodedImage& operator=(const EncodedImage&) = delete;
+	~EncodedImage() { reset(); }
 	
-	const uint8_t* VS_RESTRICT r = vsapi->getReadPtr(frame, 0);
-	const uint8_t* VS_RESTRICT g = nullptr;
-	const uint8_t* VS_RESTRICT b = nullptr;
-	const uint8_t* VS_RESTRICT a = nullptr;
-	ptrdiff_t strideR = vsapi->getStride(frame, 0);
-	ptrdiff_t strideG = 0;
-	ptrdiff_t strideB = 0;
-	ptrdiff_t strideA = 0;
+	void set(uint8_t* newData, size_t newSize, void (*newRelease)(void*)) {
+		reset();
+		data = newData;
+		size = newSize;
+		release = newRelease;
+	}
+	void borrow(uint8_t* newData, size_t newSize, ThreadScratch* owner) {
+		reset();
+		data = newData;
+		size = newSize;
+		context = owner;
+	}
+	// copy a borrowed buffer, so that it can outlive the next encode on this thread
+	bool makeOwned() {
+		if(!context) return true;
+		uint8_t* copy;
+		VSH_ALIGNED_MALLOC(&copy, size ? size : 1, MWORD_SIZE);
+		if(!copy) {
+			reset();
+			return false;
+		}
+		memcpy(copy, data, size);
+		set(copy, size, alignedFree);
+		return true;
+	}
+	void reset() {
+		if(context) context->end();
+		else if(data) release(data);
+		data = nullptr;
+		size = 0;
+		release = nullptr;
+		context = nullptr;
+	}
+};
+
+static void mapSetImage(VSMap* out, const char* key, const EncodedImage& img, int append, const VSAPI* vsapi) {
+	vsapi->mapSetData(out, key, reinterpret_cast<const char*>(img.data), img.size, dtBinary, append);
+}
+
+
+/// encoded image cache
+
+static uint64_t mix64(uint64_t a, uint64_t b) {
+	unsigned __int128 product = (unsigned __int128)a * b;
+	return uint64_t(product) ^ uint64_t(product >> 64);
+}
+
+// options which affect the encoded image
+static uint64_t cacheParams(const EncodeParams& params) {
+	return uint64_t(params.format) | uint64_t(params.quality) << 8 | uint64_t(params.effort) << 16
+		| uint64_t(params.temporal) << 24 | uint64_t(params.reduce) << 25 | uint64_t(uint32_t(params.stripes)) << 32;
+}
+
+// bump whenever a change to the encoders alters the images they produce, so that a cache_dir written by an earlier
+// build isn't used
+static const uint64_t ENCODER_VERSION = 1;
+
+// the disk cache outlives the process, so its key also covers the encoder version, and the version of the library
+// doing the encoding (TurboJPEG has no way to query this at runtime, so for JPEG, it's the version built against)
+static ImageCacheKey diskCacheKey(const ImageCacheKey& key, ImgFormat format) {
+	uint64_t version = ENCODER_VERSION;
+#ifdef HAVE_JPEG
+	if(format == IMGFMT_JPEG)
+		version |= uint64_t(LIBJPEG_TURBO_VERSION_NUMBER) << 32;
+#endif
+#ifdef HAVE_WEBP
+	if(format == IMGFMT_WEBP || format == IMGFMT_WEBP_VP8)
+		version |= uint64_t(WebPGetEncoderVersion()) << 32;
+#endif
+#if !defined(HAVE_JPEG) && !defined(HAVE_WEBP)
+	(void)format;
+#endif
+	ImageCacheKey diskKey = key;
+	diskKey.params = mix64(key.params ^ 0x9e3779b97f4a7c15ULL, version ^ 0xc2b2ae3d27d4eb4fULL);
+	return diskKey;
+}
+
+// 128-bit hash of a frame (+ optional alpha), covering its dimensions and format as well as the pixels; `params` is
+// left for the caller to fill in with cacheParams, so that one hash can serve several encodes of the frame
+static ImageCacheKey frameCacheKey(const VSFrame* frame, const VSFrame* alpha, const VSAPI* vsapi) {
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
+	int width = vsapi->getFrameWidth(frame, 0);
+	int height = vsapi->getFrameHeight(frame, 0);
+	uint64_t state[8] = {
+		uint64_t(width), uint64_t(height),
+		uint64_t(fi->colorFamily) << 24 | fi->bitsPerSample << 16 | fi->subSamplingW << 8 | fi->subSamplingH,
+		alpha ? 1u : 0u, 0, 0, 0, 0
+	};
+	for(int p=0; p<fi->numPlanes; p++) {
+		int planeWidth = p ? width >> fi->subSamplingW : width;
+		int planeHeight = p ? height >> fi->subSamplingH : height;
+		kernels->hashRows(state, vsapi->getReadPtr(frame, p), vsapi->getStride(frame, p), size_t(planeWidth) * fi->bytesPerSample, planeHeight);
+	}
+	if(alpha)
+		kernels->hashRows(state, vsapi->getReadPtr(alpha, 0), vsapi->getStride(alpha, 0), size_t(width) * fi->bytesPerSample, height);
 	
+	// fold the lanes down to two 64-bit halves, with different constants for each
+	ImageCacheKey key;
+	for(int h=0; h<2; h++) {
+		uint64_t k = h ? 0xc2b2ae3d27d4eb4fULL : 0x165667b19e3779f9ULL;
+		uint64_t v = mix64(state[0] ^ k, state[1] ^ (k*3)) + mix64(state[2] ^ (k*5), state[3] ^ (k*7))
+			+ mix64(state[4] ^ (k*9), state[5] ^ (k*11)) + mix64(state[6] ^ (k*13), state[7] ^ (k*15));
+		v ^= v >> 37;
+		v *= 0x165667919e3779f9ULL;
+		key.content[h] = v ^ (v >> 32);
+	}
+	key.params = 0;
+	return key;
+}
+
+
+/// frame encoder
+
+// a frame of an animation, which only covers the part of the frame that changed since the previous one
+struct AnimationFrame {
+	int left, top, width, height;
+	FPNGEAnimationFrame apng; // PNG: written as this APNG frame, rather than a standalone PNG
+};
+
+// 8-bit RGB(A) frame interleaved ahead of time, so that encoding it to several formats only converts it once
+struct InterleavedFrame {
+	const uint8_t* data;
+	unsigned stride;
+	size_t rowSize; // bytes of pixel data in each row
+};
+
+static void interleavedRowCallback(void* opaque, size_t y, unsigned char* dst) {
+	const InterleavedFrame* frame = static_cast<const InterleavedFrame*>(opaque);
+	memcpy(dst, frame->data + y*frame->stride, frame->rowSize);
+}
+
+// read pointer to the top left of `anim`'s region of a plane, or of the whole plane if there's no `anim`
+static const uint8_t* regionReadPtr(const VSFrame* frame, int plane, const AnimationFrame* anim, const VSAPI* vsapi) {
+	const uint8_t* ptr = vsapi->getReadPtr(frame, plane);
+	if(!anim) return ptr;
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
+	int top = plane ? anim->top >> fi->subSamplingH : anim->top;
+	int left = plane ? anim->left >> fi->subSamplingW : anim->left;
+	return ptr + ptrdiff_t(top) * vsapi->getStride(frame, plane) + left * fi->bytesPerSample;
+}
+
+static PlanarSource getPlanes(const VSFrame* frame, const VSFrame* alpha, const AnimationFrame* anim, const VSAPI* vsapi) {
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
+	PlanarSource src;
+	src.numChannels = 0;
+	for(int p=0; p<fi->numPlanes; p++) {
+		src.planes[src.numChannels] = regionReadPtr(frame, p, anim, vsapi);
+		src.strides[src.numChannels++] = vsapi->getStride(frame, p);
+	}
 	if(alpha) {
-		strideA = vsapi->getStride(alpha, 0);
-		a = vsapi->getReadPtr(alpha, 0);
+		src.planes[src.numChannels] = regionReadPtr(alpha, 0, anim, vsapi);
+		src.strides[src.numChannels++] = vsapi->getStride(alpha, 0);
+	}
+	src.bytesPerSample = fi->bytesPerSample;
+	src.bitsPerSample = fi->bitsPerSample;
+	src.width = anim ? anim->width : vsapi->getFrameWidth(frame, 0);
+	src.height = anim ? anim->height : vsapi->getFrameHeight(frame, 0);
+	return src;
+}
+
+#if defined(HAVE_JPEG) || defined(HAVE_WEBP)
+// number of bands to split `height` rows of `bytesPerRow` each into for the shared thread pool; 1 if there isn't
+// enough data for splitting to be worthwhile
+static int numRowBands(int height, size_t bytesPerRow) {
+	const size_t minParallelSize = 1024 * 1024; // below this, the overhead of handing out work isn't worth it
+	const size_t minBandSize = 256 * 1024;
+	size_t totalSize = bytesPerRow * height;
+	if(totalSize < minParallelSize) return 1;
+	return std::max(1, std::min<int>({int(ThreadPool::global().size()), int(totalSize / minBandSize), height}));
+}
+
+// calls fn(yBegin, yEnd) over bands of rows covering [0, height), splitting across the shared thread pool if there's
+// enough data for it to be worthwhile
+// used for the planar -> interleaved passes, which are largely limited by memory bandwidth, which a single core
+// usually can't saturate
+static void forEachRowBand(int height, size_t bytesPerRow, const std::function<void(int, int)>& fn) {
+	int bands = numRowBands(height, bytesPerRow);
+	if(bands <= 1) {
+		fn(0, height);
+		return;
 	}
-	if(numChannels >= 3) {
-		strideG = vsapi->getStride(frame, 1);
-		g = vsapi->getReadPtr(frame, 1);
-		strideB = vsapi->getStride(frame, 2);
-		b = vsapi->getReadPtr(frame, 2);
+	int bandRows = (height + bands-1) / bands;
+	ThreadPool::global().parallelFor((height + bandRows-1) / bandRows, 0, [&](size_t i) {
+		int y = i * bandRows;
+		fn(y, std::min(y + bandRows, height));
+	});
+}
+
+// row stride of `src` once interleaved, padded to keep rows aligned
+static unsigned interleavedStride(const PlanarSource& src) {
+	unsigned stride = src.width * src.bytesPerSample * src.numChannels;
+	return (stride + MWORD_SIZE-1) / MWORD_SIZE * MWORD_SIZE;
+}
+
+static void interleavePlanes(const PlanarSource& src, uint8_t* data, unsigned stride) {
+	forEachRowBand(src.height, stride, [&](int yBegin, int yEnd) {
+		for(int y=yBegin; y<yEnd; y++)
+			kernels->interleaveRow(src, y, data + y*stride);
+	});
+}
+
+// interleaves the planes of `frame` (+ optional `alpha`) into the context's buffer, unless `shared` already holds them
+static const uint8_t* interleaveFrame(EncoderContext& ctx, const VSFrame* frame, const VSFrame* alpha, const AnimationFrame* anim, const InterleavedFrame* shared, unsigned& stride, std::string& error, const VSAPI* vsapi) {
+	if(shared) {
+		stride = shared->stride;
+		return shared->data;
 	}
+	PlanarSource src = getPlanes(frame, alpha, anim, vsapi);
+	stride = interleavedStride(src);
+	uint8_t* data = ctx.interleaved.get(stride * src.height);
 	
-	// NOTE: only PNG supports 16b samples, and that must be in big-endian
-	if(numChannels == 1) {
-		if(fi->bytesPerSample == 1) {
-			// straight copy
-			vsh::bitblt(data, stride, r, strideR, width, height);
-		} else {
-			// upsample / endian swap
-			for(int y=0; y<height; y++)
-				copy1x16b(data + y*stride, r + y*strideR, width, fi->bitsPerSample, true);
-		}
-	} else if(numChannels == 2) {
-		if(fi->bytesPerSample == 1) {
-			for(int y=0; y<height; y++)
-				interleave2x8b(data + y*stride, r + y*strideR, a + y*strideA, width);
-		} else {
-			for(int y=0; y<height; y++)
-				interleave2x16b(data + y*stride, r + y*strideR, a + y*strideA, width, fi->bitsPerSample, true);
-		}
-	} else if(numChannels == 3) {
-		if(fi->bytesPerSample == 1) {
-			for(int y=0; y<height; y++)
-				interleave3x8b(data + y*stride, r + y*strideR, g + y*strideG, b + y*strideB, width);
-		} else {
-			for(int y=0; y<height; y++)
-				interleave3x16b(data + y*stride, r + y*strideR, g + y*strideG, b + y*strideB, width, fi->bitsPerSample, true);
-		}
-	} else { // numChannels == 4
-		if(fi->bytesPerSample == 1) {
-			for(int y=0; y<height; y++)
-				interleave4x8b(data + y*stride, r + y*strideR, g + y*strideG, b + y*strideB, a + y*strideA, width);
-		} else {
-			for(int y=0; y<height; y++)
-				interleave4x16b(data + y*stride, r + y*strideR, g + y*strideG, b + y*strideB, a + y*strideA, width, fi->bitsPerSample, true);
+	if(!data) {
+		error = "Failed to allocate intermediary buffer";
+		return nullptr;
+	}
+	interleavePlanes(src, data, stride);
+	return data;
+}
+#endif
+
+// runs fpnge's stripes on the shared thread pool
+static void poolParallelFor(void*, size_t count, void (*fn)(void* arg, size_t i), void* arg) {
+	ThreadPool::global().parallelFor(count, 0, [=](size_t i) {
+		fn(arg, i);
+	});
+}
+
+// number of horizontal stripes to split an image into, for formats which can encode them in parallel
+static int numStripes(const EncodeParams& params, int height) {
+	// splitting costs a little in size, and has some overhead, so only do it automatically for frames large enough
+	// to amortise it
+	const int minStripeRows = 64;
+	int stripes = params.stripes;
+	if(stripes == 0)
+		stripes = std::min<int>(ThreadPool::global().size(), height / minStripeRows);
+	return std::max(1, std::min(stripes, height));
+}
+
+#ifdef HAVE_JPEG
+// locates the SOF and SOS markers of a baseline JPEG produced by TurboJPEG, along with the entropy-coded data, which
+// follows the SOS header and runs up to the EOI marker at the end
+static bool jpegFindScan(const uint8_t* data, size_t size, size_t& sofPos, size_t& sosPos, size_t& scanPos) {
+	if(size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+	size_t pos = 2;
+	sofPos = 0;
+	while(pos + 4 <= size) {
+		if(data[pos] != 0xFF) return false;
+		uint8_t marker = data[pos+1];
+		size_t len = (data[pos+2] << 8) | data[pos+3];
+		if(marker == 0xC0) sofPos = pos;
+		if(marker == 0xDA) {
+			sosPos = pos;
+			scanPos = pos + 2 + len;
+			return sofPos && scanPos + 2 <= size;
 		}
+		pos += 2 + len;
+	}
+	return false;
+}
+
+// compresses with the encoder's buffer, which TurboJPEG grows if the image doesn't fit, so that memory use follows
+// the compressed size, rather than tjBufSize's worst case
+typedef std::function<int(tjhandle handle, int y, int rows, uint8_t*& out, unsigned long& size)> JpegCompressFn;
+
+static bool jpegCompress(EncoderContext::JpegEncoder& enc, const JpegCompressFn& compress, int y, int rows, unsigned long& size) {
+	size = enc.size;
+	if(compress(enc.handle, y, rows, enc.buffer, size)) {
+		// if the buffer was grown before failing, the old one has already been freed, and the new one isn't returned,
+		// so the pointer can't be trusted any more; forgetting it leaks at most one buffer on an unusual failure
+		enc.buffer = nullptr;
+		enc.size = 0;
+		return false;
 	}
+	// TurboJPEG may have grown the buffer, but doesn't report its size; it's at least as large as the output
+	enc.size = std::max(enc.size, size);
+	return true;
+}
+
+// encodes bands of `bandMcuRows` MCU rows each as separate JPEGs in parallel, then joins them into one, with a
+// restart marker between each band
+// this relies on each band using the same (default) quantisation and Huffman tables, and the DC predictors being
+// reset at a restart, as they are at the start of each band's scan
+static bool encodeJpegBands(EncoderContext& ctx, int width, int height, int subsamp, int bandMcuRows, const JpegCompressFn& compress, uint8_t*& encData, size_t& encSize, std::string& error) {
+	int bandHeight = bandMcuRows * tjMCUHeight[subsamp];
+	int mcusPerRow = (width + tjMCUWidth[subsamp]-1) / tjMCUWidth[subsamp];
+	int bands = (height + bandHeight-1) / bandHeight;
 	
-	vsapi->freeFrame(frame);
-	if(alpha) vsapi->freeFrame(alpha);
+	if(!ctx.reserveJpegEncoders(bands)) {
+		error = "Failed to allocate libjpeg handle";
+		return false;
+	}
 	
+	std::vector<unsigned long> bandSizes(bands);
+	std::vector<std::string> bandErrors(bands);
+	ThreadPool::global().parallelFor(bands, 0, [&](size_t i) {
+		int y = i * bandHeight;
+		if(!jpegCompress(ctx.jpeg[i], compress, y, std::min(bandHeight, height - y), bandSizes[i]))
+			bandErrors[i] = std::string("libjpeg compress error: ") + tjGetErrorStr2(ctx.jpeg[i].handle);
+	});
+	for(const auto& bandError : bandErrors) {
+		if(!bandError.empty()) {
+			error = bandError;
+			return false;
+		}
+	}
 	
-	/// encode to image format
-	uint8_t* encData;
-	size_t encSize;
+	// use the first band's headers, with the height fixed up, and a restart interval added
+	const uint8_t* firstBand = ctx.jpeg[0].buffer;
+	size_t sofPos, sosPos, scanPos;
+	if(!jpegFindScan(firstBand, bandSizes[0], sofPos, sosPos, scanPos)) {
+		error = "Failed to parse JPEG band";
+		return false;
+	}
+	size_t totalSize = bandSizes[0] + 6;
+	for(int i=1; i<bands; i++)
+		totalSize += bandSizes[i]; // includes more than enough space for the RSTn markers
+	encData = ctx.output.get(totalSize);
+	if(!encData) {
+		error = "Failed to allocate output buffer";
+		return false;
+	}
 	
-	if(imgFormat == "JPEG") {
-#ifdef HAVE_JPEG
-		// TODO: support subsampling option
-		int subsamp = isGray ? TJSAMP_GRAY : TJSAMP_420;
-		encSize = tjBufSize(width, height, subsamp);
-		VSH_ALIGNED_MALLOC(&encData, encSize, MWORD_SIZE);
-		if(!encData) {
-			VSH_ALIGNED_FREE(data);
-			vsapi->mapSetError(out, "EncodeFrame: Failed to allocate output buffer");
-			return;
-		}
-		
-		tjhandle handle = tjInitCompress();
-		if(!handle) {
-			VSH_ALIGNED_FREE(data);
-			vsapi->mapSetError(out, "EncodeFrame: Failed to allocate libjpeg handle");
-			return;
+	uint8_t* p = encData;
+	memcpy(p, firstBand, sosPos);
+	p[sofPos + 5] = height >> 8;
+	p[sofPos + 6] = height & 0xFF;
+	p += sosPos;
+	int restartInterval = bandMcuRows * mcusPerRow;
+	const uint8_t dri[] = { 0xFF, 0xDD, 0x00, 0x04, uint8_t(restartInterval >> 8), uint8_t(restartInterval & 0xFF) };
+	memcpy(p, dri, sizeof(dri));
+	p += sizeof(dri);
+	memcpy(p, firstBand + sosPos, bandSizes[0] - 2 - sosPos); // SOS + first band's data, less EOI
+	p += bandSizes[0] - 2 - sosPos;
+	
+	for(int i=1; i<bands; i++) {
+		const uint8_t* band = ctx.jpeg[i].buffer;
+		size_t bandSofPos, bandSosPos, bandScanPos;
+		if(!jpegFindScan(band, bandSizes[i], bandSofPos, bandSosPos, bandScanPos)) {
+			error = "Failed to parse JPEG band";
+			return false;
 		}
-		if(tjCompress2(handle, data, width, stride, height, isGray ? TJPF_GRAY : TJPF_RGB, &encData, &encSize, subsamp, quality, TJFLAG_FASTDCT)) {
-			vsapi->mapSetError(out, (std::string("EncodeFrame: libjpeg compress error: ") + tjGetErrorStr()).c_str());
-			tjDestroy(handle);
-			VSH_ALIGNED_FREE(data);
-			return;
+		*p++ = 0xFF;
+		*p++ = 0xD0 + ((i-1) & 7); // RSTn
+		memcpy(p, band + bandScanPos, bandSizes[i] - 2 - bandScanPos);
+		p += bandSizes[i] - 2 - bandScanPos;
+	}
+	*p++ = 0xFF;
+	*p++ = 0xD9; // EOI
+	encSize = p - encData;
+	return true;
+}
+
+static bool encodeJpeg(EncoderContext& ctx, const VSFrame* frame, const InterleavedFrame* interleaved, const EncodeParams& params, uint8_t*& encData, size_t& encSize, std::string& error, const VSAPI* vsapi) {
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
+	int width = vsapi->getFrameWidth(frame, 0);
+	int height = vsapi->getFrameHeight(frame, 0);
+	const int flags = TJFLAG_FASTDCT;
+	
+	// compresses rows [y, y+rows) into a standalone JPEG
+	JpegCompressFn compress;
+	int subsamp;
+	const uint8_t* planes[3];
+	int strides[3];
+	const uint8_t* data;
+	unsigned stride;
+	if(fi->colorFamily == cfYUV) {
+		// pass planes straight through, with the subsampling they already have
+		subsamp = fi->subSamplingW == 0 ? TJSAMP_444 : (fi->subSamplingH == 0 ? TJSAMP_422 : TJSAMP_420);
+		for(int p=0; p<3; p++) {
+			planes[p] = vsapi->getReadPtr(frame, p);
+			strides[p] = vsapi->getStride(frame, p);
 		}
-		tjDestroy(handle);
+		compress = [&](tjhandle handle, int y, int rows, uint8_t*& out, unsigned long& size) {
+			int cy = y >> fi->subSamplingH;
+			const uint8_t* bandPlanes[3] = { planes[0] + y*strides[0], planes[1] + cy*strides[1], planes[2] + cy*strides[2] };
+			return tjCompressFromYUVPlanes(handle, bandPlanes, width, strides, rows, subsamp, &out, &size, params.quality, flags);
+		};
+	} else {
+		bool isGray = fi->colorFamily == cfGray;
+		// TODO: support subsampling option
+		subsamp = isGray ? TJSAMP_GRAY : TJSAMP_420;
+		data = interleaveFrame(ctx, frame, nullptr, nullptr, interleaved, stride, error, vsapi);
+		if(!data) return false;
+		compress = [&, isGray](tjhandle handle, int y, int rows, uint8_t*& out, unsigned long& size) {
+			return tjCompress2(handle, data + y*stride, width, stride, rows, isGray ? TJPF_GRAY : TJPF_RGB, &out, &size, subsamp, params.quality, flags);
+		};
+	}
+	
+	// split into bands of whole MCU rows; the restart interval is a 16-bit MCU count, which limits how tall a band can
+	// be
+	// bands only add a restart marker each, and decode to the same pixels, so unlike PNG stripes, are used
+	// automatically (stripes=0) by default, once the frame is as large as the other parallel passes require
+	int mcuRows = (height + tjMCUHeight[subsamp]-1) / tjMCUHeight[subsamp];
+	int mcusPerRow = (width + tjMCUWidth[subsamp]-1) / tjMCUWidth[subsamp];
+	int bands;
+	if(params.stripes == 0) {
+		size_t bytesPerRow = fi->colorFamily == cfYUV
+			? width + 2 * ((width >> fi->subSamplingW) >> fi->subSamplingH)
+			: size_t(width) * fi->numPlanes;
+		bands = numRowBands(height, bytesPerRow);
+	} else
+		bands = numStripes(params, height);
+	bands = std::min(bands, mcuRows);
+	if(bands > 1 && mcusPerRow <= 65535) {
+		int bandMcuRows = std::min((mcuRows + bands-1) / bands, 65535 / mcusPerRow);
+		return encodeJpegBands(ctx, width, height, subsamp, bandMcuRows, compress, encData, encSize, error);
+	}
+	
+	if(!ctx.reserveJpegEncoders(1)) {
+		error = "Failed to allocate libjpeg handle";
+		return false;
+	}
+	// the output is left in the encoder's buffer, which is borrowed, like the context's other buffers
+	unsigned long jpegSize;
+	if(!jpegCompress(ctx.jpeg[0], compress, 0, height, jpegSize)) {
+		error = std::string("libjpeg compress error: ") + tjGetErrorStr2(ctx.jpeg[0].handle);
+		return false;
+	}
+	encData = ctx.jpeg[0].buffer;
+	encSize = jpegSize;
+	return true;
+}
 #endif
-	} else if(imgFormat == "WEBP" || imgFormat == "WEBP-VP8") {
+
 #ifdef HAVE_WEBP
-		WebPConfig config;
-		WebPPicture pic;
-		if(!WebPConfigPreset(&config, WEBP_PRESET_DEFAULT, quality) ||
-		   !WebPPictureInit(&pic)) {
-			VSH_ALIGNED_FREE(data);
-			vsapi->mapSetError(out, "EncodeFrame: Failed to initialize WebP");
-			return;
+// WebP writer which appends to the context's output buffer
+struct WebPScratchWriter {
+	ScratchBuffer* buffer;
+	size_t size;
+};
+static int webpScratchWrite(const uint8_t* data, size_t dataSize, const WebPPicture* pic) {
+	WebPScratchWriter* wrt = static_cast<WebPScratchWriter*>(pic->custom_ptr);
+	if(!wrt->buffer->grow(wrt->size + dataSize, wrt->size)) return 0;
+	memcpy(wrt->buffer->data() + wrt->size, data, dataSize);
+	wrt->size += dataSize;
+	return 1;
+}
+
+static std::string webpErrorString(WebPEncodingError code) {
+	switch(code) {
+		case VP8_ENC_ERROR_OUT_OF_MEMORY:
+			return "memory error allocating objects";
+		case VP8_ENC_ERROR_BITSTREAM_OUT_OF_MEMORY:
+			return "memory error while flushing bits";
+		case VP8_ENC_ERROR_NULL_PARAMETER:
+			return "a pointer parameter is NULL";
+		case VP8_ENC_ERROR_INVALID_CONFIGURATION:
+			return "configuration is invalid";
+		case VP8_ENC_ERROR_BAD_DIMENSION:
+			return "picture has invalid width/height";
+		case VP8_ENC_ERROR_PARTITION0_OVERFLOW:
+			return "partition is bigger than 512k";
+		case VP8_ENC_ERROR_PARTITION_OVERFLOW:
+			return "partition is bigger than 16M";
+		case VP8_ENC_ERROR_BAD_WRITE:
+			return "error while flushing bytes";
+		case VP8_ENC_ERROR_FILE_TOO_BIG:
+			return "file is bigger than 4G";
+		case VP8_ENC_ERROR_USER_ABORT:
+			return "abort request by user";
+		default:
+			return "unknown code (" + std::to_string(code) + ")";
+	}
+}
+
+// packs 8-bit planar RGB(A) into the ARGB words WebP uses internally
+static bool encodeWebP(EncoderContext& ctx, const VSFrame* frame, const VSFrame* alpha, const AnimationFrame* anim, const InterleavedFrame* interleaved, const EncodeParams& params, uint8_t*& encData, size_t& encSize, std::string& error, const VSAPI* vsapi) {
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
+	int width = anim ? anim->width : vsapi->getFrameWidth(frame, 0);
+	int height = anim ? anim->height : vsapi->getFrameHeight(frame, 0);
+	
+	WebPPicture pic;
+	if(!WebPPictureInit(&pic)) {
+		error = "Failed to initialize WebP";
+		return false;
+	}
+	pic.width = width;
+	pic.height = height;
+	
+	if(params.format == IMGFMT_WEBP) {
+		// lossless encoding works on ARGB, so supply that directly; this avoids libwebp allocating the picture, as well
+		// as a lossy round-trip through YUV
+		int argbStride = (width + 15) & ~15;
+		uint32_t* argb = reinterpret_cast<uint32_t*>(ctx.webpInput.get(size_t(argbStride) * height * 4));
+		if(!argb) {
+			error = "Failed to allocate intermediary buffer";
+			return false;
 		}
-		config.lossless = (imgFormat == "WEBP" ? 1 : 0);
-		config.method = effort;
-		// TODO: support other options?
+		const uint8_t* r = regionReadPtr(frame, 0, anim, vsapi);
+		const uint8_t* g = regionReadPtr(frame, 1, anim, vsapi);
+		const uint8_t* b = regionReadPtr(frame, 2, anim, vsapi);
+		const uint8_t* a = alpha ? regionReadPtr(alpha, 0, anim, vsapi) : nullptr;
+		ptrdiff_t strideR = vsapi->getStride(frame, 0);
+		ptrdiff_t strideG = vsapi->getStride(frame, 1);
+		ptrdiff_t strideB = vsapi->getStride(frame, 2);
+		ptrdiff_t strideA = alpha ? vsapi->getStride(alpha, 0) : 0;
+		forEachRowBand(height, argbStride * 4, [&](int yBegin, int yEnd) {
+			for(int y=yBegin; y<yEnd; y++)
+				kernels->packARGB(argb + y*argbStride, r + y*strideR, g + y*strideG, b + y*strideB, a ? a + y*strideA : nullptr, width);
+		});
 		
-		if(!WebPValidateConfig(&config)) {
-			VSH_ALIGNED_FREE(data);
-			vsapi->mapSetError(out, "EncodeFrame: Invalid WebP configuration");
-			return;
+		pic.use_argb = 1;
+		pic.argb = argb;
+		pic.argb_stride = argbStride;
+	} else if(fi->colorFamily != cfRGB) {
+		// lossy encoding works on YUV 4:2:0, so supply that directly, rather than having libwebp convert from RGB
+		int uvWidth = (width+1) >> 1;
+		int uvHeight = (height+1) >> 1;
+		pic.use_argb = 0;
+		pic.colorspace = alpha ? WEBP_YUV420A : WEBP_YUV420;
+		if(alpha) {
+			// libwebp doesn't modify the alpha plane, so it can be referenced
+			pic.a = const_cast<uint8_t*>(regionReadPtr(alpha, 0, anim, vsapi));
+			pic.a_stride = vsapi->getStride(alpha, 0);
 		}
 		
-		// TODO: support YUV input?
-		pic.width = width;
-		pic.height = height;
+		// with alpha, libwebp modifies the colour of transparent areas, so the frame can't be referenced then
+		if(fi->colorFamily == cfYUV && !alpha) {
+			pic.y = const_cast<uint8_t*>(regionReadPtr(frame, 0, anim, vsapi));
+			pic.u = const_cast<uint8_t*>(regionReadPtr(frame, 1, anim, vsapi));
+			pic.v = const_cast<uint8_t*>(regionReadPtr(frame, 2, anim, vsapi));
+			pic.y_stride = vsapi->getStride(frame, 0);
+			pic.uv_stride = vsapi->getStride(frame, 1);
+		} else {
+			int yStride = (width + MWORD_SIZE-1) & ~(MWORD_SIZE-1);
+			int uvStride = (uvWidth + MWORD_SIZE-1) & ~(MWORD_SIZE-1);
+			uint8_t* yuv = ctx.webpInput.get(size_t(yStride) * height + size_t(uvStride) * uvHeight * 2);
+			if(!yuv) {
+				error = "Failed to allocate intermediary buffer";
+				return false;
+			}
+			pic.y = yuv;
+			pic.u = yuv + size_t(yStride) * height;
+			pic.v = pic.u + size_t(uvStride) * uvHeight;
+			pic.y_stride = yStride;
+			pic.uv_stride = uvStride;
+			
+			const uint8_t* srcY = regionReadPtr(frame, 0, anim, vsapi);
+			ptrdiff_t srcStrideY = vsapi->getStride(frame, 0);
+			if(fi->colorFamily == cfGray) {
+				// grayscale is full range, whereas WebP's luma is limited range; chroma is neutral
+				uint8_t lut[256];
+				for(int i=0; i<256; i++)
+					lut[i] = 16 + (i*219 + 127) / 255;
+				forEachRowBand(height, width, [&](int yBegin, int yEnd) {
+					for(int y=yBegin; y<yEnd; y++)
+						for(int x=0; x<width; x++)
+							pic.y[y*yStride + x] = lut[srcY[y*srcStrideY + x]];
+				});
+				memset(pic.u, 128, size_t(uvStride) * uvHeight * 2);
+			} else {
+				vsh::bitblt(pic.y, yStride, srcY, srcStrideY, width, height);
+				vsh::bitblt(pic.u, uvStride, regionReadPtr(frame, 1, anim, vsapi), vsapi->getStride(frame, 1), uvWidth, uvHeight);
+				vsh::bitblt(pic.v, uvStride, regionReadPtr(frame, 2, anim, vsapi), vsapi->getStride(frame, 2), uvWidth, uvHeight);
+			}
+		}
+	} else {
+		unsigned stride;
+		const uint8_t* data = interleaveFrame(ctx, frame, alpha, anim, interleaved, stride, error, vsapi);
+		if(!data) return false;
 		if(!WebPPictureAlloc(&pic)) {
-			VSH_ALIGNED_FREE(data);
-			vsapi->mapSetError(out, "EncodeFrame: Failed to allocate WebP output");
-			return;
+			error = "Failed to allocate WebP output";
+			return false;
 		}
-		// TODO: consider writing directly to WebPPicture to avoid this importing business
-		if(numChannels == 3)
-			WebPPictureImportRGB(&pic, data, stride);
-		if(numChannels == 4)
+		if(alpha)
 			WebPPictureImportRGBA(&pic, data, stride);
-		VSH_ALIGNED_FREE(data);
-		
-		WebPMemoryWriter wrt;
-		WebPMemoryWriterInit(&wrt);
-		pic.writer = WebPMemoryWrite;
-		pic.custom_ptr = &wrt;
-		
-		int ok = WebPEncode(&config, &pic);
-		WebPPictureFree(&pic);
-		if(!ok) {
-			std::string error("EncodeFrame: Failed to encode WebP: ");
-			switch(pic.error_code) {
-				case VP8_ENC_ERROR_OUT_OF_MEMORY:
-					error += "memory error allocating objects"; break;
-				case VP8_ENC_ERROR_BITSTREAM_OUT_OF_MEMORY:
-					error += "memory error while flushing bits"; break;
-				case VP8_ENC_ERROR_NULL_PARAMETER:
-					error += "a pointer parameter is NULL"; break;
-				case VP8_ENC_ERROR_INVALID_CONFIGURATION:
-					error += "configuration is invalid"; break;
-				case VP8_ENC_ERROR_BAD_DIMENSION:
-					error += "picture has invalid width/height"; break;
-				case VP8_ENC_ERROR_PARTITION0_OVERFLOW:
-					error += "partition is bigger than 512k"; break;
-				case VP8_ENC_ERROR_PARTITION_OVERFLOW:
-					error += "partition is bigger than 16M"; break;
-				case VP8_ENC_ERROR_BAD_WRITE:
-					error += "error while flushing bytes"; break;
-				case VP8_ENC_ERROR_FILE_TOO_BIG:
-					error += "file is bigger than 4G"; break;
-				case VP8_ENC_ERROR_USER_ABORT:
-					error += "abort request by user"; break;
-				default:
-					error += "unknown code (" + std::to_string(pic.error_code) + ")";
-			}
-			WebPMemoryWriterClear(&wrt);
-			vsapi->mapSetError(out, error.c_str());
-			return;
-		}
-		
-		// we get the pointer, instead of allocating it ourself, so return from here and skip the PNG/JPEG path
-		vsapi->mapSetData(out, "bytes", reinterpret_cast<char*>(wrt.mem), wrt.size, dtBinary, maReplace);
-		WebPMemoryWriterClear(&wrt);
-		return;
+		else
+			WebPPictureImportRGB(&pic, data, stride);
+	}
+	
+	WebPScratchWriter wrt{&ctx.output, 0};
+	pic.writer = webpScratchWrite;
+	pic.custom_ptr = &wrt;
+	
+	int ok = WebPEncode(&params.webpConfig, &pic);
+	WebPPictureFree(&pic); // only frees memory allocated by libwebp
+	if(!ok) {
+		error = "Failed to encode WebP: " + webpErrorString(pic.error_code);
+		return false;
+	}
+	encData = ctx.output.data();
+	encSize = wrt.size;
+	return true;
+}
+#endif
+
+// lets fpnge write into a ScratchBuffer, growing it as needed, so that memory use follows the compressed size,
+// rather than the worst case
+static void* pngOutputGrow(void* opaque, size_t size, size_t used) {
+	return static_cast<ScratchBuffer*>(opaque)->grow(size, used);
+}
+static FPNGEOutput pngOutput(ScratchBuffer& buffer) {
+	FPNGEOutput output = {buffer.data(), buffer.size(), pngOutputGrow, &buffer};
+	return output;
+}
+
+// finds a smaller PNG form which holds the same pixels, and updates `src` to it:
+// - an alpha channel which is entirely opaque is dropped
+// - RGB with R=G=B everywhere becomes grayscale
+// - >8-bit samples which, shifted up to 16 bits, have equal high and low bytes (i.e. v*257) are narrowed to 8 bits
+// - 8-bit images with few enough colours become palette based, with `palette` attached to `options`, and `src`
+//   describing one plane of packed indices (so its width is in bytes, rather than pixels)
+// each check gives up at the first sample which doesn't fit, so is cheap for frames which can't be reduced
+static void reducePng(EncoderContext& ctx, PlanarSource& src, FPNGEOptions& options, uint8_t* palette) {
+	int width = src.width;
+	int height = src.height;
+	
+	if(src.numChannels == 2 || src.numChannels == 4) {
+		int a = src.numChannels-1;
+		bool opaque = true;
+		for(int y=0; y<height && opaque; y++)
+			opaque = kernels->isUniformRow(src.planes[a] + y*src.strides[a], width, src.bytesPerSample, (1 << src.bitsPerSample) - 1);
+		if(opaque)
+			src.numChannels--;
+	}
+	
+	if(src.numChannels >= 3) {
+		size_t rowSize = size_t(width) * src.bytesPerSample;
+		bool gray = true;
+		for(int y=0; y<height && gray; y++) {
+			const uint8_t* r = src.planes[0] + y*src.strides[0];
+			gray = memcmp(r, src.planes[1] + y*src.strides[1], rowSize) == 0
+				&& memcmp(r, src.planes[2] + y*src.strides[2], rowSize) == 0;
+		}
+		if(gray) {
+			if(src.numChannels == 4) {
+				src.planes[1] = src.planes[3];
+				src.strides[1] = src.strides[3];
+			}
+			src.numChannels -= 2;
+		}
+	}
+	
+	// reduced planes are stored unpadded, after a plane's worth of space for palette indices
+	size_t planeSize = size_t(width) * height;
+	uint8_t* indices = nullptr;
+	if(src.bytesPerSample == 2) {
+		bool fits = true;
+		for(int p=0; p<src.numChannels && fits; p++)
+			for(int y=0; y<height && fits; y++)
+				fits = kernels->fitsIn8Bits(src.planes[p] + y*src.strides[p], width, src.bitsPerSample);
+		if(!fits) return; // palettes are 8-bit only
+		indices = ctx.pngReduced.get(planeSize * (src.numChannels+1));
+		if(!indices) return;
+		for(int p=0; p<src.numChannels; p++) {
+			uint8_t* plane = indices + planeSize * (p+1);
+			for(int y=0; y<height; y++)
+				kernels->narrowTo8Bits(plane + y*width, src.planes[p] + y*src.strides[p], width, src.bitsPerSample);
+			src.planes[p] = plane;
+			src.strides[p] = width;
+		}
+		src.bytesPerSample = 1;
+		src.bitsPerSample = 8;
+	}
+	
+	// grayscale only gains from a palette if it allows packing several pixels into a byte
+	int maxColours = src.numChannels == 1 ? 16 : 256;
+	if(!indices) indices = ctx.pngReduced.get(planeSize);
+	size_t keysStride = (size_t(width) + MWORD_SIZE-1) / MWORD_SIZE * MWORD_SIZE; // keeps the second row aligned
+	uint32_t* rowKeys = reinterpret_cast<uint32_t*>(ctx.interleaved.get(keysStride * 8));
+	if(!indices || !rowKeys) return;
+	
+	// colours are looked up as packARGB values in an open addressing hash table, at most half full
+	uint32_t colours[256];
+	int16_t slots[512];
+	memset(slots, -1, sizeof(slots));
+	int numColours = 0;
+	uint32_t lastKey = 0;
+	int lastIndex = -1;
+	for(int y=0; y<height; y++) {
+		const uint8_t* p0 = src.planes[0] + y*src.strides[0];
+		const uint8_t* p1 = src.numChannels > 1 ? src.planes[1] + y*src.strides[1] : nullptr;
+		// alternate between two rows of keys, to compare against the previous row
+		uint32_t* keys = rowKeys + (y & 1) * keysStride;
+		if(src.numChannels <= 2)
+			kernels->packARGB(keys, p0, p0, p0, p1, width);
+		else
+			kernels->packARGB(keys, p0, p1, src.planes[2] + y*src.strides[2], src.numChannels > 3 ? src.planes[3] + y*src.strides[3] : nullptr, width);
+		
+		const uint32_t* prevKeys = rowKeys + ((y-1) & 1) * keysStride;
+		uint8_t* row = indices + size_t(y)*width;
+		for(int x=0; x<width; ) {
+			uint32_t key = keys[x];
+			// flat content mostly repeats the row above, so copy its indices where it does
+			if(y > 0 && key == prevKeys[x] && x+1 < width && keys[x+1] == prevKeys[x+1]) {
+				int run = 2 + kernels->matchLength32(keys + x+2, prevKeys + x+2, width - (x+2));
+				memcpy(row + x, row - width + x, run);
+				x += run;
+				continue;
+			}
+			if(key != lastKey || lastIndex < 0) {
+				unsigned slot = (key * 0x9E3779B1u) >> 23;
+				while(slots[slot] >= 0 && colours[slots[slot]] != key)
+					slot = (slot+1) & 511;
+				if(slots[slot] < 0) {
+					if(numColours == maxColours) return;
+					colours[numColours] = key;
+					slots[slot] = numColours++;
+				}
+				lastKey = key;
+				lastIndex = slots[slot];
+			}
+			// fill runs of the same colour at once, only checking the next pixel inline for busier content
+			int run = 1;
+			if(x+1 < width && keys[x+1] == key)
+				run = 2 + kernels->runLength32(keys + x+2, width - (x+2), key);
+			memset(row + x, lastIndex, run);
+			x += run;
+		}
+	}
+	
+	for(int i=0; i<numColours; i++) {
+		palette[i*4 +0] = colours[i] >> 16;
+		palette[i*4 +1] = colours[i] >> 8;
+		palette[i*4 +2] = colours[i];
+		palette[i*4 +3] = colours[i] >> 24;
+	}
+	options.palette = palette;
+	options.num_palette = numColours;
+	
+	// pack small indices in place, leftmost pixel in the most significant bits
+	int depth = FPNGEPaletteBitDepth(numColours);
+	int rowBytes = FPNGERowBytes(1, 1, width, &options);
+	if(depth < 8)
+		for(int y=0; y<height; y++)
+			kernels->packIndices(indices + size_t(y)*rowBytes, indices + size_t(y)*width, width, depth);
+	src.planes[0] = indices;
+	src.strides[0] = rowBytes;
+	src.numChannels = 1;
+	src.width = rowBytes;
+}
+
+static bool encodePng(EncoderContext& ctx, const VSFrame* frame, const VSFrame* alpha, const AnimationFrame* anim, const InterleavedFrame* interleaved, const EncodeParams& params, uint8_t*& encData, size_t& encSize, std::string& error, const VSAPI* vsapi) {
+	PlanarSource src = getPlanes(frame, alpha, anim, vsapi);
+	int width = src.width; // in pixels, whereas a palette reduction sets src.width to bytes
+	
+	int stripes = numStripes(params, src.height);
+	FPNGEOutput output = pngOutput(ctx.output);
+	FPNGEOptions options = params.pngOptions;
+	uint8_t palette[256 * 4];
+	// every frame of an animation has to share the same pixel format, so can't be reduced individually
+	if(anim)
+		options.animation_frame = &anim->apng;
+	else if(params.reduce) {
+		int numChannels = src.numChannels;
+		reducePng(ctx, src, options, palette);
+		// a reduced image no longer matches the interleaved frame
+		if(src.numChannels != numChannels || options.palette)
+			interleaved = nullptr;
+	}
+	// encode with a copy of the sequence's history, so that other frames of it can be encoded at the same time
+	PngHistory* history = params.temporal ? params.history : nullptr;
+	if(history) {
+		{
+			std::lock_guard<std::mutex> lk(history->mutex);
+			ctx.pngHistory = history->stripes;
+		}
+		if(ctx.pngHistory.size() < size_t(stripes))
+			ctx.pngHistory.resize(stripes);
+		options.history = ctx.pngHistory.data();
+		options.num_history = ctx.pngHistory.size();
+	}
+	
+	if(stripes > 1) {
+		void* scratch = ctx.pngScratch.get(FPNGEParallelScratchSize(src.bytesPerSample, src.numChannels, width, src.height, stripes));
+		if(!scratch) {
+			error = "Failed to allocate intermediary buffer";
+			return false;
+		}
+		while(ctx.pngStripes.size() < size_t(stripes-1))
+			ctx.pngStripes.emplace_back();
+		std::vector<FPNGEOutput> stripeOutputs;
+		stripeOutputs.reserve(stripes-1);
+		for(int i=0; i<stripes-1; i++)
+			stripeOutputs.push_back(pngOutput(ctx.pngStripes[i]));
+		if(interleaved)
+			encSize = FPNGEEncodeRowsParallel(src.bytesPerSample, src.numChannels, interleavedRowCallback, const_cast<InterleavedFrame*>(interleaved), width, src.height, &output, &options, stripes, poolParallelFor, nullptr, stripeOutputs.data(), scratch);
+		else
+			encSize = FPNGEEncodeRowsParallel(src.bytesPerSample, src.numChannels, interleaveRowCallback, &src, width, src.height, &output, &options, stripes, poolParallelFor, nullptr, stripeOutputs.data(), scratch);
+	} else {
+		void* scratch = ctx.pngScratch.get(FPNGEScratchSize(src.bytesPerSample, src.numChannels, width));
+		if(!scratch) {
+			error = "Failed to allocate intermediary buffer";
+			return false;
+		}
+		// fpnge copies each row into its own buffer before encoding, so rather than interleaving the whole frame
+		// beforehand, interleave directly into that buffer; 8-bit grayscale (or palette indices) needs no conversion,
+		// so fpnge copies its rows straight from the plane
+		if(interleaved)
+			encSize = FPNGEEncodeWithScratch(1, src.numChannels, interleaved->data, width, interleaved->stride, src.height, &output, &options, scratch);
+		else if(src.numChannels == 1 && src.bytesPerSample == 1)
+			encSize = FPNGEEncodeWithScratch(1, 1, src.planes[0], width, src.strides[0], src.height, &output, &options, scratch);
+		else
+			encSize = FPNGEEncodeRows(src.bytesPerSample, src.numChannels, interleaveRowCallback, &src, width, src.height, &output, &options, scratch);
+	}
+	if(!encSize) {
+		error = "Failed to allocate output buffer";
+		return false;
+	}
+	if(history) {
+		std::lock_guard<std::mutex> lk(history->mutex);
+		history->stripes = ctx.pngHistory;
+	}
+	encData = static_cast<uint8_t*>(output.data);
+	return true;
+}
+
+// encodes `frame` (+ optional `alpha`) into `result`; if `anim` is given, only its region is encoded, as a frame of an
+// animation; if `interleaved` is given, it holds the frame already interleaved
+// frames are not freed by this function; safe to call from any thread
+// `result` borrows memory from the calling thread's context, so must be reset (or made owned) before the thread
+// encodes anything else
+// `content`, if supplied, is the frame's frameCacheKey, where the caller has already computed it
+static bool encodeImage(const VSFrame* frame, const VSFrame* alpha, const EncodeParams& params, EncodedImage& result, std::string& error, const VSAPI* vsapi, const AnimationFrame* anim = nullptr, const InterleavedFrame* interleaved = nullptr, const ImageCacheKey* content = nullptr) {
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
+	int width = vsapi->getFrameWidth(frame, 0);
+	int height = vsapi->getFrameHeight(frame, 0);
+	
+	if(!kernels) {
+		error = "EncodeFrame requires a CPU with SSE4.1 support";
+		return false;
+	}
+	if(!checkFormat(fi, width, height,
+		alpha ? vsapi->getVideoFrameFormat(alpha) : nullptr,
+		alpha ? vsapi->getFrameWidth(alpha, 0) : 0,
+		alpha ? vsapi->getFrameHeight(alpha, 0) : 0,
+		params, error))
+		return false;
+	
+	// animation frames only cover part of the frame, and mostly differ, so aren't worth caching
+	ImageCache& cache = ImageCache::global();
+	DiskCache& diskCache = DiskCache::global();
+	bool useCache = !anim && (cache.enabled() || diskCache.enabled());
+	ImageCacheKey key;
+	if(useCache) {
+		key = content ? *content : frameCacheKey(frame, alpha, vsapi);
+		key.params = cacheParams(params);
+		uint8_t* cached;
+		size_t cachedSize;
+		void (*release)(void*);
+		if(cache.lookup(key, cached, cachedSize)) {
+			result.set(cached, cachedSize, alignedFree);
+			return true;
+		}
+		if(diskCache.lookup(diskCacheKey(key, params.format), cached, cachedSize, release)) {
+			cache.insert(key, cached, cachedSize);
+			result.set(cached, cachedSize, release);
+			return true;
+		}
+	}
+	
+	// if the same image is already being encoded, wait for that instead; without a hash, frames can only be matched
+	// by identity, which holds whilst the first request keeps its frame referenced
+	InFlightEncodes& inFlight = InFlightEncodes::global();
+	ImageCacheKey flightKey;
+	if(useCache)
+		flightKey = key;
+	else {
+		flightKey.content[0] = reinterpret_cast<uintptr_t>(frame);
+		flightKey.content[1] = reinterpret_cast<uintptr_t>(alpha);
+		flightKey.params = cacheParams(params) | uint64_t(1) << 63; // keep apart from hashed keys
+	}
+	if(!anim) {
+		uint8_t* shared;
+		size_t sharedSize;
+		if(inFlight.wait(flightKey, shared, sharedSize, error)) {
+			if(!shared) return false;
+			result.set(shared, sharedSize, alignedFree);
+			return true;
+		}
+	}
+	
+	result.reset(); // release the context, if `result` is holding it
+	EncoderContext& ctx = threadContext();
+	ctx.begin();
+	
+	uint8_t* encData = nullptr;
+	size_t encSize = 0;
+	bool ok = false;
+	if(params.format == IMGFMT_JPEG) {
+#ifdef HAVE_JPEG
+		ok = encodeJpeg(ctx, frame, interleaved, params, encData, encSize, error, vsapi);
+#endif
+	} else if(params.format == IMGFMT_WEBP || params.format == IMGFMT_WEBP_VP8) {
+#ifdef HAVE_WEBP
+		ok = encodeWebP(ctx, frame, alpha, anim, interleaved, params, encData, encSize, error, vsapi);
+#endif
+	} else { // params.format == IMGFMT_PNG
+		ok = encodePng(ctx, frame, alpha, anim, interleaved, params, encData, encSize, error, vsapi);
+	}
+	
+	if(!ok) {
+		ctx.end();
+		if(!anim) inFlight.finish(flightKey, nullptr, 0, error);
+		return false;
+	}
+	if(useCache) {
+		cache.insert(key, encData, encSize);
+		diskCache.insert(diskCacheKey(key, params.format), encData, encSize);
+	}
+	if(!anim) inFlight.finish(flightKey, encData, encSize, error);
+	result.borrow(encData, encSize, &ctx);
+	return true;
+}
+
+
+/// downscaling
+
+// writes a row of box averages from the column sums of `rows` source rows; boxes which run past the right edge average
+// the samples they cover, and output columns wholly past it (from rounding up to the chroma subsampling) repeat the
+// last one
+static void boxRow(uint8_t* dst, const uint32_t* sums, int srcWidth, int dstWidth, int factor, int rows, int bytesPerSample) {
+	uint16_t* dst16 = reinterpret_cast<uint16_t*>(dst);
+	int full = std::min(srcWidth / factor, dstWidth);
+	uint32_t count = factor * rows;
+	// box sizes are usually powers of two, which avoids a division per sample
+	bool pow2 = (count & (count-1)) == 0;
+	int shift = __builtin_ctz(count);
+	for(int x=0; x<full; x++) {
+		uint32_t sum = count/2;
+		for(int i=0; i<factor; i++)
+			sum += sums[x*factor + i];
+		uint32_t v = pow2 ? sum >> shift : sum / count;
+		if(bytesPerSample == 1) dst[x] = v;
+		else dst16[x] = v;
+	}
+	for(int x=full; x<dstWidth; x++) {
+		int x0 = std::min(x*factor, srcWidth-1);
+		int x1 = std::max(std::min(x*factor + factor, srcWidth), x0+1);
+		uint32_t partialCount = (x1-x0) * rows;
+		uint32_t sum = partialCount/2;
+		for(int i=x0; i<x1; i++)
+			sum += sums[i];
+		if(bytesPerSample == 1) dst[x] = sum / partialCount;
+		else dst16[x] = sum / partialCount;
+	}
+}
+
+// box filters `frame` down by each of `factors`, into new frames, with a factor of 1 returning a reference to `frame`
+// all sizes are produced in one pass over the source, so each sample is only read once, however many are requested
+// dimensions are rounded up, so partial boxes along the right and bottom edges average the samples they cover
+static void downscaleFrame(const VSFrame* frame, const std::vector<int>& factors, std::vector<const VSFrame*>& scaled, VSCore* core, const VSAPI* vsapi) {
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
+	int width = vsapi->getFrameWidth(frame, 0);
+	int height = vsapi->getFrameHeight(frame, 0);
+	
+	// lowest common multiple of the factors, so that bands of rows can be processed independently
+	int align = 1;
+	std::vector<VSFrame*> dst(factors.size(), nullptr);
+	scaled.resize(factors.size());
+	for(size_t i=0; i<factors.size(); i++) {
+		int factor = factors[i];
+		if(factor == 1) {
+			scaled[i] = vsapi->addFrameRef(frame);
+			continue;
+		}
+		int a = align, b = factor;
+		while(b) { int t = a % b; a = b; b = t; }
+		align = std::min(align / a * factor, height);
+		// subsampled formats need dimensions which are a multiple of the subsampling
+		int dstWidth = ((width + factor-1) / factor + (1 << fi->subSamplingW)-1) >> fi->subSamplingW << fi->subSamplingW;
+		int dstHeight = ((height + factor-1) / factor + (1 << fi->subSamplingH)-1) >> fi->subSamplingH << fi->subSamplingH;
+		dst[i] = vsapi->newVideoFrame(fi, dstWidth, dstHeight, frame, core);
+		scaled[i] = dst[i];
+	}
+	
+	// split each plane into bands for the thread pool, unless the frame is too small for it to be worthwhile; bands
+	// hold whole boxes, in the chroma planes too
+	const size_t minParallelSize = 1024 * 1024;
+	int bandRows = height;
+	align <<= fi->subSamplingH;
+	if(size_t(width) * height * fi->bytesPerSample >= minParallelSize && align < height) {
+		int bands = ThreadPool::global().size() + 1;
+		bandRows = std::min(((height + bands-1) / bands + align-1) / align * align, height);
+	}
+	int bandsPerPlane = (height + bandRows-1) / bandRows;
+	ThreadPool::global().parallelFor(bandsPerPlane * fi->numPlanes, 0, [&](size_t task) {
+		int plane = task / bandsPerPlane;
+		int planeWidth = vsapi->getFrameWidth(frame, plane);
+		int planeHeight = vsapi->getFrameHeight(frame, plane);
+		int rows = plane ? bandRows >> fi->subSamplingH : bandRows;
+		int yBegin = (task % bandsPerPlane) * rows;
+		int yEnd = std::min(yBegin + rows, planeHeight);
+		const uint8_t* src = vsapi->getReadPtr(frame, plane);
+		ptrdiff_t srcStride = vsapi->getStride(frame, plane);
+		
+		std::vector<std::vector<uint32_t>> sums(factors.size());
+		for(size_t i=0; i<factors.size(); i++)
+			if(dst[i]) sums[i].assign(planeWidth, 0);
+		for(int y=yBegin; y<yEnd; y++) {
+			const uint8_t* row = src + y*srcStride;
+			for(size_t i=0; i<factors.size(); i++) {
+				if(!dst[i]) continue;
+				int factor = factors[i];
+				kernels->sumColumns(sums[i].data(), row, planeWidth, fi->bytesPerSample);
+				if((y+1) % factor && y+1 < planeHeight) continue;
+				
+				int dstY = y / factor;
+				uint8_t* dstRow = vsapi->getWritePtr(dst[i], plane) + dstY * vsapi->getStride(dst[i], plane);
+				int boxRows = y+1 - dstY*factor;
+				boxRow(dstRow, sums[i].data(), planeWidth, vsapi->getFrameWidth(dst[i], plane), factor, boxRows, fi->bytesPerSample);
+				std::fill(sums[i].begin(), sums[i].end(), 0);
+				// rows past the bottom, from rounding up to the subsampling, repeat the last
+				if(y+1 == planeHeight) {
+					size_t rowSize = size_t(vsapi->getFrameWidth(dst[i], plane)) * fi->bytesPerSample;
+					for(int extra = dstY+1; extra < vsapi->getFrameHeight(dst[i], plane); extra++)
+						memcpy(dstRow + (extra-dstY) * vsapi->getStride(dst[i], plane), dstRow, rowSize);
+				}
+			}
+		}
+	});
+}
+
+
+/// VapourSynth functions
+
+// encodes `frame` at each size in `scales`, appending the images to `out` in the same order
+static bool encodeScaled(const VSFrame* frame, const VSFrame* alpha, const std::vector<int>& scales, const EncodeParams& params, VSMap* out, std::string& error, VSCore* core, const VSAPI* vsapi) {
+	// check before downscaling, which only handles integer samples
+	if(!checkFormat(vsapi->getVideoFrameFormat(frame), vsapi->getFrameWidth(frame, 0), vsapi->getFrameHeight(frame, 0),
+		alpha ? vsapi->getVideoFrameFormat(alpha) : nullptr,
+		alpha ? vsapi->getFrameWidth(alpha, 0) : 0,
+		alpha ? vsapi->getFrameHeight(alpha, 0) : 0,
+		params, error))
+		return false;
+	
+	std::vector<const VSFrame*> frames, alphas(scales.size(), nullptr);
+	downscaleFrame(frame, scales, frames, core, vsapi);
+	if(alpha)
+		downscaleFrame(alpha, scales, alphas, core, vsapi);
+	
+	std::vector<EncodedImage> images(scales.size());
+	std::vector<std::string> errors(scales.size());
+	ThreadPool::global().parallelFor(scales.size(), 0, [&](size_t i) {
+		if(encodeImage(frames[i], alphas[i], params, images[i], errors[i], vsapi) && !images[i].makeOwned())
+			errors[i] = "Failed to allocate output buffer";
+	});
+	for(size_t i=0; i<scales.size(); i++) {
+		vsapi->freeFrame(frames[i]);
+		if(alphas[i]) vsapi->freeFrame(alphas[i]);
+	}
+	for(size_t i=0; i<scales.size(); i++) {
+		if(!errors[i].empty()) {
+			error = "scale " + std::to_string(scales[i]) + ": " + errors[i];
+			return false;
+		}
+	}
+	for(const auto& img : images)
+		mapSetImage(out, "bytes", img, maAppend, vsapi);
+	return true;
+}
+
+static void VS_CC encodeFrame(const VSMap* in, VSMap* out, void*, VSCore*, const VSAPI* vsapi) {
+	int err = 0;
+	EncodeParams params;
+	std::string error;
+	
+	if(!parseParams(in, params, error, vsapi)) {
+		vsapi->mapSetError(out, ("EncodeFrame: " + error).c_str());
+		return;
+	}
+	
+	const VSFrame* frame = vsapi->mapGetFrame(in, "frame", 0, nullptr);
+	const VSFrame* alpha = vsapi->mapGetFrame(in, "alpha", 0, &err);
+	
+	EncodedImage img;
+	if(encodeImage(frame, alpha, params, img, error, vsapi))
+		mapSetImage(out, "bytes", img, maReplace, vsapi);
+	else
+		vsapi->mapSetError(out, ("EncodeFrame: " + error).c_str());
+	
+	vsapi->freeFrame(frame);
+	if(alpha) vsapi->freeFrame(alpha);
+}
+
+static void VS_CC encodeFrameScaled(const VSMap* in, VSMap* out, void*, VSCore* core, const VSAPI* vsapi) {
+	int err = 0;
+	EncodeParams params;
+	std::string error;
+	
+	if(!parseParams(in, params, error, vsapi)) {
+		vsapi->mapSetError(out, ("EncodeFrameScaled: " + error).c_str());
+		return;
+	}
+	std::vector<int> scales;
+	for(int i=0; i<vsapi->mapNumElements(in, "scales"); i++) {
+		int64_t scale = vsapi->mapGetInt(in, "scales", i, nullptr);
+		if(scale < 1 || scale > 256) {
+			vsapi->mapSetError(out, "EncodeFrameScaled: scales must be between 1 and 256");
+			return;
+		}
+		scales.push_back(scale);
+	}
+	
+	const VSFrame* frame = vsapi->mapGetFrame(in, "frame", 0, nullptr);
+	const VSFrame* alpha = vsapi->mapGetFrame(in, "alpha", 0, &err);
+	
+	if(!encodeScaled(frame, alpha, scales, params, out, error, core, vsapi)) {
+		vsapi->clearMap(out);
+		vsapi->mapSetError(out, ("EncodeFrameScaled: " + error).c_str());
+	}
+	
+	vsapi->freeFrame(frame);
+	if(alpha) vsapi->freeFrame(alpha);
+}
+
+static void VS_CC encodeFrames(const VSMap* in, VSMap* out, void*, VSCore*, const VSAPI* vsapi) {
+	int err = 0;
+	EncodeParams params;
+	std::string error;
+	
+	if(!parseParams(in, params, error, vsapi)) {
+		vsapi->mapSetError(out, ("EncodeFrames: " + error).c_str());
+		return;
+	}
+	int threads = vsapi->mapGetIntSaturated(in, "threads", 0, &err);
+	if(err) threads = 0;
+	if(threads < 0) {
+		vsapi->mapSetError(out, "EncodeFrames: threads cannot be negative");
+		return;
+	}
+	
+	int numFrames = vsapi->mapNumElements(in, "frames");
+	int numAlpha = vsapi->mapNumElements(in, "alpha");
+	if(numAlpha > 0 && numAlpha != numFrames) {
+		vsapi->mapSetError(out, "EncodeFrames: Number of alpha frames must match the number of frames");
+		return;
+	}
+	if(numFrames <= 0) return;
+	
+	// the batch is a sequence, for temporal
+	PngHistory history;
+	params.history = &history;
+	
+	std::vector<const VSFrame*> frames(numFrames);
+	std::vector<const VSFrame*> alphas(numFrames, nullptr);
+	for(int i=0; i<numFrames; i++) {
+		frames[i] = vsapi->mapGetFrame(in, "frames", i, nullptr);
+		if(numAlpha > 0)
+			alphas[i] = vsapi->mapGetFrame(in, "alpha", i, nullptr);
+	}
+	
+	// each worker interleaves and compresses one frame at a time, so at most `threads` frames are in flight, with
+	// one thread's interleaving overlapping with other threads' compression
+	std::vector<EncodedImage> images(numFrames);
+	std::vector<std::string> errors(numFrames);
+	ThreadPool::global().parallelFor(numFrames, threads, [&](size_t i) {
+		// take a copy to free up this thread's context for the next frame
+		if(encodeImage(frames[i], alphas[i], params, images[i], errors[i], vsapi) && !images[i].makeOwned())
+			errors[i] = "Failed to allocate output buffer";
+	});
+	
+	for(int i=0; i<numFrames; i++) {
+		vsapi->freeFrame(frames[i]);
+		if(alphas[i]) vsapi->freeFrame(alphas[i]);
+	}
+	for(int i=0; i<numFrames; i++) {
+		if(!errors[i].empty()) {
+			vsapi->clearMap(out);
+			vsapi->mapSetError(out, ("EncodeFrames: frame " + std::to_string(i) + ": " + errors[i]).c_str());
+			return;
+		}
+		mapSetImage(out, "bytes", images[i], maAppend, vsapi);
+	}
+}
+
+// encodes `frame` into each format in `targets`, appending the images to `out` in the same order
+static bool encodeMulti(const VSFrame* frame, const VSFrame* alpha, const std::vector<EncodeParams>& targets, VSMap* out, std::string& error, const VSAPI* vsapi) {
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
+	int width = vsapi->getFrameWidth(frame, 0);
+	int height = vsapi->getFrameHeight(frame, 0);
+	// check everything up front, as the frame may be interleaved before any target is encoded
+	for(size_t i=0; i<targets.size(); i++) {
+		if(!checkFormat(fi, width, height,
+			alpha ? vsapi->getVideoFrameFormat(alpha) : nullptr,
+			alpha ? vsapi->getFrameWidth(alpha, 0) : 0,
+			alpha ? vsapi->getFrameHeight(alpha, 0) : 0,
+			targets[i], error))
+		{
+			error = "target " + std::to_string(i) + ": " + error;
+			return false;
+		}
+	}
+	
+	// JPEG and lossy WebP interleave 8-bit RGB before encoding, so where one of those is joined by another target
+	// which can read interleaved pixels (including PNG), interleave once and hand the same buffer to all of them
+	const InterleavedFrame* interleaved = nullptr;
+#if defined(HAVE_JPEG) || defined(HAVE_WEBP)
+	SharedInterleaveContext* sharedCtx = nullptr;
+	InterleavedFrame shared;
+	int readers = 0, lossy = 0;
+	for(const auto& params : targets) {
+		if(params.format == IMGFMT_JPEG || params.format == IMGFMT_WEBP_VP8) lossy++;
+		if(params.format != IMGFMT_WEBP) readers++;
+	}
+	if(kernels && fi->colorFamily == cfRGB && fi->bytesPerSample == 1 && lossy > 0 && readers > 1) {
+		PlanarSource src = getPlanes(frame, alpha, nullptr, vsapi);
+		shared.stride = interleavedStride(src);
+		shared.rowSize = size_t(src.width) * src.numChannels;
+		sharedCtx = &sharedInterleaveContext();
+		sharedCtx->begin();
+		uint8_t* data = sharedCtx->interleaved.get(size_t(shared.stride) * src.height);
+		if(!data) {
+			sharedCtx->end();
+			error = "Failed to allocate intermediary buffer";
+			return false;
+		}
+		interleavePlanes(src, data, shared.stride);
+		shared.data = data;
+		interleaved = &shared;
+	}
+#endif
+	
+	// the targets differ only in their options, so share one hash of the frame for the cache
+	ImageCacheKey content;
+	bool hashed = kernels && (ImageCache::global().enabled() || DiskCache::global().enabled());
+	if(hashed)
+		content = frameCacheKey(frame, alpha, vsapi);
+	
+	// the targets are encoded concurrently, each on its own thread's context
+	std::vector<EncodedImage> images(targets.size());
+	std::vector<std::string> errors(targets.size());
+	ThreadPool::global().parallelFor(targets.size(), 0, [&](size_t i) {
+		if(encodeImage(frame, alpha, targets[i], images[i], errors[i], vsapi, nullptr, interleaved, hashed ? &content : nullptr) && !images[i].makeOwned())
+			errors[i] = "Failed to allocate output buffer";
+	});
+#if defined(HAVE_JPEG) || defined(HAVE_WEBP)
+	if(sharedCtx) sharedCtx->end();
 #endif
-	} else { // imgFormat == "PNG"
-		encSize = FPNGEOutputAllocSize(fi->bytesPerSample, numChannels, width, height);
-		VSH_ALIGNED_MALLOC(&encData, encSize, MWORD_SIZE);
-		if(!encData) {
-			VSH_ALIGNED_FREE(data);
-			vsapi->mapSetError(out, "EncodeFrame: Failed to allocate output buffer");
+	for(size_t i=0; i<targets.size(); i++) {
+		if(!errors[i].empty()) {
+			error = "target " + std::to_string(i) + ": " + errors[i];
+			return false;
+		}
+	}
+	for(const auto& img : images)
+		mapSetImage(out, "bytes", img, maAppend, vsapi);
+	return true;
+}
+
+static void VS_CC encodeFrameMulti(const VSMap* in, VSMap* out, void*, VSCore*, const VSAPI* vsapi) {
+	int err = 0;
+	std::string error;
+	
+	int numTargets = vsapi->mapNumElements(in, "imgformat");
+	for(const char* key : {"quality", "effort"}) {
+		int count = vsapi->mapNumElements(in, key);
+		if(count > 1 && count != numTargets) {
+			vsapi->mapSetError(out, (std::string("EncodeFrameMulti: ") + key + " must have one entry, or one for each imgformat").c_str());
+			return;
+		}
+	}
+	std::vector<EncodeParams> targets(numTargets);
+	for(int i=0; i<numTargets; i++) {
+		if(!parseParams(in, targets[i], error, vsapi, i)) {
+			vsapi->mapSetError(out, ("EncodeFrameMulti: target " + std::to_string(i) + ": " + error).c_str());
+			return;
+		}
+	}
+	
+	const VSFrame* frame = vsapi->mapGetFrame(in, "frame", 0, nullptr);
+	const VSFrame* alpha = vsapi->mapGetFrame(in, "alpha", 0, &err);
+	
+	if(!encodeMulti(frame, alpha, targets, out, error, vsapi)) {
+		vsapi->clearMap(out);
+		vsapi->mapSetError(out, ("EncodeFrameMulti: " + error).c_str());
+	}
+	
+	vsapi->freeFrame(frame);
+	if(alpha) vsapi->freeFrame(alpha);
+}
+
+
+// pre-validated encoder, returned by CreateEncoder
+struct Encoder {
+	EncodeParams params;
+	PngHistory history; // frames passed to the encoder are a sequence, for temporal
+};
+
+static void VS_CC encoderCall(const VSMap* in, VSMap* out, void* userData, VSCore*, const VSAPI* vsapi) {
+	Encoder* enc = static_cast<Encoder*>(userData);
+	int err = 0;
+	std::string error;
+	
+	const VSFrame* frame = vsapi->mapGetFrame(in, "frame", 0, &err);
+	if(!frame) {
+		vsapi->mapSetError(out, "Encoder: a frame must be supplied");
+		return;
+	}
+	const VSFrame* alpha = vsapi->mapGetFrame(in, "alpha", 0, &err);
+	
+	EncodedImage img;
+	if(encodeImage(frame, alpha, enc->params, img, error, vsapi))
+		mapSetImage(out, "bytes", img, maReplace, vsapi);
+	else
+		vsapi->mapSetError(out, ("Encoder: " + error).c_str());
+	
+	vsapi->freeFrame(frame);
+	if(alpha) vsapi->freeFrame(alpha);
+}
+
+static void VS_CC encoderFree(void* userData) {
+	delete static_cast<Encoder*>(userData);
+}
+
+static void VS_CC createEncoder(const VSMap* in, VSMap* out, void*, VSCore* core, const VSAPI* vsapi) {
+	Encoder* enc = new Encoder;
+	std::string error;
+	
+	if(!parseParams(in, enc->params, error, vsapi)) {
+		delete enc;
+		vsapi->mapSetError(out, ("CreateEncoder: " + error).c_str());
+		return;
+	}
+	enc->params.history = &enc->history;
+	
+	VSFunction* func = vsapi->createFunction(encoderCall, enc, encoderFree, core);
+	vsapi->mapConsumeFunction(out, "encoder", func, maReplace);
+}
+
+
+struct EncodeClipData {
+	VSNode* node;
+	VSNode* alphaNode;
+	EncodeParams params;
+	PngHistory history; // the clip is a sequence, for temporal
+	std::string prop;
+};
+
+static const VSFrame* VS_CC encodeClipGetFrame(int n, int activationReason, void* instanceData, void**, VSFrameContext* frameCtx, VSCore* core, const VSAPI* vsapi) {
+	EncodeClipData* d = static_cast<EncodeClipData*>(instanceData);
+	
+	if(activationReason == arInitial) {
+		vsapi->requestFrameFilter(n, d->node, frameCtx);
+		if(d->alphaNode)
+			vsapi->requestFrameFilter(n, d->alphaNode, frameCtx);
+	} else if(activationReason == arAllFramesReady) {
+		const VSFrame* frame = vsapi->getFrameFilter(n, d->node, frameCtx);
+		const VSFrame* alpha = d->alphaNode ? vsapi->getFrameFilter(n, d->alphaNode, frameCtx) : nullptr;
+		
+		EncodedImage img;
+		std::string error;
+		bool ok = encodeImage(frame, alpha, d->params, img, error, vsapi);
+		if(alpha) vsapi->freeFrame(alpha);
+		
+		if(!ok) {
+			vsapi->freeFrame(frame);
+			vsapi->setFilterError(("EncodeClip: " + error).c_str(), frameCtx);
+			return nullptr;
+		}
+		VSFrame* dst = vsapi->copyFrame(frame, core);
+		vsapi->freeFrame(frame);
+		mapSetImage(vsapi->getFramePropertiesRW(dst), d->prop.c_str(), img, maReplace, vsapi);
+		return dst;
+	}
+	return nullptr;
+}
+
+static void VS_CC encodeClipFree(void* instanceData, VSCore*, const VSAPI* vsapi) {
+	EncodeClipData* d = static_cast<EncodeClipData*>(instanceData);
+	vsapi->freeNode(d->node);
+	vsapi->freeNode(d->alphaNode);
+	delete d;
+}
+
+static void VS_CC encodeClipCreate(const VSMap* in, VSMap* out, void*, VSCore* core, const VSAPI* vsapi) {
+	int err = 0;
+	EncodeClipData* d = new EncodeClipData;
+	std::string error;
+	
+	if(!parseParams(in, d->params, error, vsapi)) {
+		delete d;
+		vsapi->mapSetError(out, ("EncodeClip: " + error).c_str());
+		return;
+	}
+	d->params.history = &d->history;
+	const char* prop = vsapi->mapGetData(in, "prop", 0, &err);
+	d->prop = err ? "_EncodedImage" : prop;
+	if(d->prop.empty()) {
+		delete d;
+		vsapi->mapSetError(out, "EncodeClip: prop cannot be empty");
+		return;
+	}
+	
+	d->node = vsapi->mapGetNode(in, "clip", 0, nullptr);
+	d->alphaNode = vsapi->mapGetNode(in, "alpha", 0, &err);
+	const VSVideoInfo* vi = vsapi->getVideoInfo(d->node);
+	const VSVideoInfo* alphaVi = d->alphaNode ? vsapi->getVideoInfo(d->alphaNode) : nullptr;
+	
+	if(!vsh::isConstantVideoFormat(vi) || (alphaVi && !vsh::isConstantVideoFormat(alphaVi))) {
+		error = unsupportedFormatError(d->params.format);
+	} else {
+		checkFormat(&vi->format, vi->width, vi->height,
+			alphaVi ? &alphaVi->format : nullptr,
+			alphaVi ? alphaVi->width : 0,
+			alphaVi ? alphaVi->height : 0,
+			d->params, error);
+	}
+	if(!error.empty()) {
+		vsapi->freeNode(d->node);
+		vsapi->freeNode(d->alphaNode);
+		delete d;
+		vsapi->mapSetError(out, ("EncodeClip: " + error).c_str());
+		return;
+	}
+	
+	VSFilterDependency deps[] = {{d->node, rpStrictSpatial}, {d->alphaNode, rpStrictSpatial}};
+	vsapi->createVideoFilter(out, "EncodeClip", vi, encodeClipGetFrame, encodeClipFree, fmParallel, deps, d->alphaNode ? 2 : 1, d, core);
+}
+
+
+/// animations
+
+// a frame of the clip being animated
+struct AnimationSource {
+	const VSFrame* frame;
+	const VSFrame* alpha;
+	AnimationFrame anim;
+	bool unchanged; // identical to the previous frame, so only a placeholder region is encoded
+	int64_t durationNum, durationDen; // seconds
+	EncodedImage img;
+	std::string error;
+	
+	AnimationSource() : frame(nullptr), alpha(nullptr), anim(), unchanged(false), durationNum(0), durationDen(0) {}
+};
+
+// sets `anim`'s region to the bounding box of the pixels which differ between two frames (+ alpha), in luma samples;
+// returns false if the frames are identical
+static bool changedRegion(const VSFrame* frame, const VSFrame* alpha, const VSFrame* prev, const VSFrame* prevAlpha, AnimationFrame& anim, const VSAPI* vsapi) {
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
+	int width = vsapi->getFrameWidth(frame, 0);
+	int height = vsapi->getFrameHeight(frame, 0);
+	int left = width, top = height, right = 0, bottom = 0;
+	for(int p=0; p<fi->numPlanes + (alpha ? 1 : 0); p++) {
+		bool isAlpha = p == fi->numPlanes;
+		const VSFrame* cur = isAlpha ? alpha : frame;
+		const VSFrame* old = isAlpha ? prevAlpha : prev;
+		int plane = isAlpha ? 0 : p;
+		int ssW = plane ? fi->subSamplingW : 0;
+		int ssH = plane ? fi->subSamplingH : 0;
+		const uint8_t* curPtr = vsapi->getReadPtr(cur, plane);
+		const uint8_t* oldPtr = vsapi->getReadPtr(old, plane);
+		ptrdiff_t curStride = vsapi->getStride(cur, plane);
+		ptrdiff_t oldStride = vsapi->getStride(old, plane);
+		int rowSize = vsapi->getFrameWidth(cur, plane) * fi->bytesPerSample;
+		int rows = vsapi->getFrameHeight(cur, plane);
+		for(int y=0; y<rows; y++) {
+			int end;
+			int start = kernels->diffSpan(curPtr + y*curStride, oldPtr + y*oldStride, rowSize, &end);
+			if(start == rowSize) continue;
+			left = std::min(left, (start / fi->bytesPerSample) << ssW);
+			right = std::max(right, ((end-1) / fi->bytesPerSample + 1) << ssW);
+			top = std::min(top, y << ssH);
+			bottom = std::max(bottom, (y+1) << ssH);
+		}
+	}
+	if(right == 0) return false;
+	anim.left = left;
+	anim.top = top;
+	anim.width = std::min(right, width) - left;
+	anim.height = std::min(bottom, height) - top;
+	return true;
+}
+
+// how long a frame is shown for, from its duration properties, or else the clip's frame rate
+static bool frameDuration(const VSFrame* frame, const VSVideoInfo* vi, int64_t& num, int64_t& den, const VSAPI* vsapi) {
+	const VSMap* props = vsapi->getFramePropertiesRO(frame);
+	int errNum = 0, errDen = 0;
+	num = vsapi->mapGetInt(props, "_DurationNum", 0, &errNum);
+	den = vsapi->mapGetInt(props, "_DurationDen", 0, &errDen);
+	if(errNum || errDen || num <= 0 || den <= 0) {
+		num = vi->fpsDen;
+		den = vi->fpsNum;
+	}
+	return num > 0 && den > 0;
+}
+
+// APNG delays are a 16-bit fraction of a second; durations which don't fit are rounded to milliseconds
+static void apngDelay(int64_t num, int64_t den, FPNGEAnimationFrame& frame) {
+	vsh::reduceRational(&num, &den);
+	if(num > 65535 || den > 65535) {
+		num = std::min<int64_t>((num * 1000 + den/2) / den, 65535);
+		den = 1000;
+	}
+	frame.delay_num = num;
+	frame.delay_den = den;
+}
+
+#ifdef HAVE_WEBP
+// animated WebP is assembled here, rather than with libwebpmux's WebPAnimEncoder, as that repeats the search for
+// changed regions, and doesn't allow frames to be encoded in parallel
+// each frame is encoded as a standalone WebP, then its image chunks are moved into an ANMF chunk
+
+static void storeLE24(uint32_t value, uint8_t* dst) {
+	dst[0] = value & 0xFF;
+	dst[1] = (value >> 8) & 0xFF;
+	dst[2] = (value >> 16) & 0xFF;
+}
+static void storeLE32(uint32_t value, uint8_t* dst) {
+	storeLE24(value, dst);
+	dst[3] = value >> 24;
+}
+static uint32_t loadLE32(const uint8_t* src) {
+	return src[0] | (src[1] << 8) | (src[2] << 16) | (uint32_t(src[3]) << 24);
+}
+
+// RIFF header (with the size left to fill in), VP8X and ANIM chunks
+static void webpAnimHeader(std::vector<uint8_t>& out, int width, int height, bool alpha, int loop) {
+	uint8_t header[12 + 18 + 14] = {'R','I','F','F', 0,0,0,0, 'W','E','B','P', 'V','P','8','X', 10,0,0,0};
+	header[20] = 0x02 | (alpha ? 0x10 : 0); // animation, alpha flags
+	storeLE24(width-1, header + 24);
+	storeLE24(height-1, header + 27);
+	memcpy(header + 30, "ANIM", 4);
+	storeLE32(6, header + 34);
+	storeLE32(0xFFFFFFFF, header + 38); // background colour, which viewers generally ignore
+	header[42] = loop & 0xFF;
+	header[43] = loop >> 8;
+	out.insert(out.end(), header, header + sizeof(header));
+}
+
+// appends a frame, encoded as a standalone WebP, as an ANMF chunk which replaces its region of the canvas
+static bool webpAnimAppendFrame(std::vector<uint8_t>& out, const EncodedImage& img, const AnimationFrame& anim, uint32_t durationMs, std::string& error) {
+	if(img.size < 12 || memcmp(img.data, "RIFF", 4) || memcmp(img.data + 8, "WEBP", 4)) {
+		error = "Failed to parse WebP frame";
+		return false;
+	}
+	// keep the image chunks (ALPH, VP8, VP8L), dropping the VP8X header, which is only for the whole file
+	std::vector<std::pair<size_t, size_t>> chunks;
+	size_t payloadSize = 0;
+	for(size_t pos = 12; pos + 8 <= img.size; ) {
+		size_t chunkSize = 8 + ((loadLE32(img.data + pos + 4) + 1) & ~1u);
+		if(pos + chunkSize > img.size) {
+			error = "Failed to parse WebP frame";
+			return false;
+		}
+		if(memcmp(img.data + pos, "VP8X", 4)) {
+			chunks.push_back({pos, chunkSize});
+			payloadSize += chunkSize;
+		}
+		pos += chunkSize;
+	}
+	
+	uint8_t header[24] = {'A','N','M','F'};
+	storeLE32(16 + payloadSize, header + 4);
+	storeLE24(anim.left / 2, header + 8);
+	storeLE24(anim.top / 2, header + 11);
+	storeLE24(anim.width - 1, header + 14);
+	storeLE24(anim.height - 1, header + 17);
+	storeLE24(durationMs, header + 20);
+	header[23] = 0x02; // don't blend, don't dispose
+	out.insert(out.end(), header, header + sizeof(header));
+	for(const auto& chunk : chunks)
+		out.insert(out.end(), img.data + chunk.first, img.data + chunk.first + chunk.second);
+	return true;
+}
+#endif
+
+// encodes frames [first, last] of `node` (+ `alphaNode`) as an animation, appending it to `output`
+// frames are fetched and encoded in batches, across the shared thread pool, with each frame only encoding the region
+// which changed from the previous one
+static bool encodeAnimationFrames(VSNode* node, VSNode* alphaNode, int first, int last, int loop, const EncodeParams& params, std::vector<uint8_t>& output, std::string& error, const VSAPI* vsapi) {
+	const VSVideoInfo* vi = vsapi->getVideoInfo(node);
+	bool isPng = params.format == IMGFMT_PNG;
+	int numFrames = last+1 - first;
+	int batchSize = ThreadPool::global().size() + 1; // the calling thread also takes part
+	
+#ifdef HAVE_WEBP
+	if(!isPng)
+		webpAnimHeader(output, vi->width, vi->height, alphaNode != nullptr, loop);
+	size_t lastDurationPos = 0; // position of the previous frame's duration, to extend for unchanged frames
+	uint32_t lastDurationMs = 0;
+	double elapsed = 0; // in seconds, so that frame times, rather than durations, are rounded to milliseconds
+#endif
+	
+	const VSFrame* prev = nullptr;
+	const VSFrame* prevAlpha = nullptr;
+	bool ok = true;
+	for(int batchStart = 0; batchStart < numFrames && ok; batchStart += batchSize) {
+		std::vector<AnimationSource> batch(std::min(batchSize, numFrames - batchStart));
+		ThreadPool::global().parallelFor(batch.size(), 0, [&](size_t i) {
+			AnimationSource& src = batch[i];
+			char errorMsg[1024];
+			int n = first + batchStart + i;
+			src.frame = vsapi->getFrame(n, node, errorMsg, sizeof(errorMsg));
+			if(src.frame && alphaNode)
+				src.alpha = vsapi->getFrame(n, alphaNode, errorMsg, sizeof(errorMsg));
+			if(!src.frame || (alphaNode && !src.alpha))
+				src.error = errorMsg;
+			else if(!frameDuration(src.frame, vi, src.durationNum, src.durationDen, vsapi))
+				src.error = "frame has no duration, and the clip has a variable frame rate";
+		});
+		for(size_t i=0; i<batch.size() && ok; i++) {
+			if(!batch[i].error.empty()) {
+				error = "frame " + std::to_string(first + batchStart + i) + ": " + batch[i].error;
+				ok = false;
+			}
+		}
+		
+		if(ok) {
+			ThreadPool::global().parallelFor(batch.size(), 0, [&](size_t i) {
+				AnimationSource& src = batch[i];
+				const VSFrame* before = i ? batch[i-1].frame : prev;
+				const VSFrame* beforeAlpha = i ? batch[i-1].alpha : prevAlpha;
+				AnimationFrame& anim = src.anim;
+				if(!before) {
+					anim.width = vi->width;
+					anim.height = vi->height;
+				} else if(!changedRegion(src.frame, src.alpha, before, beforeAlpha, anim, vsapi)) {
+					// still needs a frame, so redraw a pixel, unless it can be merged into the previous one
+					src.unchanged = true;
+					anim.width = anim.height = 1;
+				} else if(!isPng) {
+					// WebP frames must start on even coordinates
+					anim.width += anim.left & 1;
+					anim.height += anim.top & 1;
+					anim.left &= ~1;
+					anim.top &= ~1;
+				}
+				anim.apng.index = batchStart + i;
+				anim.apng.num_frames = numFrames;
+				anim.apng.num_plays = loop;
+				anim.apng.x_offset = anim.left;
+				anim.apng.y_offset = anim.top;
+				apngDelay(src.durationNum, src.durationDen, anim.apng);
+				anim.apng.dispose_op = FPNGE_DISPOSE_OP_NONE;
+				anim.apng.blend_op = FPNGE_BLEND_OP_SOURCE;
+				
+				if(encodeImage(src.frame, src.alpha, params, src.img, src.error, vsapi, &anim) && !src.img.makeOwned())
+					src.error = "Failed to allocate output buffer";
+			});
+		}
+		
+		for(size_t i=0; i<batch.size() && ok; i++) {
+			AnimationSource& src = batch[i];
+			if(!src.error.empty()) {
+				error = "frame " + std::to_string(first + batchStart + i) + ": " + src.error;
+				ok = false;
+				break;
+			}
+			if(isPng) {
+				output.insert(output.end(), src.img.data, src.img.data + src.img.size);
+				continue;
+			}
+#ifdef HAVE_WEBP
+			double end = elapsed + double(src.durationNum) / src.durationDen;
+			uint32_t durationMs = std::min<int64_t>(llround(end * 1000) - llround(elapsed * 1000), 0xFFFFFF);
+			elapsed = end;
+			if(src.unchanged && lastDurationMs + durationMs <= 0xFFFFFF) {
+				lastDurationMs += durationMs;
+				storeLE24(lastDurationMs, output.data() + lastDurationPos);
+				continue;
+			}
+			lastDurationPos = output.size() + 20;
+			lastDurationMs = durationMs;
+			ok = webpAnimAppendFrame(output, src.img, src.anim, durationMs, error);
+			if(!ok) error = "frame " + std::to_string(first + batchStart + i) + ": " + error;
+#endif
+		}
+		
+		// keep the last frame, to compare the next batch against
+		if(prev) vsapi->freeFrame(prev);
+		if(prevAlpha) vsapi->freeFrame(prevAlpha);
+		prev = batch.back().frame;
+		prevAlpha = batch.back().alpha;
+		for(size_t i=0; i+1<batch.size(); i++) {
+			if(batch[i].frame) vsapi->freeFrame(batch[i].frame);
+			if(batch[i].alpha) vsapi->freeFrame(batch[i].alpha);
+		}
+	}
+	if(prev) vsapi->freeFrame(prev);
+	if(prevAlpha) vsapi->freeFrame(prevAlpha);
+	
+#ifdef HAVE_WEBP
+	if(ok && !isPng) {
+		if(output.size() - 8 > 0xFFFFFFFEu) {
+			error = "WebP output is larger than 4GB";
+			return false;
+		}
+		storeLE32(output.size() - 8, output.data() + 4);
+	}
+#endif
+	return ok;
+}
+
+static void VS_CC encodeAnimation(const VSMap* in, VSMap* out, void*, VSCore*, const VSAPI* vsapi) {
+	int err = 0;
+	EncodeParams params;
+	std::string error;
+	
+	if(!parseParams(in, params, error, vsapi)) {
+		vsapi->mapSetError(out, ("EncodeAnimation: " + error).c_str());
+		return;
+	}
+	if(params.format == IMGFMT_JPEG) {
+		vsapi->mapSetError(out, "EncodeAnimation: JPEG doesn't support animation");
+		return;
+	}
+	if(params.format == IMGFMT_PNG && params.reduce) {
+		vsapi->mapSetError(out, "EncodeAnimation: reduce isn't supported for APNG, as every frame must share the same pixel format");
+		return;
+	}
+	PngHistory history;
+	params.history = &history;
+	if(!kernels) {
+		vsapi->mapSetError(out, "EncodeAnimation: EncodeFrame requires a CPU with SSE4.1 support");
+		return;
+	}
+	
+	VSNode* node = vsapi->mapGetNode(in, "clip", 0, nullptr);
+	VSNode* alphaNode = vsapi->mapGetNode(in, "alpha", 0, &err);
+	const VSVideoInfo* vi = vsapi->getVideoInfo(node);
+	const VSVideoInfo* alphaVi = alphaNode ? vsapi->getVideoInfo(alphaNode) : nullptr;
+	
+	int first = vsapi->mapGetIntSaturated(in, "first", 0, &err);
+	if(err) first = 0;
+	int last = vsapi->mapGetIntSaturated(in, "last", 0, &err);
+	if(err) last = vi->numFrames-1;
+	int loop = vsapi->mapGetIntSaturated(in, "loop", 0, &err);
+	if(err) loop = 0;
+	
+	if(!vsh::isConstantVideoFormat(vi) || (alphaVi && !vsh::isConstantVideoFormat(alphaVi))) {
+		error = unsupportedFormatError(params.format);
+	} else if(checkFormat(&vi->format, vi->width, vi->height,
+		alphaVi ? &alphaVi->format : nullptr,
+		alphaVi ? alphaVi->width : 0,
+		alphaVi ? alphaVi->height : 0,
+		params, error))
+	{
+		if(first < 0 || last >= vi->numFrames || (alphaVi && last >= alphaVi->numFrames) || first > last)
+			error = "first and last must select a range of frames within the clip";
+		else if(loop < 0 || loop > 65535)
+			error = "loop must be between 0 and 65535";
+		else if(params.format != IMGFMT_PNG && (vi->width > 16384 || vi->height > 16384))
+			error = "WebP frames cannot be larger than 16384x16384";
+	}
+	
+	std::vector<uint8_t> output;
+	if(error.empty() && encodeAnimationFrames(node, alphaNode, first, last, loop, params, output, error, vsapi)) {
+		if(output.size() > size_t(INT_MAX))
+			error = "output is larger than 2GB";
+		else
+			vsapi->mapSetData(out, "bytes", reinterpret_cast<const char*>(output.data()), output.size(), dtBinary, maReplace);
+	}
+	if(!error.empty())
+		vsapi->mapSetError(out, ("EncodeAnimation: " + error).c_str());
+	vsapi->freeNode(node);
+	vsapi->freeNode(alphaNode);
+}
+
+
+static void VS_CC configure(const VSMap* in, VSMap* out, void*, VSCore*, const VSAPI* vsapi) {
+	int err = 0;
+	int hugePages = vsapi->mapGetIntSaturated(in, "hugepages", 0, &err);
+	if(!err) ThreadScratch::setHugePages(hugePages != 0);
+	
+	double scratchIdle = vsapi->mapGetFloat(in, "scratch_idle", 0, &err);
+	if(!err) {
+		if(scratchIdle < 0) {
+			vsapi->mapSetError(out, "Configure: scratch_idle cannot be negative");
+			return;
+		}
+		ThreadScratch::setIdleTrim(scratchIdle);
+	}
+	
+	int64_t cacheSize = vsapi->mapGetInt(in, "cache_size", 0, &err);
+	if(!err) {
+		if(cacheSize < 0) {
+			vsapi->mapSetError(out, "Configure: cache_size cannot be negative");
+			return;
+		}
+		ImageCache::global().setCapacity(size_t(cacheSize) * 1024 * 1024);
+	}
+	
+	const char* cacheDir = vsapi->mapGetData(in, "cache_dir", 0, &err);
+	if(!err) {
+		int64_t cacheDirSize = vsapi->mapGetInt(in, "cache_dir_size", 0, &err);
+		if(err) cacheDirSize = 1024;
+		if(cacheDirSize <= 0) {
+			vsapi->mapSetError(out, "Configure: cache_dir_size must be positive");
 			return;
 		}
-		struct FPNGEOptions options;
-		FPNGEFillOptions(&options, effort, 0);
-		encSize = FPNGEEncode(fi->bytesPerSample, numChannels, data, width, stride, height, encData, &options);
+		std::string error;
+		if(!DiskCache::global().setDirectory(cacheDir, size_t(cacheDirSize) * 1024 * 1024, error)) {
+			vsapi->mapSetError(out, ("Configure: " + error).c_str());
+			return;
+		}
+	} else if(vsapi->mapNumElements(in, "cache_dir_size") > 0) {
+		vsapi->mapSetError(out, "Configure: cache_dir_size requires cache_dir");
+		return;
 	}
-	VSH_ALIGNED_FREE(data);
+}
+
+static void VS_CC cacheStats(const VSMap*, VSMap* out, void*, VSCore*, const VSAPI* vsapi) {
+	ImageCache::Stats stats = ImageCache::global().stats();
+	vsapi->mapSetInt(out, "hits", stats.hits, maReplace);
+	vsapi->mapSetInt(out, "misses", stats.misses, maReplace);
+	vsapi->mapSetInt(out, "entries", stats.entries, maReplace);
+	vsapi->mapSetInt(out, "bytes", stats.bytes, maReplace);
 	
-	/// return encoded data
-	vsapi->mapSetData(out, "bytes", reinterpret_cast<char*>(encData), encSize, dtBinary, maReplace);
-	VSH_ALIGNED_FREE(encData);
+	DiskCache::Stats diskStats = DiskCache::global().stats();
+	vsapi->mapSetInt(out, "disk_hits", diskStats.hits, maReplace);
+	vsapi->mapSetInt(out, "disk_misses", diskStats.misses, maReplace);
+	vsapi->mapSetInt(out, "disk_bytes", diskStats.bytes, maReplace);
+	vsapi->mapSetInt(out, "coalesced", InFlightEncodes::global().sharedCount(), maReplace);
 }
 
 
 VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI *vspapi) {
 	vspapi->configPlugin("animetosho.encodeframe", "encodeframe", "VapourSynth EncodeFrame module", VS_MAKE_VERSION(1, 0), VAPOURSYNTH_API_VERSION, 0, plugin);
-	vspapi->registerFunction("EncodeFrame", "frame:vframe;imgformat:data;quality:int:opt;effort:int:opt;alpha:vframe:opt;", "bytes:data;", encodeFrame, nullptr, plugin);
+	vspapi->registerFunction("EncodeFrame", "frame:vframe;imgformat:data;quality:int:opt;effort:int:opt;alpha:vframe:opt;stripes:int:opt;reduce:int:opt;", "bytes:data;", encodeFrame, nullptr, plugin);
+	vspapi->registerFunction("EncodeFrameScaled", "frame:vframe;imgformat:data;scales:int[];quality:int:opt;effort:int:opt;alpha:vframe:opt;stripes:int:opt;reduce:int:opt;", "bytes:data[];", encodeFrameScaled, nullptr, plugin);
+	vspapi->registerFunction("EncodeFrames", "frames:vframe[];imgformat:data;quality:int:opt;effort:int:opt;alpha:vframe[]:opt;threads:int:opt;stripes:int:opt;temporal:int:opt;reduce:int:opt;", "bytes:data[];", encodeFrames, nullptr, plugin);
+	vspapi->registerFunction("EncodeFrameMulti", "frame:vframe;imgformat:data[];quality:int[]:opt;effort:int[]:opt;alpha:vframe:opt;stripes:int:opt;reduce:int:opt;", "bytes:data[];", encodeFrameMulti, nullptr, plugin);
+	vspapi->registerFunction("CreateEncoder", "imgformat:data;quality:int:opt;effort:int:opt;stripes:int:opt;temporal:int:opt;reduce:int:opt;", "encoder:func;", createEncoder, nullptr, plugin);
+	vspapi->registerFunction("EncodeClip", "clip:vnode;imgformat:data;quality:int:opt;effort:int:opt;alpha:vnode:opt;prop:data:opt;stripes:int:opt;temporal:int:opt;reduce:int:opt;", "clip:vnode;", encodeClipCreate, nullptr, plugin);
+	vspapi->registerFunction("EncodeAnimation", "clip:vnode;imgformat:data;quality:int:opt;effort:int:opt;alpha:vnode:opt;first:int:opt;last:int:opt;loop:int:opt;stripes:int:opt;temporal:int:opt;reduce:int:opt;", "bytes:data;", encodeAnimation, nullptr, plugin);
+	vspapi->registerFunction("Configure", "hugepages:int:opt;scratch_idle:float:opt;cache_size:int:opt;cache_dir:data:opt;cache_dir_size:int:opt;", "", configure, nullptr, plugin);
+	vspapi->registerFunction("CacheStats", "", "hits:int;misses:int;entries:int;bytes:int;disk_hits:int;disk_misses:int;disk_bytes:int;coalesced:int;", cacheStats, nullptr, plugin);
 }
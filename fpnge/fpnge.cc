@@ -12,13 +12,29 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#ifdef FPNGE_ISA
+// Built once per instruction set, with the best one picked at runtime (see
+// fpnge_dispatch.cc); the entry points are suffixed to keep the builds apart.
+#define FPNGE_ISA_NAME2(name, isa) name##_##isa
+#define FPNGE_ISA_NAME(name, isa) FPNGE_ISA_NAME2(name, isa)
+#define FPNGEScratchSize FPNGE_ISA_NAME(FPNGEScratchSize, FPNGE_ISA)
+#define FPNGEEncodeWithScratch FPNGE_ISA_NAME(FPNGEEncodeWithScratch, FPNGE_ISA)
+#define FPNGEEncodeRows FPNGE_ISA_NAME(FPNGEEncodeRows, FPNGE_ISA)
+#define FPNGEParallelScratchSize                                               \
+  FPNGE_ISA_NAME(FPNGEParallelScratchSize, FPNGE_ISA)
+#define FPNGEEncodeRowsParallel                                                \
+  FPNGE_ISA_NAME(FPNGEEncodeRowsParallel, FPNGE_ISA)
+#endif
+
 #include "fpnge.h"
 #include <algorithm>
 #include <assert.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <memory>
 #include <vector>
 
 #if defined(_MSC_VER) && !defined(__clang__)
@@ -50,12 +66,31 @@
 #endif
 #endif
 
-#ifdef __AVX2__
+#ifdef __AVX512BW__
+#include <immintrin.h>
+#define MM(f) _mm512_##f
+#define MMSI(f) _mm512_##f##_si512
+#define MIVEC __m512i
+#define BCAST128 _mm512_broadcast_i32x4
+#define SET1_EPI64 _mm512_set1_epi64
+#if (defined(__clang__) && __clang_major__ >= 5 &&                             \
+     (!defined(__APPLE__) || __clang_major__ >= 7)) ||                         \
+    (defined(__GNUC__) && __GNUC__ >= 10) ||                                   \
+    (defined(_MSC_VER) && _MSC_VER >= 1910)
+#define INT2VEC(v) _mm512_zextsi128_si512(_mm_cvtsi32_si128(v))
+#else
+#define INT2VEC(v)                                                             \
+  _mm512_inserti32x4(_mm512_setzero_si512(), _mm_cvtsi32_si128(v), 0)
+#endif
+#define SIMD_WIDTH 64
+#define SIMD_MASK 0xffffffffffffffffULL
+#elif defined(__AVX2__)
 #include <immintrin.h>
 #define MM(f) _mm256_##f
 #define MMSI(f) _mm256_##f##_si256
 #define MIVEC __m256i
 #define BCAST128 _mm256_broadcastsi128_si256
+#define SET1_EPI64 _mm256_set1_epi64x
 // workaround for compilers not supporting _mm256_zextsi128_si256
 #if (defined(__clang__) && __clang_major__ >= 5 &&                             \
      (!defined(__APPLE__) || __clang_major__ >= 7)) ||                         \
@@ -78,6 +113,7 @@
 #define MMSI(f) _mm_##f##_si128
 #define MIVEC __m128i
 #define BCAST128(v) (v)
+#define SET1_EPI64 _mm_set1_epi64x
 #define INT2VEC _mm_cvtsi32_si128
 #define SIMD_WIDTH 16
 #define SIMD_MASK 0xffffU
@@ -100,6 +136,45 @@ static constexpr uint16_t kLZ77Base[29] = {
     3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
     31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
 
+// Distance codes; only used with FPNGEOptions::lz77, as otherwise all matches
+// are at distance 1.
+static constexpr uint8_t kDistNBits[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2,   3,  3,  4,  4,  5,  5,  6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static constexpr uint16_t kDistBase[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,    25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513,   769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+
+static FORCE_INLINE size_t FloorLog2(uint32_t v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long idx;
+  _BitScanReverse(&idx, v);
+  return idx;
+#else
+  return 31 - __builtin_clz(v);
+#endif
+}
+
+static FORCE_INLINE size_t CountTrailingZeros(uint64_t v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long idx;
+  _BitScanForward64(&idx, v);
+  return idx;
+#else
+  return __builtin_ctzll(v);
+#endif
+}
+
+static FORCE_INLINE size_t DistSymbol(size_t dist) {
+  if (dist <= 4) {
+    return dist - 1;
+  }
+  size_t log2 = FloorLog2(dist - 1);
+  return 2 * log2 + (((dist - 1) >> (log2 - 1)) & 1);
+}
+
 static uint16_t BitReverse(size_t nbits, uint16_t bits) {
   uint16_t rev16 = (kBitReverseNibbleLookup[bits & 0xF] << 12) |
                    (kBitReverseNibbleLookup[(bits >> 4) & 0xF] << 8) |
@@ -123,12 +198,21 @@ struct HuffmanTable {
   alignas(16) uint8_t mid_lowbits[16];
   uint8_t mid_nbits;
 
+  // codes of all literals, for writing them individually
+  uint16_t lit_bits[256];
+
   uint32_t lz77_length_nbits[259] = {};
   uint32_t lz77_length_bits[259] = {};
   uint32_t lz77_length_sym[259] = {};
 
+  // the code for distance 1
   uint32_t dist_nbits, dist_bits;
 
+  // the full distance code, if num_dist > 1
+  size_t num_dist = 1;
+  uint8_t dist_code_nbits[30] = {1};
+  uint16_t dist_code_bits[30] = {};
+
   // Computes nbits[i] for i <= n, subject to min_limit[i] <= nbits[i] <=
   // max_limit[i], so to minimize sum(nbits[i] * freqs[i]).
   static void ComputeCodeLengths(const uint64_t *freqs, size_t n,
@@ -255,9 +339,22 @@ struct HuffmanTable {
     nbits[285] = collapsed_nbits[47];
   }
 
-  void ComputeCanonicalCode(const uint8_t *nbits, uint16_t *bits) {
+  void ComputeDistNBits(const uint64_t *dist_counts) {
+    uint64_t data[30];
+    uint8_t min_limit[30] = {};
+    uint8_t max_limit[30];
+    for (size_t i = 0; i < 30; i++) {
+      data[i] = dist_counts[i] + 1;
+      max_limit[i] = 10;
+    }
+    num_dist = 30;
+    ComputeCodeLengths(data, 30, min_limit, max_limit, dist_code_nbits);
+  }
+
+  static void ComputeCanonicalCode(const uint8_t *nbits, uint16_t *bits,
+                                   size_t n = 286) {
     uint8_t code_length_counts[16] = {};
-    for (size_t i = 0; i < 286; i++) {
+    for (size_t i = 0; i < n; i++) {
       code_length_counts[nbits[i]]++;
     }
     uint16_t next_code[16] = {};
@@ -266,7 +363,7 @@ struct HuffmanTable {
       code = (code + code_length_counts[i - 1]) << 1;
       next_code[i] = code;
     }
-    for (size_t i = 0; i < 286; i++) {
+    for (size_t i = 0; i < n; i++) {
       bits[i] = BitReverse(nbits[i], next_code[nbits[i]]++);
     }
   }
@@ -288,7 +385,7 @@ struct HuffmanTable {
       }
     }
 
-    dist_nbits = 1;
+    dist_nbits = dist_code_nbits[0];
 
     approx_nbits[0] =
         nbits[0] - 1; // subtract 1 as a fudge for catering for RLE
@@ -301,6 +398,7 @@ struct HuffmanTable {
   void FillBits() {
     uint16_t bits[286];
     ComputeCanonicalCode(nbits, bits);
+    memcpy(lit_bits, bits, sizeof(lit_bits));
     for (size_t i = 0; i < 16; i++) {
       first16_bits[i] = bits[i];
       last16_bits[i] = bits[240 + i];
@@ -322,15 +420,49 @@ struct HuffmanTable {
       }
     }
 
-    dist_bits = 0;
+    if (num_dist > 1) {
+      ComputeCanonicalCode(dist_code_nbits, dist_code_bits, num_dist);
+    }
+    dist_bits = dist_code_bits[0];
   }
 
-  HuffmanTable(const uint64_t *collected_data) {
+  // `dist_counts`, if not null, are the counts of the 30 distance symbols, for
+  // which a code is built; otherwise only distance 1 is coded.
+  explicit HuffmanTable(const uint64_t *collected_data,
+                        const uint64_t *dist_counts = nullptr) {
     ComputeNBits(collected_data);
+    if (dist_counts != nullptr) {
+      ComputeDistNBits(dist_counts);
+    }
     FillNBits();
     FillBits();
   }
 
+  // rebuilds a table from the code lengths of a previous one
+  HuffmanTable(const uint8_t *code_lengths, const uint8_t *dist_code_lengths) {
+    memcpy(nbits, code_lengths, sizeof(nbits));
+    if (dist_code_lengths != nullptr) {
+      num_dist = 30;
+      memcpy(dist_code_nbits, dist_code_lengths, sizeof(dist_code_nbits));
+    }
+    FillNBits();
+    FillBits();
+  }
+
+  uint64_t Cost(const uint64_t *symbol_counts,
+                const uint64_t *dist_counts) const {
+    uint64_t cost = 0;
+    for (size_t i = 0; i < 286; i++) {
+      cost += symbol_counts[i] * nbits[i];
+    }
+    if (dist_counts != nullptr) {
+      for (size_t i = 0; i < num_dist; i++) {
+        cost += dist_counts[i] * dist_code_nbits[i];
+      }
+    }
+    return cost;
+  }
+
   // estimate for CollectSymbolCounts
   // only fills nbits; skips computing actual codes
   HuffmanTable() {
@@ -378,10 +510,43 @@ struct BitWriter {
     bytes_written += count;
   }
 
+  // Ensures that at least `count` more bytes can be written, growing the
+  // output if it's growable. Write stores 8 bytes at a time, so keep that much
+  // slack past the end.
+  bool Reserve(size_t count) {
+    size_t needed = bytes_written + count + 8;
+    if (grow == nullptr || needed <= capacity) {
+      return true;
+    }
+    size_t size = std::max(needed, capacity + capacity / 2);
+    void *grown = grow(grow_opaque, size, bytes_written);
+    if (grown == nullptr) {
+      return false;
+    }
+    data = static_cast<unsigned char *>(grown);
+    capacity = size;
+    return true;
+  }
+
+  void Attach(const FPNGEOutput &output) {
+    data = static_cast<unsigned char *>(output.data);
+    capacity = output.size;
+    grow = output.grow;
+    grow_opaque = output.opaque;
+  }
+
+  void Detach(FPNGEOutput *output) const {
+    output->data = data;
+    output->size = capacity;
+  }
+
   unsigned char *data;
   size_t bytes_written = 0;
   size_t bits_in_buffer = 0;
   uint64_t buffer = 0;
+  size_t capacity = 0;
+  FPNGEOutputGrow grow = nullptr;
+  void *grow_opaque = nullptr;
 };
 
 static void WriteHuffmanCode(const HuffmanTable &table,
@@ -392,9 +557,9 @@ static void WriteHuffmanCode(const HuffmanTable &table,
   constexpr uint8_t kCodeLengthOrder[] = {
       16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
   };
-  writer->Write(5, 29); // all lit/len codes
-  writer->Write(5, 0);  // distance code up to dist, included
-  writer->Write(4, 15); // all code length codes
+  writer->Write(5, 29);                 // all lit/len codes
+  writer->Write(5, table.num_dist - 1); // distance codes in use
+  writer->Write(4, 15);                 // all code length codes
   for (size_t i = 0; i < 19; i++) {
     writer->Write(3, kCodeLengthNbits[kCodeLengthOrder[i]]);
   }
@@ -402,7 +567,9 @@ static void WriteHuffmanCode(const HuffmanTable &table,
   for (size_t i = 0; i < 286; i++) {
     writer->Write(4, kBitReverseNibbleLookup[table.nbits[i]]);
   }
-  writer->Write(4, 0b1000);
+  for (size_t i = 0; i < table.num_dist; i++) {
+    writer->Write(4, kBitReverseNibbleLookup[table.dist_code_nbits[i]]);
+  }
 }
 
 #ifdef __PCLMUL__
@@ -608,7 +775,57 @@ static void UpdateAdler32(uint32_t &s1, uint32_t &s2, uint8_t byte) {
   s2 %= kAdler32Mod;
 }
 
+// Adler-32 of the concatenation of two buffers, the second being `len2` bytes.
+static uint32_t Adler32Combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+  uint32_t rem = len2 % kAdler32Mod;
+  uint32_t sum1 = adler1 & 0xFFFF;
+  uint32_t sum2 = (uint64_t)rem * sum1 % kAdler32Mod;
+  sum1 += (adler2 & 0xFFFF) + kAdler32Mod - 1;
+  sum2 += (adler1 >> 16) + (adler2 >> 16) + kAdler32Mod - rem;
+  if (sum1 >= kAdler32Mod)
+    sum1 -= kAdler32Mod;
+  if (sum1 >= kAdler32Mod)
+    sum1 -= kAdler32Mod;
+  if (sum2 >= 2 * kAdler32Mod)
+    sum2 -= 2 * kAdler32Mod;
+  if (sum2 >= kAdler32Mod)
+    sum2 -= kAdler32Mod;
+  return sum1 | (sum2 << 16);
+}
+
+// a * b modulo the (reflected) CRC-32 polynomial
+static uint32_t Crc32MultModP(uint32_t a, uint32_t b) {
+  uint32_t m = 1u << 31;
+  uint32_t p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0)
+        break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ 0xEDB88320 : b >> 1;
+  }
+  return p;
+}
+
+// CRC-32 of the concatenation of two buffers, the second being `len2` bytes.
+static uint32_t Crc32Combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+  // multiply crc1 by x^(8*len2), using repeated squaring of x
+  uint32_t x2n = 1u << 30; // x^1
+  uint32_t p = 1u << 31;   // x^0
+  for (size_t n = len2 * 8; n; n >>= 1) {
+    if (n & 1)
+      p = Crc32MultModP(x2n, p);
+    x2n = Crc32MultModP(x2n, x2n);
+  }
+  return Crc32MultModP(p, crc1) ^ crc2;
+}
+
 static uint32_t hadd(MIVEC v) {
+#ifdef __AVX512BW__
+  return _mm512_reduce_add_epi32(v);
+#else
   auto sum =
 #ifdef __AVX2__
       _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
@@ -618,6 +835,16 @@ static uint32_t hadd(MIVEC v) {
   sum = _mm_hadd_epi32(sum, sum);
   sum = _mm_hadd_epi32(sum, sum);
   return _mm_cvtsi128_si32(sum);
+#endif
+}
+
+// bitmask of the bytes in `v` that are zero
+static FORCE_INLINE uint64_t ZeroBytes(MIVEC v) {
+#ifdef __AVX512BW__
+  return _mm512_testn_epi8_mask(v, v);
+#else
+  return (uint32_t)MM(movemask_epi8)(MM(cmpeq_epi8)(v, MMSI(setzero)()));
+#endif
 }
 
 template <size_t predictor>
@@ -655,6 +882,18 @@ static FORCE_INLINE MIVEC PredictVec(const unsigned char *current_buf,
     // pc isn't used
     auto min_pab = MM(min_epu8)(pa, pb);
     auto pc = MM(sub_epi8)(MM(max_epu8)(pa, pb), min_pab);
+#ifdef __AVX512BW__
+    pc = _mm512_mask_set1_epi8(pc,
+                               _mm512_cmpeq_epi8_mask(min_bc, c) ^
+                                   _mm512_cmpeq_epi8_mask(min_ac, a),
+                               -1);
+
+    auto use_a = _mm512_cmpeq_epi8_mask(MM(min_epu8)(min_pab, pc), pa);
+    auto use_b = _mm512_cmpeq_epi8_mask(MM(min_epu8)(pb, pc), pb);
+
+    auto pred = _mm512_mask_blend_epi8(use_a, _mm512_mask_blend_epi8(use_b, c, b),
+                                       a);
+#else
     pc = MMSI(or)(
         pc, MMSI(xor)(MM(cmpeq_epi8)(min_bc, c), MM(cmpeq_epi8)(min_ac, a)));
 
@@ -662,6 +901,7 @@ static FORCE_INLINE MIVEC PredictVec(const unsigned char *current_buf,
     auto use_b = MM(cmpeq_epi8)(MM(min_epu8)(pb, pc), pb);
 
     auto pred = MM(blendv_epi8)(MM(blendv_epi8)(c, b, use_b), a, use_a);
+#endif
     return MM(sub_epi8)(data, pred);
     /*
     // Equivalent scalar code:
@@ -682,6 +922,13 @@ static FORCE_INLINE MIVEC PredictVec(const unsigned char *current_buf,
   }
 }
 
+#ifdef __AVX512BW__
+// partial vectors at the end of a row are handled with mask registers: the
+// first `n` bytes are valid
+static FORCE_INLINE __mmask64 TailMask(size_t n) { return _bzhi_u64(~0ULL, n); }
+#else
+// loading from `kMaskVec - n` gives a vector where all but the first `n` bytes
+// are set, i.e. the bytes past the end of a partial vector
 alignas(SIMD_WIDTH) constexpr int32_t _kMaskVec[] = {0,  0,  0,  0,
 #if SIMD_WIDTH == 32
                                                      0,  0,  0,  0,
@@ -690,6 +937,7 @@ alignas(SIMD_WIDTH) constexpr int32_t _kMaskVec[] = {0,  0,  0,  0,
                                                      -1, -1, -1, -1};
 static const uint8_t *kMaskVec =
     reinterpret_cast<const uint8_t *>(_kMaskVec) + SIMD_WIDTH;
+#endif
 
 template <size_t predictor, typename CB, typename CB_ADL, typename CB_RLE>
 static void
@@ -702,8 +950,7 @@ ProcessRow(size_t bytes_per_line, const unsigned char *current_row_buf,
   for (; i + SIMD_WIDTH <= bytes_per_line; i += SIMD_WIDTH) {
     auto pdata = PredictVec<predictor>(current_row_buf + i, top_buf + i,
                                        left_buf + i, topleft_buf + i);
-    unsigned pdatais0 =
-        MM(movemask_epi8)(MM(cmpeq_epi8)(pdata, MMSI(setzero)()));
+    uint64_t pdatais0 = ZeroBytes(pdata);
     if (pdatais0 == SIMD_MASK) {
       run += SIMD_WIDTH;
     } else {
@@ -720,9 +967,8 @@ ProcessRow(size_t bytes_per_line, const unsigned char *current_row_buf,
   if (bytes_remaining) {
     auto pdata = PredictVec<predictor>(current_row_buf + i, top_buf + i,
                                        left_buf + i, topleft_buf + i);
-    unsigned pdatais0 =
-        MM(movemask_epi8)(MM(cmpeq_epi8)(pdata, MMSI(setzero)()));
-    auto mask = (1UL << bytes_remaining) - 1;
+    uint64_t pdatais0 = ZeroBytes(pdata);
+    auto mask = (uint64_t(1) << bytes_remaining) - 1;
 
     if ((pdatais0 & mask) == mask && run + bytes_remaining >= 16) {
       run += bytes_remaining;
@@ -789,6 +1035,197 @@ template <typename CB> static void ForAllRLESymbols(size_t length, CB &&cb) {
   }
 }
 
+// Window of filtered rows for FPNGEOptions::lz77. Matches are searched for at
+// distance 1 (runs), one row up, and at the last position whose first bytes
+// hashed the same, with one step of lazy matching.
+constexpr size_t kLZ77WindowSize = 32768;
+constexpr size_t kLZ77HashBits = 15;
+constexpr size_t kLZ77MinMatch = 4;
+constexpr size_t kLZ77MaxMatch = 258;
+
+class LZ77Window {
+public:
+  explicit LZ77Window(size_t row_bytes)
+      : buf_(2 * (kLZ77WindowSize + row_bytes) + SIMD_WIDTH),
+        head_(size_t(1) << kLZ77HashBits), lit_cost_(row_bytes + 1) {}
+
+  // Forgets all rows, e.g. when moving to a different set of sample rows.
+  void Reset() {
+    base_ = end_ = 0;
+    std::fill(head_.begin(), head_.end(), 0);
+  }
+
+  // Makes room for `n` more bytes and returns where to write them. Up to
+  // SIMD_WIDTH bytes past those may be overwritten.
+  unsigned char *Append(size_t n) {
+    if (end_ - base_ + n + SIMD_WIDTH > buf_.size()) {
+      size_t keep = std::min(end_ - base_, kLZ77WindowSize);
+      memmove(buf_.data(), buf_.data() + (end_ - base_ - keep), keep);
+      base_ = end_ - keep;
+    }
+    unsigned char *data = buf_.data() + (end_ - base_);
+    end_ += n;
+    return data;
+  }
+
+  // Splits the last `n` bytes appended into literals and matches, calling
+  // `cb_lit(data, count)` and `cb_match(length, distance)` in order.
+  // `row_dist` is the distance to the same byte in the previous row. Matches
+  // are only taken if `table` codes them in fewer bits than the literals.
+  template <typename CB_LIT, typename CB_MATCH>
+  void Parse(size_t n, size_t row_dist, const HuffmanTable &table,
+             CB_LIT &&cb_lit, CB_MATCH &&cb_match) {
+    size_t start = end_ - n;
+    const unsigned char *data = buf_.data() + (start - base_);
+    // lit_cost_[i] is the cost of coding the first i bytes as literals
+    lit_cost_[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+      lit_cost_[i + 1] = lit_cost_[i] + table.nbits[data[i]];
+    }
+
+    struct Match {
+      size_t len, dist;
+      int64_t saving; // in bits, over coding as literals
+    };
+    // Finds the best match at `i`, and adds `i` to the hash table.
+    auto find = [&](size_t i) {
+      Match best = {0, 0, 0};
+      size_t max_len = std::min(n - i, kLZ77MaxMatch);
+      if (max_len < kLZ77MinMatch) {
+        return best;
+      }
+      size_t pos = start + i;
+      size_t max_dist = std::min(pos - base_, kLZ77WindowSize);
+      uint32_t prefix = Load32(data + i);
+      auto try_dist = [&](size_t dist) {
+        if (dist == 0 || dist > max_dist || best.len == max_len) {
+          return;
+        }
+        const unsigned char *ref = data + i - dist;
+        if (Load32(ref) != prefix) {
+          return;
+        }
+        size_t len = MatchLength(data + i, ref, max_len);
+        if (len <= best.len && dist >= best.dist) {
+          return;
+        }
+        int64_t saving = int64_t(lit_cost_[i + len] - lit_cost_[i]) -
+                         MatchCost(table, len, dist);
+        if (saving > best.saving) {
+          best = {len, dist, saving};
+        }
+      };
+      try_dist(1);
+      try_dist(row_dist);
+      // Hashing 6 bytes rather than 4 avoids most candidates that are too
+      // short to be worth it. Positions are truncated to 32 bits; stale
+      // entries are harmless, as candidates are always verified.
+      if (max_len >= 6) {
+        uint64_t prefix6 = Load64(data + i) << 16;
+        uint32_t &head =
+            head_[(prefix6 * 0x9E3779B97F4A7C15ull) >> (64 - kLZ77HashBits)];
+        try_dist(uint32_t(pos) - head);
+        head = uint32_t(pos);
+      }
+      return best;
+    };
+
+    size_t lit_start = 0;
+    size_t i = 0;
+    Match match = {0, 0, 0};
+    bool have_match = false;
+    while (i < n) {
+      if (!have_match) {
+        match = find(i);
+      }
+      have_match = false;
+      if (match.saving <= 0) {
+        i++;
+        continue;
+      }
+      // lazy matching: prefer a better match starting at the next byte
+      if (match.len < 32 && i + 1 < n) {
+        Match next = find(i + 1);
+        if (next.saving > match.saving) {
+          match = next;
+          have_match = true;
+          i++;
+          continue;
+        }
+      }
+      if (i > lit_start) {
+        cb_lit(data + lit_start, i - lit_start);
+      }
+      cb_match(match.len, match.dist);
+      i += match.len;
+      lit_start = i;
+    }
+    if (n > lit_start) {
+      cb_lit(data + lit_start, n - lit_start);
+    }
+  }
+
+private:
+  static int64_t MatchCost(const HuffmanTable &table, size_t len,
+                           size_t dist) {
+    size_t sym = DistSymbol(dist);
+    // without a distance code (i.e. when estimating), guess at 5 bits
+    size_t dist_nbits = table.num_dist > 1 ? table.dist_code_nbits[sym] : 5;
+    return table.lz77_length_nbits[len] + dist_nbits + kDistNBits[sym];
+  }
+
+  static FORCE_INLINE uint64_t Load64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+  }
+
+  static FORCE_INLINE uint32_t Load32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+  }
+
+  // Length of the common prefix of `a` and `b`, up to `max_len`. Reads up to
+  // SIMD_WIDTH bytes past that.
+  static FORCE_INLINE size_t MatchLength(const unsigned char *a,
+                                         const unsigned char *b,
+                                         size_t max_len) {
+    size_t len = 0;
+    for (;;) {
+      auto diff = MMSI(xor)(MMSI(loadu)((const MIVEC *)(a + len)),
+                            MMSI(loadu)((const MIVEC *)(b + len)));
+      uint64_t mismatch = ZeroBytes(diff) ^ SIMD_MASK;
+      if (mismatch != 0) {
+        return std::min(len + CountTrailingZeros(mismatch), max_len);
+      }
+      len += SIMD_WIDTH;
+      if (len >= max_len) {
+        return max_len;
+      }
+    }
+  }
+
+  std::vector<unsigned char> buf_;
+  std::vector<uint32_t> head_;
+  std::vector<uint32_t> lit_cost_;
+  size_t base_ = 0; // stream position of buf_[0]
+  size_t end_ = 0;  // stream position just past the last byte appended
+};
+
+// Writes a match, using the full distance code.
+static FORCE_INLINE void WriteMatch(const HuffmanTable &table, size_t len,
+                                    size_t dist, BitWriter *__restrict writer) {
+  size_t sym = DistSymbol(dist);
+  uint64_t dist_bits = table.dist_code_bits[sym] |
+                       (uint64_t(dist - kDistBase[sym])
+                        << table.dist_code_nbits[sym]);
+  writer->Write(table.lz77_length_nbits[len] + table.dist_code_nbits[sym] +
+                    kDistNBits[sym],
+                (dist_bits << table.lz77_length_nbits[len]) |
+                    table.lz77_length_bits[len]);
+}
+
 template <size_t pred, bool store_pred>
 static void
 TryPredictor(size_t bytes_per_line, const unsigned char *current_row_buf,
@@ -800,16 +1237,29 @@ TryPredictor(size_t bytes_per_line, const unsigned char *current_row_buf,
   auto cost_chunk_cb = [&](const MIVEC bytes,
                            const size_t bytes_in_vec) FORCE_INLINE_LAMBDA {
     auto data_for_lut = MMSI(and)(MM(set1_epi8)(0xF), bytes);
-    // get a mask of `bytes` that are between -16 and 15 inclusive
-    // (`-16 <= bytes <= 15` is equivalent to `bytes + 112 > 95`)
-    auto use_lowhi = MM(cmpgt_epi8)(MM(add_epi8)(bytes, MM(set1_epi8)(112)),
-                                    MM(set1_epi8)(95));
-
     auto nbits_low16 = MM(shuffle_epi8)(
         BCAST128(_mm_load_si128((__m128i *)table.first16_nbits)), data_for_lut);
     auto nbits_hi16 = MM(shuffle_epi8)(
         BCAST128(_mm_load_si128((__m128i *)table.last16_nbits)), data_for_lut);
 
+    // get a mask of `bytes` that are between -16 and 15 inclusive
+    // (`-16 <= bytes <= 15` is equivalent to `bytes + 112 > 95`)
+#ifdef __AVX512BW__
+    auto use_lowhi = _mm512_cmpgt_epi8_mask(
+        MM(add_epi8)(bytes, MM(set1_epi8)(112)), MM(set1_epi8)(95));
+
+    auto nbits = _mm512_mask_blend_epi8(_mm512_movepi8_mask(bytes), nbits_low16,
+                                        nbits_hi16);
+    nbits = _mm512_mask_blend_epi8(use_lowhi, MM(set1_epi8)(table.mid_nbits),
+                                   nbits);
+    nbits = _mm512_maskz_mov_epi8(TailMask(bytes_in_vec), nbits);
+
+    cost_direct =
+        MM(add_epi32)(cost_direct, MM(sad_epu8)(nbits, MMSI(setzero)()));
+#else
+    auto use_lowhi = MM(cmpgt_epi8)(MM(add_epi8)(bytes, MM(set1_epi8)(112)),
+                                    MM(set1_epi8)(95));
+
     auto nbits = MM(blendv_epi8)(nbits_low16, nbits_hi16, bytes);
     nbits = MM(blendv_epi8)(MM(set1_epi8)(table.mid_nbits), nbits, use_lowhi);
 
@@ -818,6 +1268,7 @@ TryPredictor(size_t bytes_per_line, const unsigned char *current_row_buf,
 
     cost_direct =
         MM(add_epi32)(cost_direct, MM(sad_epu8)(nbits, nbits_discard));
+#endif
   };
   auto rle_cost_cb = [&](size_t run) {
     cost_rle += table.first16_nbits[0];
@@ -864,13 +1315,17 @@ static FORCE_INLINE void WriteBitsLong(MIVEC nbits, MIVEC bits_lo,
   auto bitmask1 = MM(shuffle_epi8)(nbits_to_mask, nbits1);
 
   // aggregate nbits
-  alignas(16) uint16_t nbits_a[SIMD_WIDTH / 4];
   auto bit_count = MM(maddubs_epi16)(nbits, MM(set1_epi8)(1));
-#ifdef __AVX2__
+#ifdef __AVX512BW__
+  alignas(SIMD_WIDTH) uint32_t nbits_a[SIMD_WIDTH / 4];
+  MMSI(store)((MIVEC *)nbits_a, MM(madd_epi16)(bit_count, MM(set1_epi16)(1)));
+#elif defined(__AVX2__)
+  alignas(16) uint16_t nbits_a[SIMD_WIDTH / 4];
   auto bit_count2 = _mm_hadd_epi16(_mm256_castsi256_si128(bit_count),
                                    _mm256_extracti128_si256(bit_count, 1));
   _mm_store_si128((__m128i *)nbits_a, bit_count2);
 #else
+  alignas(16) uint16_t nbits_a[SIMD_WIDTH / 4];
   bit_count = _mm_hadd_epi16(bit_count, bit_count);
   _mm_storel_epi64((__m128i *)nbits_a, bit_count);
 #endif
@@ -931,18 +1386,18 @@ static FORCE_INLINE void WriteBitsLong(MIVEC nbits, MIVEC bits_lo,
 
   // 32 -> 64
 #ifdef __AVX2__
-  auto nbits_inv0_64_lo = MM(subs_epu8)(MM(set1_epi64x)(32), nbits0);
-  auto nbits_inv1_64_lo = MM(subs_epu8)(MM(set1_epi64x)(32), nbits1);
+  auto nbits_inv0_64_lo = MM(subs_epu8)(SET1_EPI64(32), nbits0);
+  auto nbits_inv1_64_lo = MM(subs_epu8)(SET1_EPI64(32), nbits1);
   bits0 = MM(sllv_epi32)(bits0_32, nbits_inv0_64_lo);
   bits1 = MM(sllv_epi32)(bits1_32, nbits_inv1_64_lo);
   bits0 = MM(srlv_epi64)(bits0, nbits_inv0_64_lo);
   bits1 = MM(srlv_epi64)(bits1, nbits_inv1_64_lo);
 #else
-  auto nbits0_64_lo = MMSI(and)(nbits0, MM(set1_epi64x)(0xFFFFFFFF));
-  auto nbits1_64_lo = MMSI(and)(nbits1, MM(set1_epi64x)(0xFFFFFFFF));
+  auto nbits0_64_lo = MMSI(and)(nbits0, SET1_EPI64(0xFFFFFFFF));
+  auto nbits1_64_lo = MMSI(and)(nbits1, SET1_EPI64(0xFFFFFFFF));
   // just do two shifts for SSE variant
-  auto bits0_64_lo = MMSI(and)(bits0_32, MM(set1_epi64x)(0xFFFFFFFF));
-  auto bits1_64_lo = MMSI(and)(bits1_32, MM(set1_epi64x)(0xFFFFFFFF));
+  auto bits0_64_lo = MMSI(and)(bits0_32, SET1_EPI64(0xFFFFFFFF));
+  auto bits1_64_lo = MMSI(and)(bits1_32, SET1_EPI64(0xFFFFFFFF));
   auto bits0_64_hi = MM(srli_epi64)(bits0_32, 32);
   auto bits1_64_hi = MM(srli_epi64)(bits1_32, 32);
 
@@ -961,7 +1416,13 @@ static FORCE_INLINE void WriteBitsLong(MIVEC nbits, MIVEC bits_lo,
   bits1 = MMSI(or)(bits1_64_lo, bits1_64_hi);
 #endif
 
+#ifdef __AVX512BW__
+  // no 512-bit horizontal add, so sum groups of 4 symbols from scratch
+  auto nbits01 = MM(madd_epi16)(MM(maddubs_epi16)(nbits, MM(set1_epi8)(1)),
+                                MM(set1_epi16)(1));
+#else
   auto nbits01 = MM(hadd_epi32)(nbits0, nbits1);
+#endif
 
   // nbits_a <= 40 as we have at most 10 bits per symbol, so the call to the
   // writer is safe.
@@ -974,7 +1435,10 @@ static FORCE_INLINE void WriteBitsLong(MIVEC nbits, MIVEC bits_lo,
   MMSI(store)((MIVEC *)bits_a, bits0);
   MMSI(store)((MIVEC *)bits_a + 1, bits1);
 
-#ifdef __AVX2__
+#ifdef __AVX512BW__
+  constexpr uint8_t kPerm[] = {0, 1, 8, 9, 2, 3, 10, 11,
+                               4, 5, 12, 13, 6, 7, 14, 15};
+#elif defined(__AVX2__)
   constexpr uint8_t kPerm[] = {0, 1, 4, 5, 2, 3, 6, 7};
 #else
   constexpr uint8_t kPerm[] = {0, 1, 2, 3};
@@ -1042,12 +1506,12 @@ static FORCE_INLINE void WriteBitsShort(MIVEC nbits, MIVEC bits,
 
   // 32 -> 64
 #ifdef __AVX2__
-  auto nbits_inv_64_lo = MM(subs_epu8)(MM(set1_epi64x)(32), nbits);
+  auto nbits_inv_64_lo = MM(subs_epu8)(SET1_EPI64(32), nbits);
   bits = MM(sllv_epi32)(bits, nbits_inv_64_lo);
   bits = MM(srlv_epi64)(bits, nbits_inv_64_lo);
 #else
-  auto nbits_64_lo = MMSI(and)(nbits, MM(set1_epi64x)(0xFFFFFFFF));
-  auto bits_64_lo = MMSI(and)(bits, MM(set1_epi64x)(0xFFFFFFFF));
+  auto nbits_64_lo = MMSI(and)(nbits, SET1_EPI64(0xFFFFFFFF));
+  auto bits_64_lo = MMSI(and)(bits, SET1_EPI64(0xFFFFFFFF));
   auto bits_64_hi = MM(srli_epi64)(bits, 32);
   bits_64_hi = _mm_blend_epi16(
       _mm_sll_epi64(bits_64_hi, nbits_64_lo),
@@ -1056,6 +1520,12 @@ static FORCE_INLINE void WriteBitsShort(MIVEC nbits, MIVEC bits,
   bits = MMSI(or)(bits_64_lo, bits_64_hi);
 #endif
 
+#ifdef __AVX512BW__
+  alignas(SIMD_WIDTH) uint64_t nbits_a[SIMD_WIDTH / 8];
+  MMSI(store)((MIVEC *)nbits_a,
+              MM(add_epi64)(MMSI(and)(nbits, SET1_EPI64(0xFFFFFFFF)),
+                            MM(srli_epi64)(nbits, 32)));
+#else
   auto nbits2 = _mm_hadd_epi32(
 #ifdef __AVX2__
       _mm256_castsi256_si128(nbits), _mm256_extracti128_si256(nbits, 1)
@@ -1065,9 +1535,9 @@ static FORCE_INLINE void WriteBitsShort(MIVEC nbits, MIVEC bits,
   );
 
   alignas(16) uint32_t nbits_a[4];
-  alignas(SIMD_WIDTH) uint64_t bits_a[SIMD_WIDTH / 8];
-
   _mm_store_si128((__m128i *)nbits_a, nbits2);
+#endif
+  alignas(SIMD_WIDTH) uint64_t bits_a[SIMD_WIDTH / 8];
   MMSI(store)((MIVEC *)bits_a, bits);
 
 #endif
@@ -1093,6 +1563,14 @@ static FORCE_INLINE void AddApproxCost(MIVEC &total, MIVEC pdata,
   auto cost = MM(shuffle_epi8)(bit_costs, approx_sym);
   total = MM(add_epi64)(total, MM(sad_epu8)(cost, MMSI(setzero)()));
 }
+#ifdef __AVX512BW__
+static FORCE_INLINE void AddApproxCost(MIVEC &total, MIVEC pdata,
+                                       MIVEC bit_costs, __mmask64 mask) {
+  auto approx_sym = MM(min_epu8)(MM(abs_epi8)(pdata), MM(set1_epi8)(15));
+  auto cost = _mm512_maskz_shuffle_epi8(mask, bit_costs, approx_sym);
+  total = MM(add_epi64)(total, MM(sad_epu8)(cost, MMSI(setzero)()));
+}
+#else
 static FORCE_INLINE void AddApproxCost(MIVEC &total, MIVEC pdata,
                                        MIVEC bit_costs, MIVEC maskv) {
   auto approx_sym = MM(min_epu8)(MM(abs_epi8)(pdata), MM(set1_epi8)(15));
@@ -1100,6 +1578,7 @@ static FORCE_INLINE void AddApproxCost(MIVEC &total, MIVEC pdata,
   auto cost_mask = MMSI(and)(maskv, cost);
   total = MM(add_epi64)(total, MM(sad_epu8)(cost, cost_mask));
 }
+#endif
 
 static uint8_t
 SelectPredictor(size_t bytes_per_line, const unsigned char *current_row_buf,
@@ -1140,7 +1619,11 @@ SelectPredictor(size_t bytes_per_line, const unsigned char *current_row_buf,
     size_t bytes_remaining =
         bytes_per_line ^ i; // equivalent to `bytes_per_line - i`
     if (bytes_remaining) {
+#ifdef __AVX512BW__
+      auto maskv = TailMask(bytes_remaining);
+#else
       auto maskv = MMSI(loadu)((MIVEC *)(kMaskVec - bytes_remaining));
+#endif
 
       pdata = PredictVec<1>(current_row_buf + i, top_buf + i, left_buf + i,
                             topleft_buf + i);
@@ -1198,7 +1681,8 @@ EncodeOneRow(size_t bytes_per_line, const unsigned char *current_row_buf,
              const unsigned char *top_buf, const unsigned char *left_buf,
              const unsigned char *topleft_buf, unsigned char *paeth_data,
              const HuffmanTable &table, uint32_t &s1, uint32_t &s2,
-             BitWriter *__restrict writer, const struct FPNGEOptions *options) {
+             BitWriter *__restrict writer, const struct FPNGEOptions *options,
+             LZ77Window *window) {
   uint8_t predictor =
       SelectPredictor(bytes_per_line, current_row_buf, top_buf, left_buf,
                       topleft_buf, paeth_data, table, options);
@@ -1214,7 +1698,9 @@ EncodeOneRow(size_t bytes_per_line, const unsigned char *current_row_buf,
 
   auto flush_adler = [&]() {
     adler_accum_s2 = MM(add_epi32)(
-        adler_accum_s2, MM(slli_epi32)(adler_s1_sum, SIMD_WIDTH == 32 ? 5 : 4));
+        adler_accum_s2,
+        MM(slli_epi32)(adler_s1_sum,
+                       SIMD_WIDTH == 64 ? 6 : SIMD_WIDTH == 32 ? 5 : 4));
     adler_s1_sum = MMSI(setzero)();
 
     uint32_t ls1 = hadd(adler_accum_s1);
@@ -1228,6 +1714,67 @@ EncodeOneRow(size_t bytes_per_line, const unsigned char *current_row_buf,
     bytes_since_flush = 0;
   };
 
+#ifdef __AVX512BW__
+  auto encode_chunk_cb = [&](const MIVEC bytes, const size_t bytes_in_vec) {
+    // bytes past the end get zero bits, and are treated as low/high symbols
+    auto mask = TailMask(bytes_in_vec);
+    auto is_hi = _mm512_movepi8_mask(bytes);
+
+    auto data_for_lut = MMSI(and)(MM(set1_epi8)(0xF), bytes);
+    // get a mask of `bytes` that are between -16 and 15 inclusive
+    // (`-16 <= bytes <= 15` is equivalent to `bytes + 112 > 95`)
+    auto use_lowhi = _mm512_cmpgt_epi8_mask(
+                         MM(add_epi8)(bytes, MM(set1_epi8)(112)),
+                         MM(set1_epi8)(95)) |
+                     ~mask;
+
+    auto nbits_low16 = _mm512_maskz_shuffle_epi8(
+        mask, BCAST128(_mm_load_si128((__m128i *)table.first16_nbits)),
+        data_for_lut);
+    auto nbits_hi16 = _mm512_maskz_shuffle_epi8(
+        mask, BCAST128(_mm_load_si128((__m128i *)table.last16_nbits)),
+        data_for_lut);
+    auto nbits = _mm512_mask_blend_epi8(is_hi, nbits_low16, nbits_hi16);
+
+    auto bits_low16 = _mm512_maskz_shuffle_epi8(
+        mask, BCAST128(_mm_load_si128((__m128i *)table.first16_bits)),
+        data_for_lut);
+    auto bits_hi16 = _mm512_maskz_shuffle_epi8(
+        mask, BCAST128(_mm_load_si128((__m128i *)table.last16_bits)),
+        data_for_lut);
+    auto bits_lo = _mm512_mask_blend_epi8(is_hi, bits_low16, bits_hi16);
+
+    if (use_lowhi != SIMD_MASK) {
+      auto data_for_midlut =
+          MMSI(and)(MM(set1_epi8)(0xF), MM(srai_epi16)(bytes, 4));
+
+      auto bits_mid_lo = MM(shuffle_epi8)(
+          BCAST128(_mm_load_si128((__m128i *)table.mid_lowbits)),
+          data_for_midlut);
+
+#if FPNGE_USE_PEXT
+      auto bits_hi = MM(shuffle_epi8)(
+          BCAST128(_mm_load_si128((__m128i *)kBitReverseNibbleLookup)),
+          data_for_lut);
+#else
+      auto bits_hi = _mm512_maskz_shuffle_epi8(
+          ~use_lowhi,
+          BCAST128(_mm_load_si128((__m128i *)kBitReverseNibbleLookup)),
+          data_for_lut);
+#endif
+
+      nbits = _mm512_mask_blend_epi8(use_lowhi, MM(set1_epi8)(table.mid_nbits),
+                                     nbits);
+      bits_lo = _mm512_mask_blend_epi8(use_lowhi, bits_mid_lo, bits_lo);
+
+      WriteBitsLong(nbits, bits_lo, bits_hi, table.mid_nbits - 4, writer);
+    } else {
+      // since mid (symbols 16-239) is not present, we can take some shortcuts
+      // this is expected to occur frequently if compression is effective
+      WriteBitsShort(nbits, bits_lo, writer);
+    }
+  };
+#else
   auto encode_chunk_cb = [&](const MIVEC bytes, const size_t bytes_in_vec) {
     auto maskv = MMSI(loadu)((MIVEC *)(kMaskVec - bytes_in_vec));
 
@@ -1277,6 +1824,7 @@ EncodeOneRow(size_t bytes_per_line, const unsigned char *current_row_buf,
       WriteBitsShort(nbits, bits_lo, writer);
     }
   };
+#endif
 
   auto adler_chunk_cb = [&](const MIVEC pdata, size_t bytes_in_vec, size_t) {
     bytes_since_flush += bytes_in_vec;
@@ -1284,9 +1832,14 @@ EncodeOneRow(size_t bytes_per_line, const unsigned char *current_row_buf,
 
     auto muls = MM(set_epi8)(
         1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16
-#if SIMD_WIDTH == 32
+#if SIMD_WIDTH >= 32
         ,
         17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32
+#endif
+#if SIMD_WIDTH == 64
+        ,
+        33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50,
+        51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64
 #endif
     );
 
@@ -1294,8 +1847,12 @@ EncodeOneRow(size_t bytes_per_line, const unsigned char *current_row_buf,
       adler_accum_s2 = MM(add_epi32)(
           MM(mul_epu32)(MM(set1_epi32)(bytes_in_vec), adler_accum_s1),
           adler_accum_s2);
+#ifdef __AVX512BW__
+      bytes = _mm512_maskz_mov_epi8(TailMask(bytes_in_vec), bytes);
+#else
       bytes =
           MMSI(andnot)(MMSI(loadu)((MIVEC *)(kMaskVec - bytes_in_vec)), bytes);
+#endif
       muls = MM(add_epi8)(muls, MM(set1_epi8)(bytes_in_vec - SIMD_WIDTH));
     } else {
       adler_s1_sum = MM(add_epi32)(adler_s1_sum, adler_accum_s1);
@@ -1325,7 +1882,40 @@ EncodeOneRow(size_t bytes_per_line, const unsigned char *current_row_buf,
     });
   };
 
-  if (options->predictor > 4 && predictor == 4) {
+  if (window != nullptr) {
+    // filter the row into the window, then code it as literals and matches
+    unsigned char *filtered = window->Append(bytes_per_line + 1);
+    filtered[0] = predictor;
+    auto store_cb = [&](const MIVEC pdata, size_t bytes_in_vec, size_t i) {
+      MMSI(storeu)((MIVEC *)(filtered + 1 + i), pdata);
+      adler_chunk_cb(pdata, bytes_in_vec, i);
+    };
+    auto skip_chunk_cb = [](const MIVEC, size_t) {};
+    auto skip_rle_cb = [](size_t) {};
+    if (options->predictor > 4 && predictor == 4) {
+      ProcessRow<0>(bytes_per_line, paeth_data, nullptr, nullptr, nullptr,
+                    skip_chunk_cb, store_cb, skip_rle_cb);
+    } else {
+      ProcessRow(predictor, bytes_per_line, current_row_buf, top_buf, left_buf,
+                 topleft_buf, skip_chunk_cb, store_cb, skip_rle_cb);
+    }
+    window->Parse(
+        bytes_per_line, bytes_per_line + 1, table,
+        [&](const unsigned char *data, size_t count) {
+          if (count < 8) {
+            // not worth the vector setup
+            for (size_t i = 0; i < count; i++) {
+              writer->Write(table.nbits[data[i]], table.lit_bits[data[i]]);
+            }
+            return;
+          }
+          for (size_t i = 0; i < count; i += SIMD_WIDTH) {
+            encode_chunk_cb(MMSI(loadu)((const MIVEC *)(data + i)),
+                            std::min<size_t>(count - i, SIMD_WIDTH));
+          }
+        },
+        [&](size_t len, size_t dist) { WriteMatch(table, len, dist, writer); });
+  } else if (options->predictor > 4 && predictor == 4) {
     // re-use Paeth data
     ProcessRow<0>(bytes_per_line, paeth_data, nullptr, nullptr, nullptr,
                   encode_chunk_cb, adler_chunk_cb, encode_rle_cb);
@@ -1342,7 +1932,29 @@ CollectSymbolCounts(size_t bytes_per_line, const unsigned char *current_row_buf,
                     const unsigned char *top_buf, const unsigned char *left_buf,
                     const unsigned char *topleft_buf, unsigned char *paeth_data,
                     uint64_t *__restrict symbol_counts,
-                    const struct FPNGEOptions *options) {
+                    uint64_t *__restrict dist_counts,
+                    const struct FPNGEOptions *options, LZ77Window *window) {
+  constexpr size_t kLZ77Sym[] = {
+      0,   0,   0,   257, 258, 259, 260, 261, 262, 263, 264, 265, 265, 266,
+      266, 267, 267, 268, 268, 269, 269, 269, 269, 270, 270, 270, 270, 271,
+      271, 271, 271, 272, 272, 272, 272, 273, 273, 273, 273, 273, 273, 273,
+      273, 274, 274, 274, 274, 274, 274, 274, 274, 275, 275, 275, 275, 275,
+      275, 275, 275, 276, 276, 276, 276, 276, 276, 276, 276, 277, 277, 277,
+      277, 277, 277, 277, 277, 277, 277, 277, 277, 277, 277, 277, 277, 278,
+      278, 278, 278, 278, 278, 278, 278, 278, 278, 278, 278, 278, 278, 278,
+      278, 279, 279, 279, 279, 279, 279, 279, 279, 279, 279, 279, 279, 279,
+      279, 279, 279, 280, 280, 280, 280, 280, 280, 280, 280, 280, 280, 280,
+      280, 280, 280, 280, 280, 281, 281, 281, 281, 281, 281, 281, 281, 281,
+      281, 281, 281, 281, 281, 281, 281, 281, 281, 281, 281, 281, 281, 281,
+      281, 281, 281, 281, 281, 281, 281, 281, 281, 282, 282, 282, 282, 282,
+      282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282,
+      282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 283,
+      283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283,
+      283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283,
+      283, 283, 283, 284, 284, 284, 284, 284, 284, 284, 284, 284, 284, 284,
+      284, 284, 284, 284, 284, 284, 284, 284, 284, 284, 284, 284, 284, 284,
+      284, 284, 284, 284, 284, 284, 285,
+  };
 
   auto encode_chunk_cb = [&](const MIVEC pdata, const size_t bytes_in_vec) {
     alignas(SIMD_WIDTH) uint8_t predicted_data[SIMD_WIDTH];
@@ -1356,48 +1968,47 @@ CollectSymbolCounts(size_t bytes_per_line, const unsigned char *current_row_buf,
 
   auto encode_rle_cb = [&](size_t run) {
     symbol_counts[0] += 1;
-    constexpr size_t kLZ77Sym[] = {
-        0,   0,   0,   257, 258, 259, 260, 261, 262, 263, 264, 265, 265, 266,
-        266, 267, 267, 268, 268, 269, 269, 269, 269, 270, 270, 270, 270, 271,
-        271, 271, 271, 272, 272, 272, 272, 273, 273, 273, 273, 273, 273, 273,
-        273, 274, 274, 274, 274, 274, 274, 274, 274, 275, 275, 275, 275, 275,
-        275, 275, 275, 276, 276, 276, 276, 276, 276, 276, 276, 277, 277, 277,
-        277, 277, 277, 277, 277, 277, 277, 277, 277, 277, 277, 277, 277, 278,
-        278, 278, 278, 278, 278, 278, 278, 278, 278, 278, 278, 278, 278, 278,
-        278, 279, 279, 279, 279, 279, 279, 279, 279, 279, 279, 279, 279, 279,
-        279, 279, 279, 280, 280, 280, 280, 280, 280, 280, 280, 280, 280, 280,
-        280, 280, 280, 280, 280, 281, 281, 281, 281, 281, 281, 281, 281, 281,
-        281, 281, 281, 281, 281, 281, 281, 281, 281, 281, 281, 281, 281, 281,
-        281, 281, 281, 281, 281, 281, 281, 281, 281, 282, 282, 282, 282, 282,
-        282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282,
-        282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 282, 283,
-        283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283,
-        283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283, 283,
-        283, 283, 283, 284, 284, 284, 284, 284, 284, 284, 284, 284, 284, 284,
-        284, 284, 284, 284, 284, 284, 284, 284, 284, 284, 284, 284, 284, 284,
-        284, 284, 284, 284, 284, 284, 285,
-    };
     ForAllRLESymbols(run, [&](size_t len, size_t count) {
       symbol_counts[kLZ77Sym[len]] += count;
     });
   };
 
+  HuffmanTable dummy_table;
+  uint8_t predictor;
   if (options->predictor == FPNGE_PREDICTOR_APPROX) {
     // filter selection here seems to be slightly more effective when using the
     // approximate selector; more investigation is probably warranted
-    HuffmanTable dummy_table;
-    uint8_t predictor =
+    predictor =
         SelectPredictor(bytes_per_line, current_row_buf, top_buf, left_buf,
                         topleft_buf, paeth_data, dummy_table, options);
-    if (predictor == 4) {
-      ProcessRow<0>(bytes_per_line, paeth_data, nullptr, nullptr, nullptr,
-                    encode_chunk_cb, adler_chunk_cb, encode_rle_cb);
-    } else {
-      ProcessRow(predictor, bytes_per_line, current_row_buf, top_buf, left_buf,
-                 topleft_buf, encode_chunk_cb, adler_chunk_cb, encode_rle_cb);
-    }
   } else {
-    uint8_t predictor = options->predictor > 4 ? 4 : options->predictor;
+    predictor = options->predictor > 4 ? 4 : options->predictor;
+  }
+
+  if (window != nullptr) {
+    unsigned char *filtered = window->Append(bytes_per_line + 1);
+    filtered[0] = predictor;
+    auto store_cb = [&](const MIVEC pdata, size_t, size_t i) {
+      MMSI(storeu)((MIVEC *)(filtered + 1 + i), pdata);
+    };
+    ProcessRow(predictor, bytes_per_line, current_row_buf, top_buf, left_buf,
+               topleft_buf, [](const MIVEC, size_t) {}, store_cb,
+               [](size_t) {});
+    window->Parse(
+        bytes_per_line, bytes_per_line + 1, dummy_table,
+        [&](const unsigned char *data, size_t count) {
+          for (size_t i = 0; i < count; i++) {
+            symbol_counts[data[i]] += 1;
+          }
+        },
+        [&](size_t len, size_t dist) {
+          symbol_counts[kLZ77Sym[len]] += 1;
+          dist_counts[DistSymbol(dist)] += 1;
+        });
+  } else if (options->predictor == FPNGE_PREDICTOR_APPROX && predictor == 4) {
+    ProcessRow<0>(bytes_per_line, paeth_data, nullptr, nullptr, nullptr,
+                  encode_chunk_cb, adler_chunk_cb, encode_rle_cb);
+  } else {
     ProcessRow(predictor, bytes_per_line, current_row_buf, top_buf, left_buf,
                topleft_buf, encode_chunk_cb, adler_chunk_cb, encode_rle_cb);
   }
@@ -1410,10 +2021,54 @@ static void AppendBE32(size_t value, BitWriter *__restrict writer) {
   writer->Write(8, value & 0xFF);
 }
 
+// Writes a chunk whose data is `size` bytes at `data`.
+static void WriteChunk(uint32_t name, const unsigned char *data, size_t size,
+                       BitWriter *__restrict writer) {
+  AppendBE32(size, writer);
+  size_t crc_start = writer->bytes_written;
+  writer->Write(32, name);
+  writer->WriteBytes(reinterpret_cast<const char *>(data), size);
+  size_t crc_end = writer->bytes_written;
+  uint32_t crc =
+      Crc32().update_final(writer->data + crc_start, crc_end - crc_start);
+  AppendBE32(crc, writer);
+}
+
+static void StoreBE32(uint32_t value, unsigned char *dst) {
+  dst[0] = value >> 24;
+  dst[1] = (value >> 16) & 0xFF;
+  dst[2] = (value >> 8) & 0xFF;
+  dst[3] = value & 0xFF;
+}
+
+// Writes the APNG chunks preceding a frame's image data: acTL (for the first
+// frame), then fcTL. Frame i > 0 takes sequence numbers 2i-1 and 2i, for its
+// fcTL and fdAT; the first frame's image data is IDAT, which has none.
+static void WriteFrameControl(size_t width, size_t height,
+                              const FPNGEAnimationFrame *frame,
+                              BitWriter *__restrict writer) {
+  unsigned char data[26];
+  if (frame->index == 0) {
+    StoreBE32(frame->num_frames, data);
+    StoreBE32(frame->num_plays, data + 4);
+    WriteChunk(0x4c546361, data, 8, writer); // acTL
+  }
+  StoreBE32(frame->index == 0 ? 0 : frame->index * 2 - 1, data);
+  StoreBE32(width, data + 4);
+  StoreBE32(height, data + 8);
+  StoreBE32(frame->x_offset, data + 12);
+  StoreBE32(frame->y_offset, data + 16);
+  data[20] = frame->delay_num >> 8;
+  data[21] = frame->delay_num & 0xFF;
+  data[22] = frame->delay_den >> 8;
+  data[23] = frame->delay_den & 0xFF;
+  data[24] = frame->dispose_op;
+  data[25] = frame->blend_op;
+  WriteChunk(0x4c546366, data, 26, writer); // fcTL
+}
+
 static void WriteHeader(size_t width, size_t height, size_t bytes_per_channel,
-                        size_t num_channels, char cicp_colorspace,
-                        const FPNGEAdditionalChunk *additional_chunks,
-                        int num_additional_chunks,
+                        size_t num_channels, const struct FPNGEOptions *options,
                         BitWriter *__restrict writer) {
   constexpr uint8_t kPNGHeader[8] = {137, 80, 78, 71, 13, 10, 26, 10};
   for (size_t i = 0; i < 8; i++) {
@@ -1427,11 +2082,16 @@ static void WriteHeader(size_t width, size_t height, size_t bytes_per_channel,
   writer->Write(32, 0x52444849);
   AppendBE32(width, writer);
   AppendBE32(height, writer);
-  // Bit depth
-  writer->Write(8, bytes_per_channel * 8);
-  // Colour type
-  constexpr uint8_t numc_to_colour_type[] = {0, 0, 4, 2, 6};
-  writer->Write(8, numc_to_colour_type[num_channels]);
+  if (options->num_palette > 0) {
+    writer->Write(8, FPNGEPaletteBitDepth(options->num_palette));
+    writer->Write(8, 3); // Colour type: indexed
+  } else {
+    // Bit depth
+    writer->Write(8, bytes_per_channel * 8);
+    // Colour type
+    constexpr uint8_t numc_to_colour_type[] = {0, 0, 4, 2, 6};
+    writer->Write(8, numc_to_colour_type[num_channels]);
+  }
   // Compression, filter and interlace methods.
   writer->Write(24, 0);
   assert(writer->bits_in_buffer == 0);
@@ -1440,24 +2100,35 @@ static void WriteHeader(size_t width, size_t height, size_t bytes_per_channel,
       Crc32().update_final(writer->data + crc_start, crc_end - crc_start);
   AppendBE32(crc, writer);
 
-  if (cicp_colorspace == FPNGE_CICP_PQ) {
+  if (options->cicp_colorspace == FPNGE_CICP_PQ) {
     writer->Write(32, 0x04000000);
     writer->Write(32, 0x50434963); // cICP
     writer->Write(32, 0x01001009); // PQ, Rec2020
     writer->Write(32, 0xfe23234d); // CRC
   }
-  for (int i = 0; i < num_additional_chunks; i++) {
-    AppendBE32(additional_chunks[i].data_size, writer);
-    size_t crc_start = writer->bytes_written;
+  if (options->num_palette > 0) {
+    unsigned char plte[256 * 3];
+    unsigned char trns[256];
+    size_t num_trns = 0;
+    for (size_t i = 0; i < options->num_palette; i++) {
+      memcpy(plte + i * 3, options->palette + i * 4, 3);
+      trns[i] = options->palette[i * 4 + 3];
+      if (trns[i] != 255) {
+        num_trns = i + 1;
+      }
+    }
+    WriteChunk(0x45544c50, plte, options->num_palette * 3, writer); // PLTE
+    if (num_trns > 0) {
+      WriteChunk(0x534e5274, trns, num_trns, writer); // tRNS
+    }
+  }
+  for (int i = 0; i < options->num_additional_chunks; i++) {
     uint32_t name = 0;
-    memcpy(&name, additional_chunks[i].name, 4);
-    writer->Write(32, name);
-    writer->WriteBytes(additional_chunks[i].data,
-                       additional_chunks[i].data_size);
-    size_t crc_end = writer->bytes_written;
-    uint32_t crc =
-        Crc32().update_final(writer->data + crc_start, crc_end - crc_start);
-    AppendBE32(crc, writer);
+    memcpy(&name, options->additional_chunks[i].name, 4);
+    WriteChunk(name,
+               reinterpret_cast<const unsigned char *>(
+                   options->additional_chunks[i].data),
+               options->additional_chunks[i].data_size, writer);
   }
 }
 
@@ -1581,38 +2252,442 @@ void CopyRow(unsigned char *dst, const unsigned char *src, size_t nb_channels,
   }
 }
 
-} // namespace
+// With FPNGEOptions::block_split, a range of rows is cut into groups of at
+// least this many bytes (and at most this many groups), each sampled on its
+// own, and adjacent groups are merged unless a separate Huffman code pays for
+// itself. The size limit also leaves enough slack in FPNGEOutputAllocSize for
+// the extra block headers.
+constexpr size_t kMinBlockGroupBytes = 32768;
+constexpr size_t kMaxBlockGroups = 8;
+
+// Rows [y_begin, y_end), coded as one deflate block, with the symbol counts of
+// the `sampled_rows` rows of it that were sampled.
+struct BlockSplit {
+  size_t y_begin, y_end, sampled_rows;
+  uint64_t symbol_counts[286];
+  uint64_t dist_counts[30];
+};
 
-extern "C" size_t FPNGEEncode(size_t bytes_per_channel, size_t num_channels,
-                              const void *data, size_t width, size_t row_stride,
-                              size_t height, void *output,
-                              const struct FPNGEOptions *options) {
-  assert(bytes_per_channel == 1 || bytes_per_channel == 2);
-  assert(num_channels != 0 && num_channels <= 4);
-  size_t bytes_per_line = bytes_per_channel * num_channels * width;
-  assert(row_stride >= bytes_per_line);
+// Approximates the number of bits needed to code symbols with the given
+// counts, using a code fitted to them. Lengths are taken as log2(1/p), but no
+// shorter than 1 bit, since Huffman codes can't go below that.
+static double CodedBits(const uint64_t *counts, size_t n) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += counts[i];
+  }
+  double bits = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (counts[i] != 0) {
+      bits += counts[i] * std::max(log2(double(total) / counts[i]), 1.0);
+    }
+  }
+  return bits;
+}
+
+// Estimated cost of the sampled symbols of a block, in bits. Literals 16-239
+// always have the same length (see HuffmanTable), so are left out.
+static double EstimateBlockBits(const BlockSplit &block, bool lz77) {
+  uint64_t counts[16 + 46];
+  memcpy(counts, block.symbol_counts, 16 * sizeof(uint64_t));
+  memcpy(counts + 16, block.symbol_counts + 240, 46 * sizeof(uint64_t));
+  double bits = CodedBits(counts, 16 + 46);
+  if (lz77) {
+    bits += CodedBits(block.dist_counts, 30);
+  }
+  return bits;
+}
+
+// Adds the sample of `src` to `dst`, leaving the rows `dst` covers alone.
+static void AddBlockSample(BlockSplit *dst, const BlockSplit &src) {
+  dst->sampled_rows += src.sampled_rows;
+  for (size_t i = 0; i < 286; i++) {
+    dst->symbol_counts[i] += src.symbol_counts[i];
+  }
+  for (size_t i = 0; i < 30; i++) {
+    dst->dist_counts[i] += src.dist_counts[i];
+  }
+}
+
+static void MergeBlock(BlockSplit *dst, const BlockSplit &src) {
+  dst->y_begin = std::min(dst->y_begin, src.y_begin);
+  dst->y_end = std::max(dst->y_end, src.y_end);
+  AddBlockSample(dst, src);
+}
 
+// Estimated saving, in bits over the whole of the rows, of coding two adjacent
+// blocks, `split_bits` for their samples, separately rather than as `merged`.
+// Samples differ even where the statistics don't really change, so
+// `noise_bits`, the typical saving between two samples of the same group, is
+// discounted first.
+static double SplitSavingBits(const BlockSplit &merged, double merged_bits,
+                              double split_bits, double noise_bits) {
+  double saving = merged_bits - split_bits - noise_bits;
+  size_t rows = merged.y_end - merged.y_begin;
+  return saving * rows / std::max<size_t>(merged.sampled_rows, 1);
+}
+
+// Repeatedly merges the adjacent pair of blocks that gains least from being
+// separate, until every remaining split saves more than a block header costs.
+static void MergeBlocks(std::vector<BlockSplit> &blocks, bool lz77,
+                        double noise_bits) {
+  // block header, code length code, and 4 bits per code length
+  const double header_bits = 3 + 14 + 19 * 3 + 4 * (286 + (lz77 ? 30 : 1));
+
+  std::vector<double> bits(blocks.size());
+  for (size_t i = 0; i < blocks.size(); i++) {
+    bits[i] = EstimateBlockBits(blocks[i], lz77);
+  }
+  // saving[i] is for keeping blocks i and i + 1 separate
+  std::vector<double> saving(blocks.size());
+  std::vector<double> merged_bits(blocks.size());
+  auto update = [&](size_t i) {
+    if (i + 1 >= blocks.size()) {
+      return;
+    }
+    BlockSplit merged = blocks[i];
+    MergeBlock(&merged, blocks[i + 1]);
+    merged_bits[i] = EstimateBlockBits(merged, lz77);
+    saving[i] = SplitSavingBits(merged, merged_bits[i], bits[i] + bits[i + 1],
+                                noise_bits);
+  };
+  for (size_t i = 0; i + 1 < blocks.size(); i++) {
+    update(i);
+  }
+
+  while (blocks.size() > 1) {
+    size_t worst = 0;
+    for (size_t i = 1; i + 1 < blocks.size(); i++) {
+      if (saving[i] < saving[worst]) {
+        worst = i;
+      }
+    }
+    if (saving[worst] > header_bits) {
+      break;
+    }
+    MergeBlock(&blocks[worst], blocks[worst + 1]);
+    bits[worst] = merged_bits[worst];
+    blocks.erase(blocks.begin() + worst + 1);
+    bits.erase(bits.begin() + worst + 1);
+    saving.erase(saving.begin() + worst + 1);
+    merged_bits.erase(merged_bits.begin() + worst + 1);
+    if (worst > 0) {
+      update(worst - 1);
+    }
+    update(worst);
+  }
+}
+
+static size_t BytesPerLineBuf(size_t bytes_per_channel, size_t num_channels,
+                               size_t width) {
   // allows for padding, and for extra initial space for the "left" pixel for
   // predictors.
+  return (bytes_per_channel * num_channels * width + 4 * bytes_per_channel +
+          SIMD_WIDTH - 1) /
+         SIMD_WIDTH * SIMD_WIDTH;
+}
+
+} // namespace
+
+extern "C" size_t FPNGEScratchSize(size_t bytes_per_channel,
+                                   size_t num_channels, size_t width) {
+  size_t bytes_per_line_buf =
+      BytesPerLineBuf(bytes_per_channel, num_channels, width);
+  // Two rows + one row of predicted data, with extra space for alignment.
+  return bytes_per_line_buf * 2 + SIMD_WIDTH - 1 + 4 * bytes_per_channel +
+         bytes_per_line_buf + SIMD_WIDTH - 1;
+}
+
+// Encodes rows [y_begin, y_end), produced by `get_row(y, dst)` which writes row
+// `y` into the (aligned) row buffer `dst`, as a dynamic Huffman block whose
+// table is sampled from the centre of those rows, or taken from `history` (if
+// not null) when it still fits. With `options->block_split`, the rows may
+// instead be split into several blocks, each with its own table. Updates the
+// Adler-32 sums, and the CRC from `crc_pos` onwards. A non-final block is
+// followed by an empty stored block, so that the output ends on a byte
+// boundary. Returns false if the output couldn't be grown.
+template <typename GetRow>
+static bool EncodeRowRange(size_t bytes_per_channel, size_t num_channels,
+                           GetRow &get_row, size_t width, size_t y_begin,
+                           size_t y_end, bool is_final,
+                           const struct FPNGEOptions *options,
+                           FPNGEHistory *history, void *scratch,
+                           BitWriter &writer, Crc32 &crc, size_t &crc_pos,
+                           uint32_t &s1, uint32_t &s2) {
+  size_t bytes_per_line = bytes_per_channel * num_channels * width;
+
   size_t bytes_per_line_buf =
-      (bytes_per_line + 4 * bytes_per_channel + SIMD_WIDTH - 1) / SIMD_WIDTH *
-      SIMD_WIDTH;
+      BytesPerLineBuf(bytes_per_channel, num_channels, width);
 
   // Extra space for alignment purposes.
-  std::vector<unsigned char> buf(bytes_per_line_buf * 2 + SIMD_WIDTH - 1 +
-                                 4 * bytes_per_channel);
-  unsigned char *aligned_buf_ptr = buf.data() + 4 * bytes_per_channel;
+  unsigned char *buf = static_cast<unsigned char *>(scratch);
+  size_t buf_size =
+      bytes_per_line_buf * 2 + SIMD_WIDTH - 1 + 4 * bytes_per_channel;
+  memset(buf, 0, buf_size);
+  unsigned char *aligned_buf_ptr = buf + 4 * bytes_per_channel;
   aligned_buf_ptr += (intptr_t)aligned_buf_ptr % SIMD_WIDTH
                          ? (SIMD_WIDTH - (intptr_t)aligned_buf_ptr % SIMD_WIDTH)
                          : 0;
 
-  std::vector<unsigned char> pdata_buf(bytes_per_line_buf + SIMD_WIDTH - 1);
-  unsigned char *aligned_pdata_ptr = pdata_buf.data();
+  unsigned char *aligned_pdata_ptr = buf + buf_size;
   aligned_pdata_ptr +=
       (intptr_t)aligned_pdata_ptr % SIMD_WIDTH
           ? (SIMD_WIDTH - (intptr_t)aligned_pdata_ptr % SIMD_WIDTH)
           : 0;
 
+  uint64_t symbol_counts[286] = {};
+  uint64_t dist_counts[30] = {};
+
+  // With LZ77, rows are also filtered into a window to search for matches.
+  std::unique_ptr<LZ77Window> window;
+  if (options->lz77) {
+    window.reset(new LZ77Window(bytes_per_line + 1));
+  }
+
+  // Sample rows in the center of the range.
+  size_t rows = y_end - y_begin;
+  size_t y0 = y_begin + rows * (127 - options->huffman_sample) / 256;
+  size_t y1 = y_begin + rows * (129 + options->huffman_sample) / 256;
+  if (y1 == y_begin && rows > 0) { // for 1 pixel high ranges
+    y1 = y_begin + 1;
+  }
+
+  // Counts the symbols of rows [ya, yb), except the first, which is only used
+  // for prediction (unless it's the top of the image).
+  auto sample_rows = [&](size_t ya, size_t yb, uint64_t *counts,
+                         uint64_t *dists) {
+    if (window) {
+      window->Reset();
+    }
+    for (size_t y = ya; y < yb; y++) {
+      unsigned char *current_row_buf =
+          aligned_buf_ptr + (y % 2 ? bytes_per_line_buf : 0);
+      const unsigned char *top_buf =
+          aligned_buf_ptr + ((y + 1) % 2 ? bytes_per_line_buf : 0);
+      const unsigned char *left_buf =
+          current_row_buf - bytes_per_channel * num_channels;
+      const unsigned char *topleft_buf =
+          top_buf - bytes_per_channel * num_channels;
+
+      get_row(y, current_row_buf);
+      if (y == ya && y != 0) {
+        continue;
+      }
+
+      CollectSymbolCounts(bytes_per_line, current_row_buf, top_buf, left_buf,
+                          topleft_buf, aligned_pdata_ptr, counts, dists,
+                          options, window.get());
+    }
+  };
+
+  // With FPNGEOptions::block_split (and no history, which is kept per range),
+  // the range is sampled in groups, which may be coded as separate blocks.
+  size_t num_groups = 1;
+  if (options->block_split && history == nullptr) {
+    num_groups = std::min(rows * bytes_per_line / kMinBlockGroupBytes,
+                          std::min(rows / 4, kMaxBlockGroups));
+  }
+  std::vector<BlockSplit> blocks;
+
+  // With a history, the middle quarter of the sample is counted first. A code
+  // fitted to just those rows is always a bit cheaper on them than one built
+  // from the whole sample; if the previous code's overhead over such a fit is
+  // about what it was when it was built, it's reused and the rest isn't
+  // sampled.
+  uint64_t check_counts[286] = {};
+  uint64_t check_dist_counts[30] = {};
+  const uint64_t *check_dists = window ? check_dist_counts : nullptr;
+  uint64_t check_fit_bits = 0;
+  bool reuse_history = false;
+  if (history != nullptr) {
+    size_t span = y1 - y0;
+    size_t check_span = std::max<size_t>(span / 4, std::min<size_t>(span, 2));
+    size_t cy0 = y0 + (span - check_span) / 2;
+    size_t cy1 = cy0 + check_span;
+    sample_rows(cy0, cy1, check_counts, check_dist_counts);
+    check_fit_bits = HuffmanTable(check_counts, check_dists)
+                         .Cost(check_counts, check_dists);
+
+    if (history->bytes_per_line == bytes_per_line &&
+        history->y_begin == y_begin && history->y_end == y_end &&
+        history->predictor == options->predictor &&
+        history->lz77 == options->lz77 && check_fit_bits > 0 &&
+        history->check_fit_bits > 0) {
+      uint64_t check_bits =
+          HuffmanTable(history->nbits, window ? history->dist_nbits : nullptr)
+              .Cost(check_counts, check_dists);
+      reuse_history = check_bits * history->check_fit_bits * 32 <=
+                      history->check_bits * check_fit_bits * 33;
+    }
+    if (!reuse_history) {
+      memcpy(symbol_counts, check_counts, sizeof(symbol_counts));
+      memcpy(dist_counts, check_dist_counts, sizeof(dist_counts));
+      if (cy0 > y0) {
+        sample_rows(y0, cy0 + 1, symbol_counts, dist_counts);
+      }
+      if (cy1 < y1) {
+        sample_rows(cy1 - 1, y1, symbol_counts, dist_counts);
+      }
+    }
+  } else if (num_groups > 1) {
+    // Each group is sampled in two halves, a quarter of the way from either
+    // end; how much those differ shows what a split must beat.
+    blocks.resize(num_groups);
+    double noise_bits = 0;
+    for (size_t g = 0; g < num_groups; g++) {
+      BlockSplit &block = blocks[g];
+      block.y_begin = y_begin + rows * g / num_groups;
+      block.y_end = y_begin + rows * (g + 1) / num_groups;
+      size_t group_rows = block.y_end - block.y_begin;
+      // at least two rows each, as the first is only used for prediction, but
+      // within the group (which has at least four)
+      size_t half_span = std::min(
+          std::max<size_t>(group_rows * (1 + options->huffman_sample) / 256, 3),
+          group_rows);
+      BlockSplit half[2] = {};
+      for (size_t h = 0; h < 2; h++) {
+        size_t centre = group_rows * (1 + 2 * h) / 4;
+        size_t offset = centre > half_span / 2 ? centre - half_span / 2 : 0;
+        size_t hy0 = block.y_begin + std::min(offset, group_rows - half_span);
+        half[h].y_begin = hy0;
+        half[h].y_end = hy0 + half_span;
+        half[h].sampled_rows = half_span - (hy0 != 0);
+        sample_rows(hy0, hy0 + half_span, half[h].symbol_counts,
+                    half[h].dist_counts);
+        AddBlockSample(&block, half[h]);
+      }
+      bool lz77 = window != nullptr;
+      noise_bits += EstimateBlockBits(block, lz77) -
+                    EstimateBlockBits(half[0], lz77) -
+                    EstimateBlockBits(half[1], lz77);
+    }
+    // Halves are closer together than neighbouring groups, and a code built
+    // from fewer rows fits the rest of them less well, so allow some margin.
+    MergeBlocks(blocks, window != nullptr, 4 * noise_bits / num_groups);
+  } else {
+    sample_rows(y0, y1, symbol_counts, dist_counts);
+  }
+
+  memset(buf, 0, buf_size);
+  // The first row is predicted from the last row of the previous range.
+  if (y_begin != 0) {
+    get_row(y_begin - 1,
+            aligned_buf_ptr + ((y_begin - 1) % 2 ? bytes_per_line_buf : 0));
+  }
+
+  if (window) {
+    window->Reset();
+  }
+
+  // Codes rows [ya, yb) as a block using `table`.
+  auto encode_block = [&](size_t ya, size_t yb, const HuffmanTable &table,
+                          bool is_last) {
+    if (!writer.Reserve(FPNGE_STRIPE_OVERHEAD)) {
+      return false;
+    }
+    // dynamic huffman
+    writer.Write(3, is_last ? 0b101 : 0b100);
+    WriteHuffmanCode(table, &writer);
+
+    for (size_t y = ya; y < yb; y++) {
+      unsigned char *current_row_buf =
+          aligned_buf_ptr + (y % 2 ? bytes_per_line_buf : 0);
+      const unsigned char *top_buf =
+          aligned_buf_ptr + ((y + 1) % 2 ? bytes_per_line_buf : 0);
+      const unsigned char *left_buf =
+          current_row_buf - bytes_per_channel * num_channels;
+      const unsigned char *topleft_buf =
+          top_buf - bytes_per_channel * num_channels;
+
+      get_row(y, current_row_buf);
+
+      // filter byte + at most 2 bytes per symbol
+      if (!writer.Reserve(2 * bytes_per_line + 1)) {
+        return false;
+      }
+      EncodeOneRow(bytes_per_line, current_row_buf, top_buf, left_buf,
+                   topleft_buf, aligned_pdata_ptr, table, s1, s2, &writer,
+                   options, window.get());
+
+      crc_pos +=
+          crc.update(writer.data + crc_pos, writer.bytes_written - crc_pos);
+    }
+
+    // EOB, with room for the stored block and the trailing chunks that follow
+    if (!writer.Reserve(64)) {
+      return false;
+    }
+    writer.Write(table.nbits[256], table.end_bits);
+    return true;
+  };
+
+  if (!blocks.empty()) {
+    for (size_t i = 0; i < blocks.size(); i++) {
+      HuffmanTable table(blocks[i].symbol_counts,
+                         window ? blocks[i].dist_counts : nullptr);
+      if (!encode_block(blocks[i].y_begin, blocks[i].y_end, table,
+                        is_final && i + 1 == blocks.size())) {
+        return false;
+      }
+    }
+  } else {
+    HuffmanTable huffman_table =
+        reuse_history
+            ? HuffmanTable(history->nbits,
+                           window ? history->dist_nbits : nullptr)
+            : HuffmanTable(symbol_counts, window ? dist_counts : nullptr);
+    if (history != nullptr && !reuse_history) {
+      memcpy(history->nbits, huffman_table.nbits, sizeof(history->nbits));
+      memcpy(history->dist_nbits, huffman_table.dist_code_nbits,
+             sizeof(history->dist_nbits));
+      history->predictor = options->predictor;
+      history->lz77 = options->lz77;
+      history->bytes_per_line = bytes_per_line;
+      history->y_begin = y_begin;
+      history->y_end = y_end;
+      history->check_bits = huffman_table.Cost(check_counts, check_dists);
+      history->check_fit_bits = check_fit_bits;
+    }
+    if (!encode_block(y_begin, y_end, huffman_table, is_final)) {
+      return false;
+    }
+  }
+
+  if (!is_final) {
+    // empty stored block to byte align
+    writer.Write(3, 0b000);
+    writer.ZeroPadToByte();
+    writer.Write(16, 0x0000);
+    writer.Write(16, 0xFFFF);
+  }
+  return true;
+}
+
+static size_t StripeRows(size_t height, size_t num_stripes) {
+  return (height + num_stripes - 1) / num_stripes;
+}
+
+static size_t StripeScratchSize(size_t bytes_per_channel, size_t num_channels,
+                                size_t width) {
+  return (FPNGEScratchSize(bytes_per_channel, num_channels, width) + 63) & ~63;
+}
+
+static FPNGEHistory *GetHistory(const struct FPNGEOptions *options,
+                               size_t block) {
+  return block < options->num_history ? options->history + block : nullptr;
+}
+
+template <typename GetRow>
+static size_t EncodeImpl(size_t bytes_per_channel, size_t num_channels,
+                         GetRow &&get_row, size_t width, size_t height,
+                         FPNGEOutput *output,
+                         const struct FPNGEOptions *options,
+                         size_t num_stripes, FPNGEParallelFor parallel_for,
+                         void *parallel_opaque, FPNGEOutput *stripe_outputs,
+                         void *scratch) {
+  assert(bytes_per_channel == 1 || bytes_per_channel == 2);
+  assert(num_channels != 0 && num_channels <= 4);
+
   struct FPNGEOptions default_options;
   if (options == nullptr) {
     FPNGEFillOptions(&default_options, FPNGE_COMPRESS_LEVEL_DEFAULT,
@@ -1623,112 +2698,264 @@ extern "C" size_t FPNGEEncode(size_t bytes_per_channel, size_t num_channels,
   // options sanity check
   assert(options->predictor >= 0 && options->predictor <= FPNGE_PREDICTOR_BEST);
   assert(options->huffman_sample >= 0 && options->huffman_sample <= 127);
+  assert(options->num_palette <= 256);
+
+  // Packed palette indices are coded as 8-bit greyscale rows of the packed
+  // width; filters then work on whole bytes, as PNG specifies.
+  size_t image_width = width;
+  if (options->num_palette > 0) {
+    assert(bytes_per_channel == 1 && num_channels == 1);
+    width = FPNGERowBytes(1, 1, width, options);
+  }
+  size_t bytes_per_line = bytes_per_channel * num_channels * width;
+
+  if (num_stripes > height) {
+    num_stripes = height;
+  }
+  if (num_stripes < 1 || parallel_for == nullptr) {
+    num_stripes = 1;
+  }
 
   BitWriter writer;
-  writer.data = static_cast<unsigned char *>(output);
+  writer.Attach(*output);
 
-  WriteHeader(width, height, bytes_per_channel, num_channels,
-              options->cicp_colorspace, options->additional_chunks,
-              options->num_additional_chunks, &writer);
+  const FPNGEAnimationFrame *frame = options->animation_frame;
+  size_t header_size = 1024 + options->num_palette * 4;
+  for (int i = 0; i < options->num_additional_chunks; i++) {
+    header_size += 12 + options->additional_chunks[i].data_size;
+  }
+  if (!writer.Reserve(header_size)) {
+    writer.Detach(output);
+    return 0;
+  }
+  if (frame == nullptr || frame->index == 0) {
+    WriteHeader(image_width, height, bytes_per_channel, num_channels, options,
+                &writer);
+  }
+  if (frame != nullptr) {
+    WriteFrameControl(image_width, height, frame, &writer);
+  }
 
   assert(writer.bits_in_buffer == 0);
   size_t chunk_length_pos = writer.bytes_written;
   writer.bytes_written += 4; // Skip space for length.
   size_t crc_pos = writer.bytes_written;
-  writer.Write(32, 0x54414449); // IDAT
-  // Deflate header
-  writer.Write(8, 8);  // deflate with smallest window
-  writer.Write(8, 29); // cfm+flg check value
-
-  uint64_t symbol_counts[286] = {};
-
-  // Sample rows in the center of the image.
-  size_t y0 = height * (127 - options->huffman_sample) / 256;
-  size_t y1 = height * (129 + options->huffman_sample) / 256;
-  if (y1 == 0 && height > 0) { // for 1 pixel high images
-    y1 = 1;
+  if (frame != nullptr && frame->index > 0) {
+    writer.Write(32, 0x54416466); // fdAT
+    AppendBE32(frame->index * 2, &writer); // sequence number
+  } else {
+    writer.Write(32, 0x54414449); // IDAT
   }
-
-  for (size_t y = y0; y < y1; y++) {
-    const unsigned char *current_row_in =
-        static_cast<const unsigned char *>(data) + row_stride * y;
-    unsigned char *current_row_buf =
-        aligned_buf_ptr + (y % 2 ? bytes_per_line_buf : 0);
-    const unsigned char *top_buf =
-        aligned_buf_ptr + ((y + 1) % 2 ? bytes_per_line_buf : 0);
-    const unsigned char *left_buf =
-        current_row_buf - bytes_per_channel * num_channels;
-    const unsigned char *topleft_buf =
-        top_buf - bytes_per_channel * num_channels;
-
-    CopyRow(current_row_buf, current_row_in, num_channels, bytes_per_channel,
-            (FPNGEColorChannelOrder)options->channel_order, width);
-    if (y == y0 && y != 0) {
-      continue;
-    }
-
-    CollectSymbolCounts(bytes_per_line, current_row_buf, top_buf, left_buf,
-                        topleft_buf, aligned_pdata_ptr, symbol_counts, options);
+  // Deflate header
+  if (options->lz77) {
+    writer.Write(8, 0x78); // deflate with 32KB window
+    writer.Write(8, 0x5E); // cfm+flg check value
+  } else {
+    writer.Write(8, 8);  // deflate with smallest window
+    writer.Write(8, 29); // cfm+flg check value
   }
 
-  memset(buf.data(), 0, buf.size());
-
-  HuffmanTable huffman_table(symbol_counts);
-
-  // Single block, dynamic huffman
-  writer.Write(3, 0b101);
-  WriteHuffmanCode(huffman_table, &writer);
-
   Crc32 crc;
   uint32_t s1 = 1;
   uint32_t s2 = 0;
-  for (size_t y = 0; y < height; y++) {
-    const unsigned char *current_row_in =
-        static_cast<const unsigned char *>(data) + row_stride * y;
-    unsigned char *current_row_buf =
-        aligned_buf_ptr + (y % 2 ? bytes_per_line_buf : 0);
-    const unsigned char *top_buf =
-        aligned_buf_ptr + ((y + 1) % 2 ? bytes_per_line_buf : 0);
-    const unsigned char *left_buf =
-        current_row_buf - bytes_per_channel * num_channels;
-    const unsigned char *topleft_buf =
-        top_buf - bytes_per_channel * num_channels;
-
-    CopyRow(current_row_buf, current_row_in, num_channels, bytes_per_channel,
-            (FPNGEColorChannelOrder)options->channel_order, width);
-
-    EncodeOneRow(bytes_per_line, current_row_buf, top_buf, left_buf,
-                 topleft_buf, aligned_pdata_ptr, huffman_table, s1, s2, &writer,
-                 options);
+  uint32_t adler32;
+  uint32_t idat_crc;
+  if (num_stripes == 1) {
+    if (!EncodeRowRange(bytes_per_channel, num_channels, get_row, width, 0,
+                        height, true, options, GetHistory(options, 0), scratch,
+                        writer, crc, crc_pos, s1, s2)) {
+      writer.Detach(output);
+      return 0;
+    }
+    writer.ZeroPadToByte();
+    assert(writer.bits_in_buffer == 0);
+    s1 %= kAdler32Mod;
+    s2 %= kAdler32Mod;
+    adler32 = (s2 << 16) | s1;
+    AppendBE32(adler32, &writer);
+    idat_crc =
+        crc.update_final(writer.data + crc_pos, writer.bytes_written - crc_pos);
+  } else {
+    // Each stripe is a separate block, encoded into its own buffer, except the
+    // first, which is written in place. The stripes are then concatenated, and
+    // their checksums combined.
+    size_t stripe_rows = StripeRows(height, num_stripes);
+    num_stripes = (height + stripe_rows - 1) / stripe_rows;
+    size_t row_scratch_size =
+        StripeScratchSize(bytes_per_channel, num_channels, width);
+    unsigned char *scratch_base = static_cast<unsigned char *>(scratch);
+
+    struct Stripe {
+      BitWriter writer;
+      uint32_t crc;
+      uint32_t adler32;
+      bool ok;
+    };
+    std::vector<Stripe> stripes(num_stripes);
+    stripes[0].writer = writer;
+    for (size_t i = 1; i < num_stripes; i++) {
+      stripes[i].writer.Attach(stripe_outputs[i - 1]);
+    }
 
-    crc_pos +=
-        crc.update(writer.data + crc_pos, writer.bytes_written - crc_pos);
+    struct Job {
+      GetRow &get_row;
+      std::vector<Stripe> &stripes;
+      size_t bytes_per_channel, num_channels, width, height, stripe_rows;
+      const struct FPNGEOptions *options;
+      unsigned char *scratch_base;
+      size_t row_scratch_size, first_crc_pos;
+
+      static void Run(void *arg, size_t i) {
+        Job &job = *static_cast<Job *>(arg);
+        Stripe &stripe = job.stripes[i];
+        size_t crc_pos = i == 0 ? job.first_crc_pos : 0;
+        size_t y_begin = i * job.stripe_rows;
+        size_t y_end = std::min(y_begin + job.stripe_rows, job.height);
+        bool is_final = y_end == job.height;
+        Crc32 crc;
+        uint32_t s1 = 1;
+        uint32_t s2 = 0;
+        stripe.ok = EncodeRowRange(
+            job.bytes_per_channel, job.num_channels, job.get_row, job.width,
+            y_begin, y_end, is_final, job.options,
+            GetHistory(job.options, i),
+            job.scratch_base + job.row_scratch_size * i, stripe.writer, crc,
+            crc_pos, s1, s2);
+        if (!stripe.ok) {
+          return;
+        }
+        stripe.writer.ZeroPadToByte();
+        stripe.crc = crc.update_final(stripe.writer.data + crc_pos,
+                                      stripe.writer.bytes_written - crc_pos);
+        stripe.adler32 = ((s2 % kAdler32Mod) << 16) | (s1 % kAdler32Mod);
+      }
+    } job{get_row,      stripes,          bytes_per_channel, num_channels,
+          width,        height,           stripe_rows,       options,
+          scratch_base, row_scratch_size, crc_pos};
+    parallel_for(parallel_opaque, num_stripes, Job::Run, &job);
+
+    bool ok = true;
+    size_t total_len = 0;
+    for (size_t i = 1; i < num_stripes; i++) {
+      stripes[i].writer.Detach(&stripe_outputs[i - 1]);
+      ok = ok && stripes[i].ok;
+      total_len += stripes[i].writer.bytes_written;
+    }
+    writer = stripes[0].writer;
+    if (!ok || !stripes[0].ok || !writer.Reserve(total_len + 64)) {
+      writer.Detach(output);
+      return 0;
+    }
+    idat_crc = stripes[0].crc;
+    adler32 = stripes[0].adler32;
+    for (size_t i = 1; i < num_stripes; i++) {
+      size_t len = stripes[i].writer.bytes_written;
+      size_t rows = std::min(stripe_rows, height - i * stripe_rows);
+      writer.WriteBytes(reinterpret_cast<const char *>(stripes[i].writer.data),
+                        len);
+      idat_crc = Crc32Combine(idat_crc, stripes[i].crc, len);
+      adler32 = Adler32Combine(adler32, stripes[i].adler32,
+                               rows * (bytes_per_line + 1));
+    }
+    size_t adler_pos = writer.bytes_written;
+    AppendBE32(adler32, &writer);
+    idat_crc = Crc32Combine(idat_crc,
+                            Crc32().update_final(writer.data + adler_pos, 4), 4);
   }
 
-  // EOB
-  writer.Write(huffman_table.nbits[256], huffman_table.end_bits);
-
-  writer.ZeroPadToByte();
-  assert(writer.bits_in_buffer == 0);
-  s1 %= kAdler32Mod;
-  s2 %= kAdler32Mod;
-  uint32_t adler32 = (s2 << 16) | s1;
-  AppendBE32(adler32, &writer);
-
   size_t data_len = writer.bytes_written - chunk_length_pos - 8;
   writer.data[chunk_length_pos + 0] = data_len >> 24;
   writer.data[chunk_length_pos + 1] = (data_len >> 16) & 0xFF;
   writer.data[chunk_length_pos + 2] = (data_len >> 8) & 0xFF;
   writer.data[chunk_length_pos + 3] = data_len & 0xFF;
 
-  auto final_crc =
-      crc.update_final(writer.data + crc_pos, writer.bytes_written - crc_pos);
-  AppendBE32(final_crc, &writer);
+  AppendBE32(idat_crc, &writer);
 
-  // IEND
-  writer.Write(32, 0);
-  writer.Write(32, 0x444e4549);
-  writer.Write(32, 0x826042ae);
+  if (frame == nullptr || frame->index + 1 == frame->num_frames) {
+    // IEND
+    writer.Write(32, 0);
+    writer.Write(32, 0x444e4549);
+    writer.Write(32, 0x826042ae);
+  }
 
+  writer.Detach(output);
   return writer.bytes_written;
 }
+
+#ifndef FPNGE_ISA
+extern "C" size_t FPNGEEncode(size_t bytes_per_channel, size_t num_channels,
+                              const void *data, size_t width, size_t row_stride,
+                              size_t height, void *output,
+                              const struct FPNGEOptions *options) {
+  std::vector<unsigned char> scratch(
+      FPNGEScratchSize(bytes_per_channel, num_channels, width));
+  FPNGEOutput out = {output,
+                     FPNGEOutputAllocSize(bytes_per_channel, num_channels,
+                                          width, height),
+                     nullptr, nullptr};
+  return FPNGEEncodeWithScratch(bytes_per_channel, num_channels, data, width,
+                                row_stride, height, &out, options,
+                                scratch.data());
+}
+#endif
+
+extern "C" size_t
+FPNGEEncodeWithScratch(size_t bytes_per_channel, size_t num_channels,
+                       const void *data, size_t width, size_t row_stride,
+                       size_t height, struct FPNGEOutput *output,
+                       const struct FPNGEOptions *options, void *scratch) {
+  size_t row_bytes =
+      FPNGERowBytes(bytes_per_channel, num_channels, width, options);
+  assert(row_stride >= row_bytes);
+  FPNGEColorChannelOrder order =
+      options ? (FPNGEColorChannelOrder)options->channel_order
+              : FPNGE_ORDER_RGB;
+  return EncodeImpl(
+      bytes_per_channel, num_channels,
+      [&](size_t y, unsigned char *dst) {
+        CopyRow(dst, static_cast<const unsigned char *>(data) + row_stride * y,
+                num_channels, bytes_per_channel, order,
+                row_bytes / (bytes_per_channel * num_channels));
+      },
+      width, height, output, options, 1, nullptr, nullptr, nullptr, scratch);
+}
+
+extern "C" size_t FPNGEEncodeRows(size_t bytes_per_channel,
+                                  size_t num_channels, FPNGERowCallback get_row,
+                                  void *opaque, size_t width, size_t height,
+                                  struct FPNGEOutput *output,
+                                  const struct FPNGEOptions *options,
+                                  void *scratch) {
+  return EncodeImpl(
+      bytes_per_channel, num_channels,
+      [&](size_t y, unsigned char *dst) { get_row(opaque, y, dst); }, width,
+      height, output, options, 1, nullptr, nullptr, nullptr, scratch);
+}
+
+extern "C" size_t FPNGEParallelScratchSize(size_t bytes_per_channel,
+                                           size_t num_channels, size_t width,
+                                           size_t height, size_t num_stripes) {
+  if (num_stripes > height) {
+    num_stripes = height;
+  }
+  if (num_stripes <= 1) {
+    return FPNGEScratchSize(bytes_per_channel, num_channels, width);
+  }
+  size_t stripe_rows = StripeRows(height, num_stripes);
+  num_stripes = (height + stripe_rows - 1) / stripe_rows;
+  return StripeScratchSize(bytes_per_channel, num_channels, width) *
+         num_stripes;
+}
+
+extern "C" size_t FPNGEEncodeRowsParallel(
+    size_t bytes_per_channel, size_t num_channels, FPNGERowCallback get_row,
+    void *opaque, size_t width, size_t height, struct FPNGEOutput *output,
+    const struct FPNGEOptions *options, size_t num_stripes,
+    FPNGEParallelFor parallel_for, void *parallel_opaque,
+    struct FPNGEOutput *stripe_outputs, void *scratch) {
+  return EncodeImpl(
+      bytes_per_channel, num_channels,
+      [&](size_t y, unsigned char *dst) { get_row(opaque, y, dst); }, width,
+      height, output, options, num_stripes, parallel_for, parallel_opaque,
+      stripe_outputs, scratch);
+}
@@ -13,6 +13,7 @@
 // limitations under the License.
 #ifndef FPNGE_H
 #define FPNGE_H
+#include <stdint.h>
 #include <stdlib.h>
 
 #ifdef __cplusplus
@@ -42,17 +43,99 @@ struct FPNGEAdditionalChunk {
   int data_size;
 };
 
+// The Huffman code used for a deflate block, kept so that it can be reused for
+// the corresponding block of the next, similar, image (e.g. consecutive video
+// frames). Zero-initialise before first use.
+struct FPNGEHistory {
+  unsigned char nbits[286];
+  unsigned char dist_nbits[30];
+  char predictor;
+  char lz77;
+  size_t bytes_per_line, y_begin, y_end; // all zero if unset
+  // cost, in bits, of the rows used to check that the code still fits, with
+  // this code and with one fitted to just those rows
+  size_t check_bits, check_fit_bits;
+};
+
+// How an APNG frame's region is treated once it's been shown, and how the
+// frame is combined with the canvas.
+enum FPNGEDisposeOp {
+  FPNGE_DISPOSE_OP_NONE = 0,
+  FPNGE_DISPOSE_OP_BACKGROUND = 1,
+  FPNGE_DISPOSE_OP_PREVIOUS = 2,
+};
+enum FPNGEBlendOp {
+  FPNGE_BLEND_OP_SOURCE = 0,
+  FPNGE_BLEND_OP_OVER = 1,
+};
+// One frame of an animated PNG (APNG). The outputs for frames 0 to
+// `num_frames - 1`, concatenated in order, form the whole file: frame 0 starts
+// it, with the PNG header and acTL, and is the default image, so must cover
+// the canvas (which its size sets). Later frames only write fcTL and fdAT
+// chunks, for a region of the canvas, and the last adds IEND. Every frame must
+// use the same pixel format and palette.
+struct FPNGEAnimationFrame {
+  uint32_t index;
+  uint32_t num_frames;
+  uint32_t num_plays; // 0 = loop forever
+  uint32_t x_offset, y_offset;
+  // shown for delay_num / delay_den seconds (a denominator of 0 means 100)
+  uint16_t delay_num, delay_den;
+  char dispose_op; // FPNGEDisposeOp
+  char blend_op;   // FPNGEBlendOp
+};
+
 struct FPNGEOptions {
   char predictor;       // FPNGEOptionsPredictor
   char huffman_sample;  // 0-127: how much of the image to sample
   char cicp_colorspace; // FPNGECicpColorspace
   char channel_order;   // FPNGEColorChannelOrder
+  char lz77;            // 0/1: also search for repeats beyond runs (slower)
+  // 0/1: sample rows throughout the image, and start a new deflate block, with
+  // its own Huffman code, where the statistics change enough to be worth it
+  // (e.g. at letterboxing or overlays). Not done for blocks with a history.
+  char block_split;
   int num_additional_chunks;
   const struct FPNGEAdditionalChunk *additional_chunks;
+  // If set, `history[i]` carries the Huffman code of deflate block `i` across
+  // encodes. Where it was made for a block of the same geometry, only a
+  // fraction of the usual rows are sampled first, and if the previous code
+  // still fits them about as well as when it was built, it's reused; otherwise
+  // the rest is sampled as normal and the history replaced. Blocks from
+  // `num_history` onwards are unaffected.
+  struct FPNGEHistory *history;
+  size_t num_history;
+  // If non-zero, the image is palette based: `palette` holds `num_palette`
+  // (at most 256) RGBA entries, and the input is a single 8-bit channel of
+  // indices into it, packed into FPNGEPaletteBitDepth(num_palette) bits per
+  // pixel, leftmost pixel in the most significant bits (as in PNG).
+  const unsigned char *palette;
+  size_t num_palette;
+  // If set, writes this frame of an animated PNG, rather than a standalone
+  // PNG.
+  const struct FPNGEAnimationFrame *animation_frame;
 };
 
+// Bits per index for a palette of `num_palette` entries.
+inline size_t FPNGEPaletteBitDepth(size_t num_palette) {
+  return num_palette <= 2    ? 1
+         : num_palette <= 4  ? 2
+         : num_palette <= 16 ? 4
+                             : 8;
+}
+
+// Bytes per row of the input for the given options, i.e. for palette images,
+// of the packed indices.
+inline size_t FPNGERowBytes(size_t bytes_per_channel, size_t num_channels,
+                            size_t width, const struct FPNGEOptions *options) {
+  if (options != NULL && options->num_palette > 0) {
+    return (width * FPNGEPaletteBitDepth(options->num_palette) + 7) / 8;
+  }
+  return bytes_per_channel * num_channels * width;
+}
+
 #define FPNGE_COMPRESS_LEVEL_DEFAULT 4
-#define FPNGE_COMPRESS_LEVEL_BEST 5
+#define FPNGE_COMPRESS_LEVEL_BEST 6
 inline void FPNGEFillOptions(struct FPNGEOptions *options, int level,
                              int cicp_colorspace) {
   if (level == 0)
@@ -62,6 +145,13 @@ inline void FPNGEFillOptions(struct FPNGEOptions *options, int level,
   options->num_additional_chunks = 0;
   options->additional_chunks = NULL;
   options->channel_order = FPNGE_ORDER_RGB;
+  options->lz77 = 0;
+  options->block_split = level >= 5;
+  options->history = NULL;
+  options->num_history = 0;
+  options->palette = NULL;
+  options->num_palette = 0;
+  options->animation_frame = NULL;
   switch (level) {
   case 1:
     options->predictor = 2;
@@ -72,6 +162,9 @@ inline void FPNGEFillOptions(struct FPNGEOptions *options, int level,
   case 3:
     options->predictor = 5;
     break;
+  case 6:
+    options->lz77 = 1;
+    // fall through
   case 5:
     options->huffman_sample = 23;
     // fall through
@@ -88,6 +181,80 @@ size_t FPNGEEncode(size_t bytes_per_channel, size_t num_channels,
                    size_t height, void *output,
                    const struct FPNGEOptions *options);
 
+// Enlarges an output buffer to at least `size` bytes, retaining the first
+// `used` bytes. Returns the (possibly moved) buffer, or NULL on failure.
+typedef void *(*FPNGEOutputGrow)(void *opaque, size_t size, size_t used);
+
+// Output buffer for the functions below. If `grow` is NULL, the buffer is
+// assumed to be large enough (see FPNGEOutputAllocSize), otherwise it's grown
+// as needed, so can start off small (or NULL). On return, `data` and `size`
+// describe the buffer holding the encoded image.
+struct FPNGEOutput {
+  void *data;
+  size_t size;
+  FPNGEOutputGrow grow;
+  void *opaque;
+};
+
+// Size of the working memory needed by FPNGEEncodeWithScratch.
+size_t FPNGEScratchSize(size_t bytes_per_channel, size_t num_channels,
+                        size_t width);
+
+// As FPNGEEncode, but uses `scratch` (at least FPNGEScratchSize bytes, no
+// alignment requirement) as working memory instead of allocating it, and
+// writes to `output`. Returns 0 if the output couldn't be grown.
+size_t FPNGEEncodeWithScratch(size_t bytes_per_channel, size_t num_channels,
+                              const void *data, size_t width,
+                              size_t row_stride, size_t height,
+                              struct FPNGEOutput *output,
+                              const struct FPNGEOptions *options,
+                              void *scratch);
+
+// Writes row `y` of the image to `dst`, in the same layout as FPNGEEncode's
+// input (RGB(A) order, 16-bit samples big-endian). `dst` is aligned to the
+// SIMD width fpnge was compiled for (with runtime dispatch, that of the build
+// selected for the CPU). Rows may be requested more than once, and not
+// necessarily in order.
+typedef void (*FPNGERowCallback)(void *opaque, size_t y, unsigned char *dst);
+
+// As FPNGEEncodeWithScratch, but obtains rows via `get_row`, which writes them
+// directly into fpnge's row buffer. `options->channel_order` is ignored.
+size_t FPNGEEncodeRows(size_t bytes_per_channel, size_t num_channels,
+                       FPNGERowCallback get_row, void *opaque, size_t width,
+                       size_t height, struct FPNGEOutput *output,
+                       const struct FPNGEOptions *options, void *scratch);
+
+// Runs `fn(arg, i)` for each `i` in [0, count), potentially in parallel, and
+// returns once all have completed.
+typedef void (*FPNGEParallelFor)(void *opaque, size_t count,
+                                 void (*fn)(void *arg, size_t i), void *arg);
+
+// Size of the working memory needed by FPNGEEncodeRowsParallel.
+size_t FPNGEParallelScratchSize(size_t bytes_per_channel, size_t num_channels,
+                                size_t width, size_t height,
+                                size_t num_stripes);
+
+// As FPNGEEncodeRows, but splits the image into (up to) `num_stripes`
+// horizontal stripes, each encoded as a separate deflate block with its own
+// Huffman table, using `parallel_for` to encode them concurrently. `get_row`
+// must be safe to call from multiple threads. The first stripe is written to
+// `output`; the others are encoded into `stripe_outputs[0..num_stripes-2]`,
+// then appended to it. Buffers which can't grow must be at least
+// FPNGEParallelOutputAllocSize bytes.
+size_t FPNGEEncodeRowsParallel(size_t bytes_per_channel, size_t num_channels,
+                               FPNGERowCallback get_row, void *opaque,
+                               size_t width, size_t height,
+                               struct FPNGEOutput *output,
+                               const struct FPNGEOptions *options,
+                               size_t num_stripes,
+                               FPNGEParallelFor parallel_for,
+                               void *parallel_opaque,
+                               struct FPNGEOutput *stripe_outputs,
+                               void *scratch);
+
+// Allowance for the Huffman code and padding of each stripe.
+#define FPNGE_STRIPE_OVERHEAD 256
+
 inline size_t FPNGEOutputAllocSize(size_t bytes_per_channel,
                                    size_t num_channels, size_t width,
                                    size_t height) {
@@ -95,6 +262,13 @@ inline size_t FPNGEOutputAllocSize(size_t bytes_per_channel,
   return 1024 + (2 * bytes_per_channel * width * num_channels + 1) * height;
 }
 
+inline size_t FPNGEParallelOutputAllocSize(size_t bytes_per_channel,
+                                           size_t num_channels, size_t width,
+                                           size_t height, size_t num_stripes) {
+  return FPNGEOutputAllocSize(bytes_per_channel, num_channels, width, height) +
+         FPNGE_STRIPE_OVERHEAD * num_stripes;
+}
+
 #ifdef __cplusplus
 }
 #endif
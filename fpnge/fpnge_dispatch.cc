@@ -0,0 +1,135 @@
+// Runtime instruction set dispatch: fpnge.cc is built once per supported
+// instruction set, with FPNGE_ISA defined, and calls are forwarded to the best
+// one the CPU supports.
+
+#include "fpnge.h"
+#include <vector>
+
+#define FPNGE_DECLARE_ISA(isa)                                                 \
+  size_t FPNGEScratchSize_##isa(size_t bytes_per_channel,                      \
+                                size_t num_channels, size_t width);            \
+  size_t FPNGEEncodeWithScratch_##isa(                                         \
+      size_t bytes_per_channel, size_t num_channels, const void *data,         \
+      size_t width, size_t row_stride, size_t height,                          \
+      struct FPNGEOutput *output, const struct FPNGEOptions *options,          \
+      void *scratch);                                                          \
+  size_t FPNGEEncodeRows_##isa(                                                \
+      size_t bytes_per_channel, size_t num_channels, FPNGERowCallback get_row, \
+      void *opaque, size_t width, size_t height, struct FPNGEOutput *output,   \
+      const struct FPNGEOptions *options, void *scratch);                      \
+  size_t FPNGEParallelScratchSize_##isa(size_t bytes_per_channel,              \
+                                        size_t num_channels, size_t width,     \
+                                        size_t height, size_t num_stripes);    \
+  size_t FPNGEEncodeRowsParallel_##isa(                                        \
+      size_t bytes_per_channel, size_t num_channels, FPNGERowCallback get_row, \
+      void *opaque, size_t width, size_t height, struct FPNGEOutput *output,   \
+      const struct FPNGEOptions *options, size_t num_stripes,                  \
+      FPNGEParallelFor parallel_for, void *parallel_opaque,                    \
+      struct FPNGEOutput *stripe_outputs, void *scratch);
+
+extern "C" {
+FPNGE_DECLARE_ISA(sse41)
+FPNGE_DECLARE_ISA(avx2)
+FPNGE_DECLARE_ISA(avx512)
+}
+
+namespace {
+
+struct Impl {
+  decltype(&FPNGEScratchSize) scratch_size;
+  decltype(&FPNGEEncodeWithScratch) encode_with_scratch;
+  decltype(&FPNGEEncodeRows) encode_rows;
+  decltype(&FPNGEParallelScratchSize) parallel_scratch_size;
+  decltype(&FPNGEEncodeRowsParallel) encode_rows_parallel;
+};
+
+#define FPNGE_IMPL(isa)                                                        \
+  {                                                                            \
+    FPNGEScratchSize_##isa, FPNGEEncodeWithScratch_##isa,                      \
+        FPNGEEncodeRows_##isa, FPNGEParallelScratchSize_##isa,                 \
+        FPNGEEncodeRowsParallel_##isa                                          \
+  }
+
+const Impl kImplSSE41 = FPNGE_IMPL(sse41);
+const Impl kImplAVX2 = FPNGE_IMPL(avx2);
+const Impl kImplAVX512 = FPNGE_IMPL(avx512);
+
+const Impl &SelectImpl() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw") &&
+      __builtin_cpu_supports("avx512vl") &&
+      __builtin_cpu_supports("avx512dq")) {
+    return kImplAVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return kImplAVX2;
+  }
+  // SSE4.1 is the minimum requirement
+  return kImplSSE41;
+}
+
+const Impl &GetImpl() {
+  static const Impl &impl = SelectImpl();
+  return impl;
+}
+
+} // namespace
+
+extern "C" size_t FPNGEEncode(size_t bytes_per_channel, size_t num_channels,
+                              const void *data, size_t width, size_t row_stride,
+                              size_t height, void *output,
+                              const struct FPNGEOptions *options) {
+  std::vector<unsigned char> scratch(
+      FPNGEScratchSize(bytes_per_channel, num_channels, width));
+  FPNGEOutput out = {output,
+                     FPNGEOutputAllocSize(bytes_per_channel, num_channels,
+                                          width, height),
+                     nullptr, nullptr};
+  return FPNGEEncodeWithScratch(bytes_per_channel, num_channels, data, width,
+                                row_stride, height, &out, options,
+                                scratch.data());
+}
+
+extern "C" size_t FPNGEScratchSize(size_t bytes_per_channel,
+                                   size_t num_channels, size_t width) {
+  return GetImpl().scratch_size(bytes_per_channel, num_channels, width);
+}
+
+extern "C" size_t
+FPNGEEncodeWithScratch(size_t bytes_per_channel, size_t num_channels,
+                       const void *data, size_t width, size_t row_stride,
+                       size_t height, struct FPNGEOutput *output,
+                       const struct FPNGEOptions *options, void *scratch) {
+  return GetImpl().encode_with_scratch(bytes_per_channel, num_channels, data,
+                                       width, row_stride, height, output,
+                                       options, scratch);
+}
+
+extern "C" size_t FPNGEEncodeRows(size_t bytes_per_channel,
+                                  size_t num_channels, FPNGERowCallback get_row,
+                                  void *opaque, size_t width, size_t height,
+                                  struct FPNGEOutput *output,
+                                  const struct FPNGEOptions *options,
+                                  void *scratch) {
+  return GetImpl().encode_rows(bytes_per_channel, num_channels, get_row, opaque,
+                               width, height, output, options, scratch);
+}
+
+extern "C" size_t FPNGEParallelScratchSize(size_t bytes_per_channel,
+                                           size_t num_channels, size_t width,
+                                           size_t height, size_t num_stripes) {
+  return GetImpl().parallel_scratch_size(bytes_per_channel, num_channels,
+                                         width, height, num_stripes);
+}
+
+extern "C" size_t FPNGEEncodeRowsParallel(
+    size_t bytes_per_channel, size_t num_channels, FPNGERowCallback get_row,
+    void *opaque, size_t width, size_t height, struct FPNGEOutput *output,
+    const struct FPNGEOptions *options, size_t num_stripes,
+    FPNGEParallelFor parallel_for, void *parallel_opaque,
+    struct FPNGEOutput *stripe_outputs, void *scratch) {
+  return GetImpl().encode_rows_parallel(
+      bytes_per_channel, num_channels, get_row, opaque, width, height, output,
+      options, num_stripes, parallel_for, parallel_opaque, stripe_outputs,
+      scratch);
+}
@@ -0,0 +1,139 @@
+#include "imagecache.h"
+#include <VSHelper4.h>
+#include <cstring>
+
+// bookkeeping per entry, counted towards the capacity so that many tiny images can't exceed it by much
+static const size_t ENTRY_OVERHEAD = 128;
+
+ImageCache::ImageCache() : capacity(0), used(0), hits(0), misses(0) {}
+
+ImageCache::~ImageCache() {
+	evict(0);
+}
+
+void ImageCache::evict(size_t limit) {
+	while(used > limit) {
+		Entry& entry = entries.back();
+		used -= entry.size + ENTRY_OVERHEAD;
+		VSH_ALIGNED_FREE(entry.data);
+		index.erase(entry.key);
+		entries.pop_back();
+	}
+}
+
+bool ImageCache::lookup(const ImageCacheKey& key, uint8_t*& data, size_t& size) {
+	if(!enabled()) return false;
+	std::lock_guard<std::mutex> lk(mutex);
+	auto it = index.find(key);
+	if(it == index.end()) {
+		misses++;
+		return false;
+	}
+	const Entry& entry = *it->second;
+	VSH_ALIGNED_MALLOC(&data, entry.size ? entry.size : 1, 64);
+	if(!data) return false;
+	memcpy(data, entry.data, entry.size);
+	size = entry.size;
+	entries.splice(entries.begin(), entries, it->second);
+	hits++;
+	return true;
+}
+
+void ImageCache::insert(const ImageCacheKey& key, const uint8_t* data, size_t size) {
+	// an image taking more than a quarter of the cache would push out too much else
+	if(size + ENTRY_OVERHEAD > capacity.load(std::memory_order_relaxed) / 4) return;
+	uint8_t* copy;
+	VSH_ALIGNED_MALLOC(&copy, size ? size : 1, 64);
+	if(!copy) return;
+	memcpy(copy, data, size);
+	
+	std::lock_guard<std::mutex> lk(mutex);
+	// check again, in case another thread added the same image, or shrunk the cache, in the meantime
+	size_t limit = capacity;
+	if(index.count(key) || size + ENTRY_OVERHEAD > limit / 4) {
+		VSH_ALIGNED_FREE(copy);
+		return;
+	}
+	evict(limit - (size + ENTRY_OVERHEAD));
+	entries.push_front({key, copy, size});
+	index.emplace(key, entries.begin());
+	used += size + ENTRY_OVERHEAD;
+}
+
+void ImageCache::setCapacity(size_t bytes) {
+	std::lock_guard<std::mutex> lk(mutex);
+	capacity = bytes;
+	evict(bytes);
+}
+
+ImageCache::Stats ImageCache::stats() {
+	std::lock_guard<std::mutex> lk(mutex);
+	return {hits, misses, entries.size(), used};
+}
+
+ImageCache& ImageCache::global() {
+	static ImageCache cache;
+	return cache;
+}
+
+
+bool InFlightEncodes::wait(const ImageCacheKey& key, uint8_t*& data, size_t& size, std::string& error) {
+	std::shared_ptr<Flight> flight;
+	{
+		std::unique_lock<std::mutex> lk(mutex);
+		auto it = flights.find(key);
+		if(it == flights.end()) {
+			flights.emplace(key, std::make_shared<Flight>(Flight{false, 0, false, {}, {}}));
+			return false;
+		}
+		flight = it->second;
+		flight->waiters++;
+		cond.wait(lk, [&] { return flight->finished; });
+		if(flight->ok) shared++;
+	}
+	
+	// the flight's result is no longer modified, so can be read without the lock
+	data = nullptr;
+	if(!flight->ok) {
+		error = flight->error;
+		return true;
+	}
+	size = flight->data.size();
+	VSH_ALIGNED_MALLOC(&data, size ? size : 1, 64);
+	if(!data) {
+		error = "Failed to allocate output buffer";
+		return true;
+	}
+	memcpy(data, flight->data.data(), size);
+	return true;
+}
+
+void InFlightEncodes::finish(const ImageCacheKey& key, const uint8_t* data, size_t size, const std::string& error) {
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		auto it = flights.find(key);
+		if(it == flights.end()) return;
+		Flight& flight = *it->second;
+		// only copy the result if something will use it
+		if(flight.waiters) {
+			flight.ok = data != nullptr;
+			if(data)
+				flight.data.assign(data, data + size);
+			else
+				flight.error = error;
+		}
+		flight.finished = true;
+		flights.erase(it);
+	}
+	cond.notify_all();
+}
+
+uint64_t InFlightEncodes::sharedCount() {
+	std::lock_guard<std::mutex> lk(mutex);
+	return shared;
+}
+
+InFlightEncodes& InFlightEncodes::global() {
+	static InFlightEncodes flights;
+	return flights;
+}
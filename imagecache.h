@@ -0,0 +1,106 @@
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// identifies an encoded image: a hash of the source frame (its pixels, dimensions and format), plus the options it
+// was encoded with
+struct ImageCacheKey {
+	uint64_t content[2];
+	uint64_t params;
+	
+	bool operator==(const ImageCacheKey& other) const {
+		return content[0] == other.content[0] && content[1] == other.content[1] && params == other.params;
+	}
+};
+
+struct ImageCacheKeyHash {
+	size_t operator()(const ImageCacheKey& key) const {
+		return size_t(key.content[0] ^ key.params);
+	}
+};
+
+// LRU cache of encoded images, bounded by the total size of the images it holds
+class ImageCache {
+	struct Entry {
+		ImageCacheKey key;
+		uint8_t* data;
+		size_t size;
+	};
+	
+	std::mutex mutex;
+	std::list<Entry> entries; // most recently used first
+	std::unordered_map<ImageCacheKey, std::list<Entry>::iterator, ImageCacheKeyHash> index;
+	std::atomic<size_t> capacity; // in bytes; 0 = disabled
+	size_t used;
+	uint64_t hits, misses;
+	
+	// drop the least recently used entries until `used` is at most `limit`; called with the mutex held
+	void evict(size_t limit);
+public:
+	ImageCache();
+	~ImageCache();
+	ImageCache(const ImageCache&) = delete;
+	ImageCache& operator=(const ImageCache&) = delete;
+	
+	bool enabled() const { return capacity.load(std::memory_order_relaxed) > 0; }
+	// on a hit, returns a copy of the image, allocated with VSH_ALIGNED_MALLOC
+	bool lookup(const ImageCacheKey& key, uint8_t*& data, size_t& size);
+	// stores a copy of the image, if it fits
+	void insert(const ImageCacheKey& key, const uint8_t* data, size_t size);
+	// sets the memory limit, evicting entries which no longer fit (0 disables the cache and frees everything)
+	void setCapacity(size_t bytes);
+	
+	struct Stats {
+		uint64_t hits, misses;
+		size_t entries, bytes;
+	};
+	Stats stats();
+	
+	// shared cache, disabled until given a capacity
+	static ImageCache& global();
+};
+
+// encodes in progress, so that a request for an image which is already being encoded waits for that encode to finish
+// and shares its result, rather than repeating it
+class InFlightEncodes {
+	struct Flight {
+		bool finished;
+		int waiters;
+		bool ok;
+		std::vector<uint8_t> data;
+		std::string error;
+	};
+	
+	std::mutex mutex;
+	std::condition_variable cond; // signalled whenever a flight finishes
+	std::unordered_map<ImageCacheKey, std::shared_ptr<Flight>, ImageCacheKeyHash> flights;
+	uint64_t shared;
+public:
+	InFlightEncodes() : shared(0) {}
+	InFlightEncodes(const InFlightEncodes&) = delete;
+	InFlightEncodes& operator=(const InFlightEncodes&) = delete;
+	
+	// if `key` is already being encoded, waits for it and returns true, with either `data` set to a copy of the image
+	// (allocated with VSH_ALIGNED_MALLOC), or `data` null and `error` set if it failed
+	// otherwise returns false, and the caller must encode the image, then call finish()
+	bool wait(const ImageCacheKey& key, uint8_t*& data, size_t& size, std::string& error);
+	// hands the result to anything waiting on `key`; `data` is null if the encode failed
+	void finish(const ImageCacheKey& key, const uint8_t* data, size_t size, const std::string& error);
+	
+	// number of requests which were given another request's image
+	uint64_t sharedCount();
+	
+	static InFlightEncodes& global();
+};
+
+#endif
@@ -0,0 +1,853 @@
+// SIMD kernels for converting planar frames into the interleaved layouts the encoders take
+// this file is compiled once per instruction set, with INTERLEAVE_ISA naming the build; see interleave.h
+#include <VSHelper4.h>
+#include <cstring>
+
+#include "interleave.h"
+
+#ifndef INTERLEAVE_ISA
+# error INTERLEAVE_ISA must be defined
+#endif
+
+// requires SSE4.1 minimum
+#ifdef __AVX2__
+# include <immintrin.h>
+# define MWORD_SIZE 32  // sizeof(__m256i)
+# define MM(f) _mm256_##f
+# define MMSI(f) _mm256_##f##_si256
+# define MIVEC __m256i
+# define BCAST128 _mm256_broadcastsi128_si256
+# define SWAP_MID64(x) _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3,1,2,0))
+#else
+# include <smmintrin.h>
+# define MWORD_SIZE 16  // sizeof(__m128i)
+# define MM(f) _mm_##f
+# define MMSI(f) _mm_##f##_si128
+# define MIVEC __m128i
+# define BCAST128(v) (v)
+# define SWAP_MID64(x) (x)
+#endif
+
+/// planar -> interleaved conversion
+
+static inline void copy1x16b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, int width, int bits, bool endianSwap) {
+	uint16_t* d16 = reinterpret_cast<uint16_t*>(dst);
+	const uint16_t* s0_16 = reinterpret_cast<const uint16_t*>(src0);
+	int shl = endianSwap ? (24-bits) : (16-bits);
+	int shr = endianSwap ? (bits-8) : (bits*2 - 16);
+	__m128i vshl = _mm_set_epi32(0, shr, 0, shl);
+	__m128i vshr = _mm_unpackhi_epi64(vshl, vshl);
+	
+	int x = 0;
+	for(; x<width-MWORD_SIZE/2+1; x+=MWORD_SIZE/2) {
+		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s0_16 + x));
+		s0 = MMSI(or)(MM(sll_epi16)(s0, vshl), MM(srl_epi16)(s0, vshr));
+		MMSI(store)(reinterpret_cast<MIVEC*>(d16 + x), s0);
+	}
+	for(; x<width; x++) {
+		d16[x] = (s0_16[x] << shl) | (s0_16[x] >> shr);
+	}
+}
+
+static inline void interleave2x8b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, int width) {
+	int x = 0;
+	for(; x<width-MWORD_SIZE+1; x+=MWORD_SIZE) {
+		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src0 + x));
+		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src1 + x));
+		
+		s0 = SWAP_MID64(s0);
+		s1 = SWAP_MID64(s1);
+		
+		MIVEC* d = reinterpret_cast<MIVEC*>(dst + x*2);
+		MMSI(store)(d+0, MM(unpacklo_epi8)(s0, s1));
+		MMSI(store)(d+1, MM(unpackhi_epi8)(s0, s1));
+	}
+	for(; x<width; x++) {
+		dst[x*2 +0] = src0[x];
+		dst[x*2 +1] = src1[x];
+	}
+}
+static inline void interleave2x16b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, int width, int bits, bool endianSwap) {
+	uint16_t* d16 = reinterpret_cast<uint16_t*>(dst);
+	const uint16_t* s0_16 = reinterpret_cast<const uint16_t*>(src0);
+	const uint16_t* s1_16 = reinterpret_cast<const uint16_t*>(src1);
+	int shl = endianSwap ? (24-bits) : (16-bits);
+	int shr = endianSwap ? (bits-8) : (bits*2 - 16);
+	__m128i vshl = _mm_set_epi32(0, shr, 0, shl);
+	__m128i vshr = _mm_unpackhi_epi64(vshl, vshl);
+	
+	int x = 0;
+	for(; x<width-MWORD_SIZE/2+1; x+=MWORD_SIZE/2) {
+		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s0_16 + x));
+		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s1_16 + x));
+		
+		s0 = MMSI(or)(MM(sll_epi16)(s0, vshl), MM(srl_epi16)(s0, vshr));
+		s1 = MMSI(or)(MM(sll_epi16)(s1, vshl), MM(srl_epi16)(s1, vshr));
+		
+		s0 = SWAP_MID64(s0);
+		s1 = SWAP_MID64(s1);
+		
+		MIVEC* d = reinterpret_cast<MIVEC*>(d16 + x*2);
+		MMSI(store)(d+0, MM(unpacklo_epi16)(s0, s1));
+		MMSI(store)(d+1, MM(unpackhi_epi16)(s0, s1));
+	}
+	for(; x<width; x++) {
+		d16[x*2 +0] = (s0_16[x] << shl) | (s0_16[x] >> shr);
+		d16[x*2 +1] = (s1_16[x] << shl) | (s1_16[x] >> shr);
+	}
+}
+static inline void interleave3x8b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, int width) {
+	int x = 0;
+	MIVEC blend1 = BCAST128(_mm_set_epi32(0x0000ff00, 0x00ff0000, 0xff0000ff, 0x0000ff00));
+	MIVEC blend2 = MMSI(slli)(blend1, 1);
+	MIVEC shuf0 = BCAST128(_mm_set_epi32(0x050a0f04, 0x090e0308, 0x0d02070c, 0x01060b00));
+	MIVEC shuf1 = MM(alignr_epi8)(shuf0, shuf0, 15);
+	MIVEC shuf2 = MM(alignr_epi8)(shuf0, shuf0, 14);
+	for(; x<width-MWORD_SIZE+1; x+=MWORD_SIZE) {
+		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src0 + x));
+		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src1 + x));
+		MIVEC s2 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src2 + x));
+		
+		// re-arrange into groups of 3
+		s0 = MM(shuffle_epi8)(s0, shuf0);
+		s1 = MM(shuffle_epi8)(s1, shuf1);
+		s2 = MM(shuffle_epi8)(s2, shuf2);
+		
+		// blend together
+		MIVEC d0 = MM(blendv_epi8)(s0, s1, blend1);
+		MIVEC d1 = MM(blendv_epi8)(s1, s2, blend1);
+		MIVEC d2 = MM(blendv_epi8)(s2, s0, blend1);
+		d0 = MM(blendv_epi8)(d0, s2, blend2);
+		d1 = MM(blendv_epi8)(d1, s0, blend2);
+		d2 = MM(blendv_epi8)(d2, s1, blend2);
+		
+#ifdef __AVX2__
+		s0 = _mm256_permute2x128_si256(d0, d1, 0x20);
+		s1 = _mm256_permute2x128_si256(d2, d0, 0x30);
+		s2 = _mm256_permute2x128_si256(d1, d2, 0x31);
+		d0 = s0;
+		d1 = s1;
+		d2 = s2;
+#endif
+		
+		MIVEC* d = reinterpret_cast<MIVEC*>(dst + x*3);
+		MMSI(store)(d+0, d0);
+		MMSI(store)(d+1, d1);
+		MMSI(store)(d+2, d2);
+	}
+	for(; x<width; x++) {
+		dst[x*3 +0] = src0[x];
+		dst[x*3 +1] = src1[x];
+		dst[x*3 +2] = src2[x];
+	}
+}
+static inline void interleave3x16b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, int width, int bits, bool endianSwap) {
+	uint16_t* d16 = reinterpret_cast<uint16_t*>(dst);
+	const uint16_t* s0_16 = reinterpret_cast<const uint16_t*>(src0);
+	const uint16_t* s1_16 = reinterpret_cast<const uint16_t*>(src1);
+	const uint16_t* s2_16 = reinterpret_cast<const uint16_t*>(src2);
+	int shl = endianSwap ? (24-bits) : (16-bits);
+	int shr = endianSwap ? (bits-8) : (bits*2 - 16);
+	__m128i vshl = _mm_set_epi32(0, shr, 0, shl);
+	__m128i vshr = _mm_unpackhi_epi64(vshl, vshl);
+	
+	MIVEC shuf0 = BCAST128(_mm_set_epi32(0x0b0a0504, 0x0f0e0908, 0x03020d0c, 0x07060100));
+	MIVEC shuf1 = MM(alignr_epi8)(shuf0, shuf0, 14);
+	MIVEC shuf2 = MM(alignr_epi8)(shuf0, shuf0, 12);
+	int x = 0;
+	for(; x<width-MWORD_SIZE/2+1; x+=MWORD_SIZE/2) {
+		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s0_16 + x));
+		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s1_16 + x));
+		MIVEC s2 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s2_16 + x));
+		
+		s0 = MMSI(or)(MM(sll_epi16)(s0, vshl), MM(srl_epi16)(s0, vshr));
+		s1 = MMSI(or)(MM(sll_epi16)(s1, vshl), MM(srl_epi16)(s1, vshr));
+		s2 = MMSI(or)(MM(sll_epi16)(s2, vshl), MM(srl_epi16)(s2, vshr));
+		
+		// re-arrange into groups of 3
+		s0 = MM(shuffle_epi8)(s0, shuf0);
+		s1 = MM(shuffle_epi8)(s1, shuf1);
+		s2 = MM(shuffle_epi8)(s2, shuf2);
+		
+		// blend together
+		MIVEC d0 = MM(blend_epi16)(s0, s1, 0b10010010);
+		MIVEC d1 = MM(blend_epi16)(s2, s0, 0b10010010);
+		MIVEC d2 = MM(blend_epi16)(s1, s2, 0b10010010);
+		d0 = MM(blend_epi16)(d0, s2, 0b00100100);
+		d1 = MM(blend_epi16)(d1, s1, 0b00100100);
+		d2 = MM(blend_epi16)(d2, s0, 0b00100100);
+		
+#ifdef __AVX2__
+		s0 = _mm256_permute2x128_si256(d0, d1, 0x20);
+		s1 = _mm256_permute2x128_si256(d2, d0, 0x30);
+		s2 = _mm256_permute2x128_si256(d1, d2, 0x31);
+		d0 = s0;
+		d1 = s1;
+		d2 = s2;
+#endif
+		
+		MIVEC* d = reinterpret_cast<MIVEC*>(d16 + x*3);
+		MMSI(store)(d+0, d0);
+		MMSI(store)(d+1, d1);
+		MMSI(store)(d+2, d2);
+	}
+	for(; x<width; x++) {
+		d16[x*3 +0] = (s0_16[x] << shl) | (s0_16[x] >> shr);
+		d16[x*3 +1] = (s1_16[x] << shl) | (s1_16[x] >> shr);
+		d16[x*3 +2] = (s2_16[x] << shl) | (s2_16[x] >> shr);
+	}
+}
+static inline void store4x8b(MIVEC* d, MIVEC s0, MIVEC s1, MIVEC s2, MIVEC s3) {
+	MIVEC mix0 = MM(unpacklo_epi8)(s0, s1);
+	MIVEC mix1 = MM(unpackhi_epi8)(s0, s1);
+	MIVEC mix2 = MM(unpacklo_epi8)(s2, s3);
+	MIVEC mix3 = MM(unpackhi_epi8)(s2, s3);
+	
+	s0 = MM(unpacklo_epi16)(mix0, mix2);
+	s1 = MM(unpackhi_epi16)(mix0, mix2);
+	s2 = MM(unpacklo_epi16)(mix1, mix3);
+	s3 = MM(unpackhi_epi16)(mix1, mix3);
+	
+#ifdef __AVX2__
+	mix0 = _mm256_permute2x128_si256(s0, s1, 0x20);
+	mix1 = _mm256_permute2x128_si256(s2, s3, 0x20);
+	mix2 = _mm256_permute2x128_si256(s0, s1, 0x31);
+	mix3 = _mm256_permute2x128_si256(s2, s3, 0x31);
+	s0 = mix0;
+	s1 = mix1;
+	s2 = mix2;
+	s3 = mix3;
+#endif
+	
+	MMSI(store)(d+0, s0);
+	MMSI(store)(d+1, s1);
+	MMSI(store)(d+2, s2);
+	MMSI(store)(d+3, s3);
+}
+static inline void interleave4x8b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, const uint8_t* VS_RESTRICT src3, int width) {
+	int x = 0;
+	for(; x<width-MWORD_SIZE+1; x+=MWORD_SIZE) {
+		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src0 + x));
+		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src1 + x));
+		MIVEC s2 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src2 + x));
+		MIVEC s3 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src3 + x));
+		store4x8b(reinterpret_cast<MIVEC*>(dst + x*4), s0, s1, s2, s3);
+	}
+	for(; x<width; x++) {
+		dst[x*4 +0] = src0[x];
+		dst[x*4 +1] = src1[x];
+		dst[x*4 +2] = src2[x];
+		dst[x*4 +3] = src3[x];
+	}
+}
+// 3 planes + constant 4th channel (e.g. opaque alpha)
+static inline void interleave3x8bFill(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, uint8_t fill, int width) {
+	int x = 0;
+	MIVEC s3 = MM(set1_epi8)(char(fill));
+	for(; x<width-MWORD_SIZE+1; x+=MWORD_SIZE) {
+		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src0 + x));
+		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src1 + x));
+		MIVEC s2 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src2 + x));
+		store4x8b(reinterpret_cast<MIVEC*>(dst + x*4), s0, s1, s2, s3);
+	}
+	for(; x<width; x++) {
+		dst[x*4 +0] = src0[x];
+		dst[x*4 +1] = src1[x];
+		dst[x*4 +2] = src2[x];
+		dst[x*4 +3] = fill;
+	}
+}
+static inline void interleave4x16b(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, const uint8_t* VS_RESTRICT src3, int width, int bits, bool endianSwap) {
+	uint16_t* d16 = reinterpret_cast<uint16_t*>(dst);
+	const uint16_t* s0_16 = reinterpret_cast<const uint16_t*>(src0);
+	const uint16_t* s1_16 = reinterpret_cast<const uint16_t*>(src1);
+	const uint16_t* s2_16 = reinterpret_cast<const uint16_t*>(src2);
+	const uint16_t* s3_16 = reinterpret_cast<const uint16_t*>(src3);
+	int shl = endianSwap ? (24-bits) : (16-bits);
+	int shr = endianSwap ? (bits-8) : (bits*2 - 16);
+	__m128i vshl = _mm_set_epi32(0, shr, 0, shl);
+	__m128i vshr = _mm_unpackhi_epi64(vshl, vshl);
+	
+	int x = 0;
+	for(; x<width-MWORD_SIZE/2+1; x+=MWORD_SIZE/2) {
+		MIVEC s0 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s0_16 + x));
+		MIVEC s1 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s1_16 + x));
+		MIVEC s2 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s2_16 + x));
+		MIVEC s3 = MMSI(loadu)(reinterpret_cast<const MIVEC*>(s3_16 + x));
+		
+		s0 = MMSI(or)(MM(sll_epi16)(s0, vshl), MM(srl_epi16)(s0, vshr));
+		s1 = MMSI(or)(MM(sll_epi16)(s1, vshl), MM(srl_epi16)(s1, vshr));
+		s2 = MMSI(or)(MM(sll_epi16)(s2, vshl), MM(srl_epi16)(s2, vshr));
+		s3 = MMSI(or)(MM(sll_epi16)(s3, vshl), MM(srl_epi16)(s3, vshr));
+		
+		MIVEC mix0 = MM(unpacklo_epi16)(s0, s1);
+		MIVEC mix1 = MM(unpackhi_epi16)(s0, s1);
+		MIVEC mix2 = MM(unpacklo_epi16)(s2, s3);
+		MIVEC mix3 = MM(unpackhi_epi16)(s2, s3);
+		
+		s0 = MM(unpacklo_epi32)(mix0, mix2);
+		s1 = MM(unpackhi_epi32)(mix0, mix2);
+		s2 = MM(unpacklo_epi32)(mix1, mix3);
+		s3 = MM(unpackhi_epi32)(mix1, mix3);
+		
+#ifdef __AVX2__
+		mix0 = _mm256_permute2x128_si256(s0, s1, 0x20);
+		mix1 = _mm256_permute2x128_si256(s2, s3, 0x20);
+		mix2 = _mm256_permute2x128_si256(s0, s1, 0x31);
+		mix3 = _mm256_permute2x128_si256(s2, s3, 0x31);
+		s0 = mix0;
+		s1 = mix1;
+		s2 = mix2;
+		s3 = mix3;
+#endif
+		
+		MIVEC* d = reinterpret_cast<MIVEC*>(d16 + x*4);
+		MMSI(store)(d+0, s0);
+		MMSI(store)(d+1, s1);
+		MMSI(store)(d+2, s2);
+		MMSI(store)(d+3, s3);
+	}
+	for(; x<width; x++) {
+		d16[x*4 +0] = (s0_16[x] << shl) | (s0_16[x] >> shr);
+		d16[x*4 +1] = (s1_16[x] << shl) | (s1_16[x] >> shr);
+		d16[x*4 +2] = (s2_16[x] << shl) | (s2_16[x] >> shr);
+		d16[x*4 +3] = (s3_16[x] << shl) | (s3_16[x] >> shr);
+	}
+}
+
+#ifdef __AVX512BW__
+/// AVX-512 kernels
+// `dst` is only guaranteed MWORD_SIZE alignment, so stores are unaligned; the end of the row is handled with masked
+// loads/stores rather than relying on padding
+
+// masks for the first `n` elements of a vector; BZHI only looks at the low byte of the count, so clamp it first
+static inline __mmask64 tailMask8(int n) {
+	return n <= 0 ? 0 : n >= 64 ? ~0ULL : _bzhi_u64(~0ULL, n);
+}
+static inline __mmask32 tailMask16(int n) {
+	return n <= 0 ? 0 : n >= 32 ? ~0U : _bzhi_u32(~0U, n);
+}
+static inline __m512i shift16x32(__m512i v, __m128i vshl, __m128i vshr) {
+	return _mm512_or_si512(_mm512_sll_epi16(v, vshl), _mm512_srl_epi16(v, vshr));
+}
+
+static inline void copy1x16b_avx512(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, int width, int bits, bool endianSwap) {
+	uint16_t* d16 = reinterpret_cast<uint16_t*>(dst);
+	const uint16_t* s0_16 = reinterpret_cast<const uint16_t*>(src0);
+	int shl = endianSwap ? (24-bits) : (16-bits);
+	int shr = endianSwap ? (bits-8) : (bits*2 - 16);
+	__m128i vshl = _mm_cvtsi32_si128(shl);
+	__m128i vshr = _mm_cvtsi32_si128(shr);
+	
+	int x = 0;
+	for(; x<width-31; x+=32) {
+		__m512i s0 = _mm512_loadu_si512(s0_16 + x);
+		_mm512_storeu_si512(d16 + x, shift16x32(s0, vshl, vshr));
+	}
+	if(x < width) {
+		__mmask32 mask = tailMask16(width - x);
+		__m512i s0 = _mm512_maskz_loadu_epi16(mask, s0_16 + x);
+		_mm512_mask_storeu_epi16(d16 + x, mask, shift16x32(s0, vshl, vshr));
+	}
+}
+
+// the unpack instructions work within 128-bit lanes, so spread the 64-bit halves of each lane across lanes first
+static inline __m512i spreadHalves(__m512i v) {
+	return _mm512_permutexvar_epi64(_mm512_set_epi64(7, 3, 6, 2, 5, 1, 4, 0), v);
+}
+static inline void interleave2x8b_avx512(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, int width) {
+	for(int x=0; x<width; x+=64) {
+		__mmask64 mask = tailMask8(width - x);
+		__m512i s0 = spreadHalves(_mm512_maskz_loadu_epi8(mask, src0 + x));
+		__m512i s1 = spreadHalves(_mm512_maskz_loadu_epi8(mask, src1 + x));
+		int n = (width - x) * 2;
+		_mm512_mask_storeu_epi8(dst + x*2, tailMask8(n), _mm512_unpacklo_epi8(s0, s1));
+		_mm512_mask_storeu_epi8(dst + x*2 + 64, tailMask8(n - 64), _mm512_unpackhi_epi8(s0, s1));
+	}
+}
+static inline void interleave2x16b_avx512(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, int width, int bits, bool endianSwap) {
+	uint16_t* d16 = reinterpret_cast<uint16_t*>(dst);
+	const uint16_t* s0_16 = reinterpret_cast<const uint16_t*>(src0);
+	const uint16_t* s1_16 = reinterpret_cast<const uint16_t*>(src1);
+	int shl = endianSwap ? (24-bits) : (16-bits);
+	int shr = endianSwap ? (bits-8) : (bits*2 - 16);
+	__m128i vshl = _mm_cvtsi32_si128(shl);
+	__m128i vshr = _mm_cvtsi32_si128(shr);
+	
+	for(int x=0; x<width; x+=32) {
+		__mmask32 mask = tailMask16(width - x);
+		__m512i s0 = shift16x32(_mm512_maskz_loadu_epi16(mask, s0_16 + x), vshl, vshr);
+		__m512i s1 = shift16x32(_mm512_maskz_loadu_epi16(mask, s1_16 + x), vshl, vshr);
+		s0 = spreadHalves(s0);
+		s1 = spreadHalves(s1);
+		int n = (width - x) * 2;
+		_mm512_mask_storeu_epi16(d16 + x*2, tailMask16(n), _mm512_unpacklo_epi16(s0, s1));
+		_mm512_mask_storeu_epi16(d16 + x*2 + 32, tailMask16(n - 32), _mm512_unpackhi_epi16(s0, s1));
+	}
+}
+
+// for 3 channels, each output vector takes elements from all three sources: a two-source permute picks the first
+// two channels, and a masked single-source permute merges in the third; the same index vector serves both, since the
+// second permute only looks at the low bits
+alignas(64) static const uint16_t interleave3x16bIdx[3][32] = {
+	{0,32,0,1,33,1,2,34,2,3,35,3,4,36,4,5,37,5,6,38,6,7,39,7,8,40,8,9,41,9,10,42},
+	{10,11,43,11,12,44,12,13,45,13,14,46,14,15,47,15,16,48,16,17,49,17,18,50,18,19,51,19,20,52,20,21},
+	{53,21,22,54,22,23,55,23,24,56,24,25,57,25,26,58,26,27,59,27,28,60,28,29,61,29,30,62,30,31,63,31}
+};
+static inline void interleave3x16b_avx512(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, int width, int bits, bool endianSwap) {
+	uint16_t* d16 = reinterpret_cast<uint16_t*>(dst);
+	const uint16_t* s0_16 = reinterpret_cast<const uint16_t*>(src0);
+	const uint16_t* s1_16 = reinterpret_cast<const uint16_t*>(src1);
+	const uint16_t* s2_16 = reinterpret_cast<const uint16_t*>(src2);
+	int shl = endianSwap ? (24-bits) : (16-bits);
+	int shr = endianSwap ? (bits-8) : (bits*2 - 16);
+	__m128i vshl = _mm_cvtsi32_si128(shl);
+	__m128i vshr = _mm_cvtsi32_si128(shr);
+	
+	__m512i idx0 = _mm512_load_si512(interleave3x16bIdx[0]);
+	__m512i idx1 = _mm512_load_si512(interleave3x16bIdx[1]);
+	__m512i idx2 = _mm512_load_si512(interleave3x16bIdx[2]);
+	for(int x=0; x<width; x+=32) {
+		__mmask32 mask = tailMask16(width - x);
+		__m512i s0 = shift16x32(_mm512_maskz_loadu_epi16(mask, s0_16 + x), vshl, vshr);
+		__m512i s1 = shift16x32(_mm512_maskz_loadu_epi16(mask, s1_16 + x), vshl, vshr);
+		__m512i s2 = shift16x32(_mm512_maskz_loadu_epi16(mask, s2_16 + x), vshl, vshr);
+		
+		__m512i d0 = _mm512_mask_permutexvar_epi16(_mm512_permutex2var_epi16(s0, idx0, s1), 0x24924924, idx0, s2);
+		__m512i d1 = _mm512_mask_permutexvar_epi16(_mm512_permutex2var_epi16(s0, idx1, s1), 0x49249249, idx1, s2);
+		__m512i d2 = _mm512_mask_permutexvar_epi16(_mm512_permutex2var_epi16(s0, idx2, s1), 0x92492492, idx2, s2);
+		
+		int n = (width - x) * 3;
+		_mm512_mask_storeu_epi16(d16 + x*3, tailMask16(n), d0);
+		_mm512_mask_storeu_epi16(d16 + x*3 + 32, tailMask16(n - 32), d1);
+		_mm512_mask_storeu_epi16(d16 + x*3 + 64, tailMask16(n - 64), d2);
+	}
+}
+
+#ifdef __AVX512VBMI__
+alignas(64) static const uint8_t interleave3x8bIdx[3][64] = {
+	{0,64,0,1,65,1,2,66,2,3,67,3,4,68,4,5,69,5,6,70,6,7,71,7,8,72,8,9,73,9,10,74,10,11,75,11,12,76,12,13,77,13,14,78,14,15,79,15,16,80,16,17,81,17,18,82,18,19,83,19,20,84,20,21},
+	{85,21,22,86,22,23,87,23,24,88,24,25,89,25,26,90,26,27,91,27,28,92,28,29,93,29,30,94,30,31,95,31,32,96,32,33,97,33,34,98,34,35,99,35,36,100,36,37,101,37,38,102,38,39,103,39,40,104,40,41,105,41,42,106},
+	{42,43,107,43,44,108,44,45,109,45,46,110,46,47,111,47,48,112,48,49,113,49,50,114,50,51,115,51,52,116,52,53,117,53,54,118,54,55,119,55,56,120,56,57,121,57,58,122,58,59,123,59,60,124,60,61,125,61,62,126,62,63,127,63}
+};
+static inline void interleave3x8b_avx512(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, int width) {
+	__m512i idx0 = _mm512_load_si512(interleave3x8bIdx[0]);
+	__m512i idx1 = _mm512_load_si512(interleave3x8bIdx[1]);
+	__m512i idx2 = _mm512_load_si512(interleave3x8bIdx[2]);
+	for(int x=0; x<width; x+=64) {
+		__mmask64 mask = tailMask8(width - x);
+		__m512i s0 = _mm512_maskz_loadu_epi8(mask, src0 + x);
+		__m512i s1 = _mm512_maskz_loadu_epi8(mask, src1 + x);
+		__m512i s2 = _mm512_maskz_loadu_epi8(mask, src2 + x);
+		
+		__m512i d0 = _mm512_mask_permutexvar_epi8(_mm512_permutex2var_epi8(s0, idx0, s1), 0x4924924924924924, idx0, s2);
+		__m512i d1 = _mm512_mask_permutexvar_epi8(_mm512_permutex2var_epi8(s0, idx1, s1), 0x2492492492492492, idx1, s2);
+		__m512i d2 = _mm512_mask_permutexvar_epi8(_mm512_permutex2var_epi8(s0, idx2, s1), 0x9249249249249249, idx2, s2);
+		
+		int n = (width - x) * 3;
+		_mm512_mask_storeu_epi8(dst + x*3, tailMask8(n), d0);
+		_mm512_mask_storeu_epi8(dst + x*3 + 64, tailMask8(n - 64), d1);
+		_mm512_mask_storeu_epi8(dst + x*3 + 128, tailMask8(n - 128), d2);
+	}
+}
+#else
+// without VBMI, there's no byte permute across lanes, so stick with the 256-bit version
+static inline void interleave3x8b_avx512(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, int width) {
+	interleave3x8b(dst, src0, src1, src2, width);
+}
+#endif
+
+// transposes the 128-bit lanes of four vectors, as the results of 2 rounds of unpacking are spread across them
+static inline void storeTranspose4x128(void* dst, int n, __m512i s0, __m512i s1, __m512i s2, __m512i s3, bool words) {
+	__m512i t0 = _mm512_shuffle_i64x2(s0, s1, _MM_SHUFFLE(1,0,1,0));
+	__m512i t1 = _mm512_shuffle_i64x2(s2, s3, _MM_SHUFFLE(1,0,1,0));
+	__m512i t2 = _mm512_shuffle_i64x2(s0, s1, _MM_SHUFFLE(3,2,3,2));
+	__m512i t3 = _mm512_shuffle_i64x2(s2, s3, _MM_SHUFFLE(3,2,3,2));
+	__m512i d[4] = {
+		_mm512_shuffle_i64x2(t0, t1, _MM_SHUFFLE(2,0,2,0)),
+		_mm512_shuffle_i64x2(t0, t1, _MM_SHUFFLE(3,1,3,1)),
+		_mm512_shuffle_i64x2(t2, t3, _MM_SHUFFLE(2,0,2,0)),
+		_mm512_shuffle_i64x2(t2, t3, _MM_SHUFFLE(3,1,3,1))
+	};
+	// `n` is the number of elements (bytes or words) to store
+	for(int i=0; i<4; i++) {
+		if(words)
+			_mm512_mask_storeu_epi16(static_cast<uint16_t*>(dst) + i*32, tailMask16(n - i*32), d[i]);
+		else
+			_mm512_mask_storeu_epi8(static_cast<uint8_t*>(dst) + i*64, tailMask8(n - i*64), d[i]);
+	}
+}
+static inline void store4x8b_avx512(uint8_t* dst, int n, __m512i s0, __m512i s1, __m512i s2, __m512i s3) {
+	__m512i mix0 = _mm512_unpacklo_epi8(s0, s1);
+	__m512i mix1 = _mm512_unpackhi_epi8(s0, s1);
+	__m512i mix2 = _mm512_unpacklo_epi8(s2, s3);
+	__m512i mix3 = _mm512_unpackhi_epi8(s2, s3);
+	storeTranspose4x128(dst, n,
+		_mm512_unpacklo_epi16(mix0, mix2),
+		_mm512_unpackhi_epi16(mix0, mix2),
+		_mm512_unpacklo_epi16(mix1, mix3),
+		_mm512_unpackhi_epi16(mix1, mix3),
+		false
+	);
+}
+static inline void interleave4x8b_avx512(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, const uint8_t* VS_RESTRICT src3, int width) {
+	for(int x=0; x<width; x+=64) {
+		__mmask64 mask = tailMask8(width - x);
+		store4x8b_avx512(dst + x*4, (width - x) * 4,
+			_mm512_maskz_loadu_epi8(mask, src0 + x),
+			_mm512_maskz_loadu_epi8(mask, src1 + x),
+			_mm512_maskz_loadu_epi8(mask, src2 + x),
+			_mm512_maskz_loadu_epi8(mask, src3 + x)
+		);
+	}
+}
+static inline void interleave3x8bFill_avx512(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, uint8_t fill, int width) {
+	__m512i s3 = _mm512_set1_epi8(char(fill));
+	for(int x=0; x<width; x+=64) {
+		__mmask64 mask = tailMask8(width - x);
+		store4x8b_avx512(dst + x*4, (width - x) * 4,
+			_mm512_maskz_loadu_epi8(mask, src0 + x),
+			_mm512_maskz_loadu_epi8(mask, src1 + x),
+			_mm512_maskz_loadu_epi8(mask, src2 + x),
+			s3
+		);
+	}
+}
+static inline void interleave4x16b_avx512(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src0, const uint8_t* VS_RESTRICT src1, const uint8_t* VS_RESTRICT src2, const uint8_t* VS_RESTRICT src3, int width, int bits, bool endianSwap) {
+	uint16_t* d16 = reinterpret_cast<uint16_t*>(dst);
+	const uint16_t* s0_16 = reinterpret_cast<const uint16_t*>(src0);
+	const uint16_t* s1_16 = reinterpret_cast<const uint16_t*>(src1);
+	const uint16_t* s2_16 = reinterpret_cast<const uint16_t*>(src2);
+	const uint16_t* s3_16 = reinterpret_cast<const uint16_t*>(src3);
+	int shl = endianSwap ? (24-bits) : (16-bits);
+	int shr = endianSwap ? (bits-8) : (bits*2 - 16);
+	__m128i vshl = _mm_cvtsi32_si128(shl);
+	__m128i vshr = _mm_cvtsi32_si128(shr);
+	
+	for(int x=0; x<width; x+=32) {
+		__mmask32 mask = tailMask16(width - x);
+		__m512i s0 = shift16x32(_mm512_maskz_loadu_epi16(mask, s0_16 + x), vshl, vshr);
+		__m512i s1 = shift16x32(_mm512_maskz_loadu_epi16(mask, s1_16 + x), vshl, vshr);
+		__m512i s2 = shift16x32(_mm512_maskz_loadu_epi16(mask, s2_16 + x), vshl, vshr);
+		__m512i s3 = shift16x32(_mm512_maskz_loadu_epi16(mask, s3_16 + x), vshl, vshr);
+		
+		__m512i mix0 = _mm512_unpacklo_epi16(s0, s1);
+		__m512i mix1 = _mm512_unpackhi_epi16(s0, s1);
+		__m512i mix2 = _mm512_unpacklo_epi16(s2, s3);
+		__m512i mix3 = _mm512_unpackhi_epi16(s2, s3);
+		storeTranspose4x128(d16 + x*4, (width - x) * 4,
+			_mm512_unpacklo_epi32(mix0, mix2),
+			_mm512_unpackhi_epi32(mix0, mix2),
+			_mm512_unpacklo_epi32(mix1, mix3),
+			_mm512_unpackhi_epi32(mix1, mix3),
+			true
+		);
+	}
+}
+
+# define KERNEL(name) name##_avx512
+#else
+# define KERNEL(name) name
+#endif
+
+// interleaves row `y` of `src` into `dst`, which must be aligned to MWORD_SIZE
+// 16-bit samples are converted to big-endian, as PNG requires
+static void interleaveRow(const PlanarSource& src, size_t y, uint8_t* VS_RESTRICT dst) {
+	const uint8_t* p0 = src.planes[0] + y*src.strides[0];
+	const uint8_t* p1 = src.numChannels > 1 ? src.planes[1] + y*src.strides[1] : nullptr;
+	const uint8_t* p2 = src.numChannels > 2 ? src.planes[2] + y*src.strides[2] : nullptr;
+	const uint8_t* p3 = src.numChannels > 3 ? src.planes[3] + y*src.strides[3] : nullptr;
+	int width = src.width;
+	int bits = src.bitsPerSample;
+	
+	// NOTE: only PNG supports 16b samples, and that must be in big-endian
+	if(src.bytesPerSample == 1) {
+		switch(src.numChannels) {
+			case 1: memcpy(dst, p0, width); break;
+			case 2: KERNEL(interleave2x8b)(dst, p0, p1, width); break;
+			case 3: KERNEL(interleave3x8b)(dst, p0, p1, p2, width); break;
+			case 4: KERNEL(interleave4x8b)(dst, p0, p1, p2, p3, width); break;
+		}
+	} else {
+		switch(src.numChannels) {
+			case 1: KERNEL(copy1x16b)(dst, p0, width, bits, true); break;
+			case 2: KERNEL(interleave2x16b)(dst, p0, p1, width, bits, true); break;
+			case 3: KERNEL(interleave3x16b)(dst, p0, p1, p2, width, bits, true); break;
+			case 4: KERNEL(interleave4x16b)(dst, p0, p1, p2, p3, width, bits, true); break;
+		}
+	}
+}
+
+// WebP's ARGB is a native-endian uint32, i.e. BGRA byte order on x86
+static void packARGB(uint32_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT r, const uint8_t* VS_RESTRICT g, const uint8_t* VS_RESTRICT b, const uint8_t* VS_RESTRICT a, int width) {
+	uint8_t* d = reinterpret_cast<uint8_t*>(dst);
+	if(a)
+		KERNEL(interleave4x8b)(d, b, g, r, a, width);
+	else
+		KERNEL(interleave3x8bFill)(d, b, g, r, 0xff, width);
+}
+
+
+/// lossless reduction analysis
+
+static bool isUniformRow(const uint8_t* VS_RESTRICT p, int width, int bytesPerSample, int value) {
+	int x = 0;
+	if(bytesPerSample == 1) {
+		MIVEC v = MM(set1_epi8)(char(value));
+		for(; x<width-MWORD_SIZE+1; x+=MWORD_SIZE) {
+			MIVEC diff = MMSI(xor)(MMSI(loadu)(reinterpret_cast<const MIVEC*>(p + x)), v);
+			if(!MMSI(testz)(diff, diff)) return false;
+		}
+		for(; x<width; x++)
+			if(p[x] != value) return false;
+	} else {
+		const uint16_t* p16 = reinterpret_cast<const uint16_t*>(p);
+		MIVEC v = MM(set1_epi16)(short(value));
+		for(; x<width-MWORD_SIZE/2+1; x+=MWORD_SIZE/2) {
+			MIVEC diff = MMSI(xor)(MMSI(loadu)(reinterpret_cast<const MIVEC*>(p16 + x)), v);
+			if(!MMSI(testz)(diff, diff)) return false;
+		}
+		for(; x<width; x++)
+			if(p16[x] != value) return false;
+	}
+	return true;
+}
+
+static bool fitsIn8Bits(const uint8_t* VS_RESTRICT p, int width, int bits) {
+	const uint16_t* p16 = reinterpret_cast<const uint16_t*>(p);
+	int shl = 16-bits;
+	__m128i vshl = _mm_cvtsi32_si128(shl);
+	MIVEC lowByte = MM(set1_epi16)(0xff);
+	
+	int x = 0;
+	for(; x<width-MWORD_SIZE/2+1; x+=MWORD_SIZE/2) {
+		MIVEC s = MM(sll_epi16)(MMSI(loadu)(reinterpret_cast<const MIVEC*>(p16 + x)), vshl);
+		// the high and low bytes differ where (s ^ s>>8) has any of the low 8 bits set
+		if(!MMSI(testz)(MMSI(xor)(s, MM(srli_epi16)(s, 8)), lowByte)) return false;
+	}
+	for(; x<width; x++) {
+		unsigned s = (p16[x] << shl) & 0xffff;
+		if((s >> 8) != (s & 0xff)) return false;
+	}
+	return true;
+}
+
+static void narrowTo8Bits(uint8_t* VS_RESTRICT dst, const uint8_t* VS_RESTRICT src, int width, int bits) {
+	const uint16_t* s16 = reinterpret_cast<const uint16_t*>(src);
+	int shr = bits-8;
+	__m128i vshr = _mm_cvtsi32_si128(shr);
+	
+	int x = 0;
+	for(; x<width-MWORD_SIZE+1; x+=MWORD_SIZE) {
+		MIVEC s0 = MM(srl_epi16)(MMSI(loadu)(reinterpret_cast<const MIVEC*>(s16 + x)), vshr);
+		MIVEC s1 = MM(srl_epi16)(MMSI(loadu)(reinterpret_cast<const MIVEC*>(s16 + x + MWORD_SIZE/2)), vshr);
+		MMSI(storeu)(reinterpret_cast<MIVEC*>(dst + x), SWAP_MID64(MM(packus_epi16)(s0, s1)));
+	}
+	for(; x<width; x++)
+		dst[x] = s16[x] >> shr;
+}
+
+static int runLength32(const uint32_t* VS_RESTRICT p, int width, uint32_t value) {
+	MIVEC v = MM(set1_epi32)(int(value));
+	int x = 0;
+	for(; x<width-MWORD_SIZE/4+1; x+=MWORD_SIZE/4) {
+		MIVEC eq = MM(cmpeq_epi32)(MMSI(loadu)(reinterpret_cast<const MIVEC*>(p + x)), v);
+		unsigned differ = ~unsigned(MM(movemask_epi8)(eq));
+		if(MWORD_SIZE == 16) differ &= 0xffff;
+		if(differ) return x + __builtin_ctz(differ) / 4;
+	}
+	while(x<width && p[x] == value) x++;
+	return x;
+}
+
+static int matchLength32(const uint32_t* VS_RESTRICT a, const uint32_t* VS_RESTRICT b, int width) {
+	int x = 0;
+	for(; x<width-MWORD_SIZE/4+1; x+=MWORD_SIZE/4) {
+		MIVEC eq = MM(cmpeq_epi32)(
+			MMSI(loadu)(reinterpret_cast<const MIVEC*>(a + x)),
+			MMSI(loadu)(reinterpret_cast<const MIVEC*>(b + x))
+		);
+		unsigned differ = ~unsigned(MM(movemask_epi8)(eq));
+		if(MWORD_SIZE == 16) differ &= 0xffff;
+		if(differ) return x + __builtin_ctz(differ) / 4;
+	}
+	while(x<width && a[x] == b[x]) x++;
+	return x;
+}
+
+static int diffSpan(const uint8_t* VS_RESTRICT a, const uint8_t* VS_RESTRICT b, int size, int* end) {
+	const unsigned fullMask = MWORD_SIZE == 16 ? 0xffff : 0xffffffff;
+	int x = 0;
+	unsigned differ = 0;
+	for(; x<size-MWORD_SIZE+1; x+=MWORD_SIZE) {
+		MIVEC eq = MM(cmpeq_epi8)(
+			MMSI(loadu)(reinterpret_cast<const MIVEC*>(a + x)),
+			MMSI(loadu)(reinterpret_cast<const MIVEC*>(b + x))
+		);
+		differ = ~unsigned(MM(movemask_epi8)(eq)) & fullMask;
+		if(differ) break;
+	}
+	if(differ)
+		x += __builtin_ctz(differ);
+	else
+		while(x<size && a[x] == b[x]) x++;
+	if(x == size) {
+		*end = 0;
+		return size;
+	}
+	
+	// there's a difference at `x`, so the backwards search stops there at the latest
+	int e = size;
+	for(; e-MWORD_SIZE >= x; e-=MWORD_SIZE) {
+		MIVEC eq = MM(cmpeq_epi8)(
+			MMSI(loadu)(reinterpret_cast<const MIVEC*>(a + e-MWORD_SIZE)),
+			MMSI(loadu)(reinterpret_cast<const MIVEC*>(b + e-MWORD_SIZE))
+		);
+		differ = ~unsigned(MM(movemask_epi8)(eq)) & fullMask;
+		if(differ) {
+			*end = e - MWORD_SIZE + 32 - __builtin_clz(differ);
+			return x;
+		}
+	}
+	while(a[e-1] == b[e-1]) e--;
+	*end = e;
+	return x;
+}
+
+// halves the number of bytes, combining pairs as (first << shift) | second
+static inline MIVEC packPairs(MIVEC a, MIVEC b, int shift) {
+	MIVEC weights = MM(set1_epi16)(short(0x100 | (1 << shift)));
+	return SWAP_MID64(MM(packus_epi16)(MM(maddubs_epi16)(a, weights), MM(maddubs_epi16)(b, weights)));
+}
+static inline void packIndicesN(uint8_t* dst, const uint8_t* src, int width, int depth) {
+	int perByte = 8 / depth;
+	int x = 0;
+	// everything a store overwrites has already been loaded, so this works in place
+	for(; x<width-MWORD_SIZE*perByte+1; x+=MWORD_SIZE*perByte) {
+		MIVEC v[8];
+		for(int i=0; i<perByte; i++)
+			v[i] = MMSI(loadu)(reinterpret_cast<const MIVEC*>(src + x + i*MWORD_SIZE));
+		for(int n=perByte, shift=depth; n>1; n/=2, shift*=2)
+			for(int i=0; i<n/2; i++)
+				v[i] = packPairs(v[i*2], v[i*2 +1], shift);
+		MMSI(storeu)(reinterpret_cast<MIVEC*>(dst + x/perByte), v[0]);
+	}
+	for(; x<width; x+=perByte) {
+		unsigned packed = 0;
+		for(int i=0; i<perByte; i++)
+			packed = (packed << depth) | (x+i < width ? src[x+i] : 0);
+		dst[x/perByte] = packed;
+	}
+}
+static void packIndices(uint8_t* dst, const uint8_t* src, int width, int depth) {
+	// specialise for each depth, so that the loops above unroll
+	switch(depth) {
+		case 1: packIndicesN(dst, src, width, 1); break;
+		case 2: packIndicesN(dst, src, width, 2); break;
+		case 4: packIndicesN(dst, src, width, 4); break;
+	}
+}
+
+
+/// downscaling
+
+static void sumColumns(uint32_t* VS_RESTRICT sums, const uint8_t* VS_RESTRICT src, int width, int bytesPerSample) {
+	const int step = MWORD_SIZE/4; // sums per vector
+	int x = 0;
+	if(bytesPerSample == 1) {
+		for(; x<width-15; x+=16) {
+			__m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+			for(int i=0; i<16; i+=step) {
+				MIVEC* d = reinterpret_cast<MIVEC*>(sums + x+i);
+				MMSI(storeu)(d, MM(add_epi32)(MMSI(loadu)(d), MM(cvtepu8_epi32)(s)));
+				s = _mm_srli_si128(s, step);
+			}
+		}
+		for(; x<width; x++)
+			sums[x] += src[x];
+	} else {
+		const uint16_t* s16 = reinterpret_cast<const uint16_t*>(src);
+		for(; x<width-7; x+=8) {
+			__m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s16 + x));
+			for(int i=0; i<8; i+=step) {
+				MIVEC* d = reinterpret_cast<MIVEC*>(sums + x+i);
+				MMSI(storeu)(d, MM(add_epi32)(MMSI(loadu)(d), MM(cvtepu16_epi32)(s)));
+				s = _mm_srli_si128(s, step*2);
+			}
+		}
+		for(; x<width; x++)
+			sums[x] += s16[x];
+	}
+}
+
+
+/// hashing
+
+// each 64-byte stripe of a row is mixed into the lanes in the manner of XXH3's accumulation, with the key advancing
+// per stripe so that moving data within a row changes the hash, and the lanes are scrambled at the end of each row
+static const uint64_t hashKeys[8] = {
+	0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+	0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL
+};
+static inline MIVEC hashStripe(MIVEC acc, MIVEC data, MIVEC key) {
+	MIVEC dk = MMSI(xor)(data, key);
+	MIVEC product = MM(mul_epu32)(dk, MM(srli_epi64)(dk, 32));
+	return MM(add_epi64)(acc, MM(add_epi64)(product, MM(shuffle_epi32)(data, _MM_SHUFFLE(1,0,3,2))));
+}
+static void hashRows(uint64_t* VS_RESTRICT state, const uint8_t* VS_RESTRICT src, ptrdiff_t stride, size_t rowSize, int rows) {
+	const int n = 64 / MWORD_SIZE;
+	MIVEC acc[4], keys[4];
+	for(int i=0; i<n; i++) {
+		acc[i] = MMSI(loadu)(reinterpret_cast<const MIVEC*>(state) + i);
+		keys[i] = MMSI(loadu)(reinterpret_cast<const MIVEC*>(hashKeys) + i);
+	}
+	const MIVEC step = MM(set1_epi64x)(0x9e3779b97f4a7c15LL);
+	const MIVEC prime = MM(set1_epi32)(0x9e3779b1);
+	alignas(64) uint8_t tail[64];
+	for(int y=0; y<rows; y++) {
+		const uint8_t* row = src + y*stride;
+		MIVEC k[4];
+		for(int i=0; i<n; i++) k[i] = keys[i];
+		size_t x = 0;
+		for(; x+64 <= rowSize; x+=64) {
+			for(int i=0; i<n; i++) {
+				acc[i] = hashStripe(acc[i], MMSI(loadu)(reinterpret_cast<const MIVEC*>(row + x) + i), k[i]);
+				k[i] = MM(add_epi64)(k[i], step);
+			}
+		}
+		if(x < rowSize) {
+			// zero-pad the last partial stripe
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, row + x, rowSize - x);
+			for(int i=0; i<n; i++)
+				acc[i] = hashStripe(acc[i], MMSI(load)(reinterpret_cast<const MIVEC*>(tail) + i), k[i]);
+		}
+		for(int i=0; i<n; i++) {
+			MIVEC a = MMSI(xor)(acc[i], MM(srli_epi64)(acc[i], 47));
+			a = MMSI(xor)(a, keys[i]);
+			// 64-bit multiply by a 32-bit prime
+			MIVEC lo = MM(mul_epu32)(a, prime);
+			MIVEC hi = MM(mul_epu32)(MM(srli_epi64)(a, 32), prime);
+			acc[i] = MM(add_epi64)(lo, MM(slli_epi64)(hi, 32));
+		}
+	}
+	for(int i=0; i<n; i++)
+		MMSI(storeu)(reinterpret_cast<MIVEC*>(state) + i, acc[i]);
+}
+
+#define KERNELS_NAME2(isa) interleaveKernels_##isa
+#define KERNELS_NAME(isa) KERNELS_NAME2(isa)
+extern const InterleaveKernels KERNELS_NAME(INTERLEAVE_ISA) = {
+	interleaveRow,
+	packARGB,
+	isUniformRow,
+	fitsIn8Bits,
+	narrowTo8Bits,
+	runLength32,
+	matchLength32,
+	diffSpan,
+	packIndices,
+	sumColumns,
+	hashRows,
+	MWORD_SIZE
+};
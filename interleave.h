@@ -0,0 +1,56 @@
+#ifndef INTERLEAVE_H
+#define INTERLEAVE_H
+
+#include <cstddef>
+#include <cstdint>
+
+// planes of a frame (+ optional alpha), in output channel order
+struct PlanarSource {
+	const uint8_t* planes[4];
+	ptrdiff_t strides[4];
+	int numChannels;
+	int bytesPerSample;
+	int bitsPerSample;
+	int width;
+	int height;
+};
+
+// planar -> interleaved conversion kernels
+// interleave.cpp is built once for each supported instruction set, and the best one the CPU supports is selected at
+// runtime
+struct InterleaveKernels {
+	// writes row `y` of `src` to `dst`, which must be aligned to `alignment`
+	void (*interleaveRow)(const PlanarSource& src, size_t y, uint8_t* dst);
+	// packs planes into WebP's ARGB layout; `a` may be null, for opaque
+	void (*packARGB)(uint32_t* dst, const uint8_t* r, const uint8_t* g, const uint8_t* b, const uint8_t* a, int width);
+	// true if every sample in the row equals `value`
+	bool (*isUniformRow)(const uint8_t* p, int width, int bytesPerSample, int value);
+	// for >8-bit samples: true if every sample, shifted up to 16 bits as interleaveRow does, has equal high and low
+	// bytes, so that an 8-bit PNG decodes to the same values
+	bool (*fitsIn8Bits)(const uint8_t* p, int width, int bits);
+	// writes the top 8 bits of each >8-bit sample
+	void (*narrowTo8Bits)(uint8_t* dst, const uint8_t* src, int width, int bits);
+	// number of leading elements of `p` which equal `value`
+	int (*runLength32)(const uint32_t* p, int width, uint32_t value);
+	// number of leading elements which are equal in `a` and `b`
+	int (*matchLength32)(const uint32_t* a, const uint32_t* b, int width);
+	// compares two rows: returns the index of the first byte which differs (or `size` if none do), and sets `end` to
+	// one past the last (0 if none do)
+	int (*diffSpan)(const uint8_t* a, const uint8_t* b, int size, int* end);
+	// packs 8-bit palette indices into `depth` (1, 2 or 4) bits each, leftmost pixel in the most significant bits;
+	// `dst` may equal `src`
+	void (*packIndices)(uint8_t* dst, const uint8_t* src, int width, int depth);
+	// adds each sample of a row to the corresponding element of `sums`
+	void (*sumColumns)(uint32_t* sums, const uint8_t* src, int width, int bytesPerSample);
+	// folds `rows` rows of `rowSize` bytes into the eight 64-bit lanes of `state`; the result is the same for every
+	// instruction set
+	void (*hashRows)(uint64_t* state, const uint8_t* src, ptrdiff_t stride, size_t rowSize, int rows);
+	size_t alignment;
+};
+
+extern const InterleaveKernels interleaveKernels_sse41;
+extern const InterleaveKernels interleaveKernels_avx2;
+extern const InterleaveKernels interleaveKernels_avx512;
+extern const InterleaveKernels interleaveKernels_avx512vbmi;
+
+#endif
@@ -0,0 +1,201 @@
+#include "scratch.h"
+#include <VSHelper4.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+# include <sys/mman.h>
+#endif
+
+static std::atomic<bool> useHugePages(false);
+static const size_t HUGEPAGE_SIZE = 2 * 1024 * 1024;
+
+// round up to 64KB, or to a quarter of the nearest power of two for larger sizes, which limits wasted space to 25%
+static size_t sizeClass(size_t size) {
+	const size_t minSize = 65536;
+	if(size <= minSize) return minSize;
+	size_t step = minSize;
+	while(step*8 <= size) step <<= 1;
+	return (size + step-1) & ~(step-1);
+}
+
+bool ScratchBuffer::allocate(size_t size) {
+	size = sizeClass(size);
+#ifdef __linux__
+	if(size >= HUGEPAGE_SIZE && useHugePages.load(std::memory_order_relaxed)) {
+		// huge pages need 2MB alignment, so over-allocate and unmap the excess
+		size = (size + HUGEPAGE_SIZE-1) & ~(HUGEPAGE_SIZE-1);
+		size_t mapSize = size + HUGEPAGE_SIZE;
+		void* mem = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mem != MAP_FAILED) {
+			uintptr_t start = reinterpret_cast<uintptr_t>(mem);
+			uintptr_t aligned = (start + HUGEPAGE_SIZE-1) & ~(uintptr_t)(HUGEPAGE_SIZE-1);
+			if(aligned > start)
+				munmap(mem, aligned - start);
+			if(aligned + size < start + mapSize)
+				munmap(reinterpret_cast<void*>(aligned + size), start + mapSize - aligned - size);
+			madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE); // failure (e.g. THP unavailable) isn't fatal
+			ptr = reinterpret_cast<uint8_t*>(aligned);
+			capacity = size;
+			mapped = true;
+			return true;
+		}
+	}
+#endif
+	VSH_ALIGNED_MALLOC(&ptr, size, ALIGNMENT);
+	if(!ptr) return false;
+	capacity = size;
+	mapped = false;
+	return true;
+}
+
+uint8_t* ScratchBuffer::get(size_t size) {
+	if(size <= capacity) return ptr;
+	release();
+	if(!allocate(size)) return nullptr;
+	return ptr;
+}
+
+uint8_t* ScratchBuffer::grow(size_t size, size_t used) {
+	if(size <= capacity) return ptr;
+	ScratchBuffer old;
+	swap(old);
+	// grow by at least 50% to amortise copying
+	if(!allocate(std::max(size, old.capacity + old.capacity/2))) {
+		swap(old);
+		return nullptr;
+	}
+	if(old.ptr)
+		memcpy(ptr, old.ptr, std::min(used, old.capacity));
+	return ptr;
+}
+
+void ScratchBuffer::swap(ScratchBuffer& other) {
+	std::swap(ptr, other.ptr);
+	std::swap(capacity, other.capacity);
+	std::swap(mapped, other.mapped);
+}
+
+void ScratchBuffer::release() {
+	if(!ptr) return;
+#ifdef __linux__
+	if(mapped)
+		munmap(ptr, capacity);
+	else
+#endif
+		VSH_ALIGNED_FREE(ptr);
+	ptr = nullptr;
+	capacity = 0;
+	mapped = false;
+}
+
+
+/// idle trimming
+
+class ScratchTrimmer {
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::vector<ThreadScratch*> states;
+	std::thread thread;
+	std::chrono::duration<double> idleTime;
+	bool stopping;
+	
+	void run() {
+		std::unique_lock<std::mutex> lk(mutex);
+		while(!stopping) {
+			if(idleTime.count() <= 0) {
+				cond.wait(lk);
+				continue;
+			}
+			cond.wait_for(lk, idleTime / 4);
+			if(stopping || idleTime.count() <= 0) continue;
+			auto now = std::chrono::steady_clock::now();
+			for(auto state : states) {
+				// if the owner is using it, it obviously isn't idle
+				if(!state->mutex.try_lock()) continue;
+				if(!state->trimmed && now - state->lastUsed >= idleTime) {
+					state->trim();
+					state->trimmed = true;
+				}
+				state->mutex.unlock();
+			}
+		}
+	}
+	static std::atomic<ScratchTrimmer*> instance;
+	
+	ScratchTrimmer() : idleTime(10.0), stopping(false) {
+		instance = this;
+	}
+public:
+	~ScratchTrimmer() {
+		{
+			std::lock_guard<std::mutex> lk(mutex);
+			stopping = true;
+			// threads (e.g. pool workers) may exit after static destruction has begun
+			instance = nullptr;
+		}
+		cond.notify_all();
+		if(thread.joinable())
+			thread.join();
+	}
+	
+	static void add(ThreadScratch* state) {
+		ScratchTrimmer* self = get();
+		if(!self) return;
+		std::lock_guard<std::mutex> lk(self->mutex);
+		self->states.push_back(state);
+		if(!self->thread.joinable())
+			self->thread = std::thread(&ScratchTrimmer::run, self);
+	}
+	static void remove(ThreadScratch* state) {
+		ScratchTrimmer* self = instance;
+		if(!self) return;
+		std::lock_guard<std::mutex> lk(self->mutex);
+		self->states.erase(std::remove(self->states.begin(), self->states.end(), state), self->states.end());
+	}
+	static void setIdleTime(double seconds) {
+		ScratchTrimmer* self = get();
+		if(!self) return;
+		{
+			std::lock_guard<std::mutex> lk(self->mutex);
+			self->idleTime = std::chrono::duration<double>(seconds);
+		}
+		self->cond.notify_all();
+	}
+	
+	static ScratchTrimmer* get() {
+		static ScratchTrimmer trimmer;
+		return instance;
+	}
+};
+std::atomic<ScratchTrimmer*> ScratchTrimmer::instance(nullptr);
+
+ThreadScratch::ThreadScratch() : lastUsed(std::chrono::steady_clock::now()), trimmed(true) {
+	ScratchTrimmer::add(this);
+}
+ThreadScratch::~ThreadScratch() {
+	detach();
+}
+void ThreadScratch::detach() {
+	ScratchTrimmer::remove(this);
+}
+
+void ThreadScratch::begin() {
+	mutex.lock();
+}
+void ThreadScratch::end() {
+	lastUsed = std::chrono::steady_clock::now();
+	trimmed = false;
+	mutex.unlock();
+}
+
+void ThreadScratch::setHugePages(bool enable) {
+	useHugePages = enable;
+}
+void ThreadScratch::setIdleTrim(double seconds) {
+	ScratchTrimmer::setIdleTime(seconds);
+}
@@ -0,0 +1,65 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// reusable, aligned block of memory which grows in size classes
+class ScratchBuffer {
+	uint8_t* ptr;
+	size_t capacity;
+	bool mapped;
+	
+	bool allocate(size_t size);
+	void swap(ScratchBuffer& other);
+public:
+	ScratchBuffer() : ptr(nullptr), capacity(0), mapped(false) {}
+	ScratchBuffer(const ScratchBuffer&) = delete;
+	ScratchBuffer(ScratchBuffer&& other) : ScratchBuffer() { swap(other); }
+	ScratchBuffer& operator=(const ScratchBuffer&) = delete;
+	~ScratchBuffer() { release(); }
+	
+	// returns a buffer of at least `size` bytes; previous contents are not retained
+	uint8_t* get(size_t size);
+	// as above, but retains the first `used` bytes if the buffer needs to grow
+	uint8_t* grow(size_t size, size_t used);
+	void release();
+	
+	uint8_t* data() const { return ptr; }
+	size_t size() const { return capacity; }
+	
+	static const size_t ALIGNMENT = 64;
+};
+
+// base for per-thread state holding scratch buffers
+// the owning thread brackets each use with begin()/end(); a background thread calls trim() on states which haven't
+// been used for a while, so that memory isn't held indefinitely by threads which have stopped encoding
+class ThreadScratch {
+	std::mutex mutex; // held by the owning thread whilst in use
+	std::chrono::steady_clock::time_point lastUsed;
+	bool trimmed;
+	
+	friend class ScratchTrimmer;
+protected:
+	// release any memory held; called with the mutex held
+	virtual void trim() = 0;
+	// stop background trimming; derived classes must call this in their destructor, before members are destroyed
+	void detach();
+public:
+	ThreadScratch();
+	virtual ~ThreadScratch();
+	ThreadScratch(const ThreadScratch&) = delete;
+	ThreadScratch& operator=(const ThreadScratch&) = delete;
+	
+	void begin();
+	void end();
+	
+	// back large buffers with transparent huge pages (Linux only)
+	static void setHugePages(bool enable);
+	// release buffers after this many seconds of inactivity (<= 0 to never release)
+	static void setIdleTrim(double seconds);
+};
+
+#endif
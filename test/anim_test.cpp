@@ -0,0 +1,373 @@
+// EncodeAnimation output: APNG, decoded frame by frame with libpng, and animated WebP, decoded with libwebp
+
+#include "common.h"
+#include <cmath>
+#ifdef HAVE_WEBP
+#include <webp/decode.h>
+#endif
+
+// a sequence exercising a change within one plane, a repeated frame, alpha-only, single pixel, scattered and full
+// changes
+static std::vector<const VSFrame*> makeSequence(int colorFamily, int bits, int width, int height, bool withAlpha, std::vector<const VSFrame*>& alphas) {
+	std::vector<const VSFrame*> frames;
+	alphas.clear();
+	int numPlanes = colorFamily == cfGray ? 1 : 3;
+	VSFrame* frame = newFrame(colorFamily, bits, width, height);
+	VSFrame* alpha = withAlpha ? newFrame(cfGray, bits, width, height) : nullptr;
+	uint32_t seed = 1;
+	fillFrame(frame, seed++);
+	if(alpha) fillFrame(alpha, seed++, 5);
+	auto push = [&]() {
+		frames.push_back(frame);
+		frame = vsapi->copyFrame(frame, core);
+		if(alpha) {
+			alphas.push_back(alpha);
+			alpha = vsapi->copyFrame(alpha, core);
+		}
+	};
+	auto flip = [&](VSFrame* f, int plane, int x, int y) {
+		setSample(f, plane, x, y, getSample(f, plane, x, y) ^ 1);
+	};
+	push();
+	for(int y=height/4; y<=height/2; y++)
+		for(int x=width/3; x<=width/2; x++)
+			flip(frame, numPlanes - 1, x, y);
+	push();
+	push(); // repeat
+	if(alpha) {
+		flip(alpha, 0, width > 1, height > 1);
+		push();
+	}
+	flip(frame, 0, width - 1, height - 1);
+	push();
+	flip(frame, 0, width > 1, height / 2);
+	flip(frame, numPlanes - 1, width / 2, height > 1);
+	push();
+	fillFrame(frame, seed++);
+	push();
+	vsapi->freeFrame(frame);
+	vsapi->freeFrame(alpha);
+	return frames;
+}
+
+static void freeFrames(std::vector<const VSFrame*>& frames) {
+	for(const VSFrame* frame : frames)
+		vsapi->freeFrame(frame);
+	frames.clear();
+}
+
+// canvas after each frame of an animation, and how long it's shown for
+struct Shown {
+	Image image;
+	double delay;
+};
+
+// decodes an APNG, checking its frame control and sequence numbers, by turning each frame into a standalone PNG for
+// libpng, and compositing it onto the canvas
+static bool decodeApng(const std::string& png, std::vector<Shown>& shown, int& plays, std::string& error) {
+	std::vector<PngChunk> chunks;
+	if(!readPngChunks(png, chunks) || chunks[0].type != "IHDR") {
+		error = "bad chunk layout";
+		return false;
+	}
+	const std::string& ihdr = chunks[0].data;
+	std::string header; // chunks which apply to every frame, such as PLTE
+	Image canvas;
+	canvas.width = readBE32(ihdr, 0);
+	canvas.height = readBE32(ihdr, 4);
+	canvas.channels = 0;
+	uint32_t numFrames = 0, sequence = 0;
+	bool seenIdat = false;
+	std::string frameControl, frameData;
+	Image previous;
+
+	auto finishFrame = [&]() -> bool {
+		if(frameControl.empty()) return true;
+		int width = readBE32(frameControl, 4), height = readBE32(frameControl, 8);
+		int x0 = readBE32(frameControl, 12), y0 = readBE32(frameControl, 16);
+		int delayNum = uint8_t(frameControl[20]) << 8 | uint8_t(frameControl[21]);
+		int delayDen = uint8_t(frameControl[22]) << 8 | uint8_t(frameControl[23]);
+		int dispose = frameControl[24], blend = frameControl[25];
+		if(width <= 0 || height <= 0 || x0 + width > canvas.width || y0 + height > canvas.height) {
+			error = "frame outside the canvas";
+			return false;
+		}
+		if(shown.empty() && (x0 || y0 || width != canvas.width || height != canvas.height)) {
+			error = "first frame doesn't cover the canvas";
+			return false;
+		}
+		if(blend != 0) {
+			error = "unexpected APNG_BLEND_OP_OVER"; // the encoder always replaces
+			return false;
+		}
+		std::string frameIhdr = ihdr;
+		frameIhdr.replace(0, 8, frameControl.substr(4, 8));
+		std::string framePng = png.substr(0, 8) + writePngChunk("IHDR", frameIhdr) + header
+			+ writePngChunk("IDAT", frameData) + writePngChunk("IEND", "");
+		Image image;
+		if(!decodePng(framePng, image)) {
+			error = "libpng failed to decode frame " + std::to_string(shown.size());
+			return false;
+		}
+		if(shown.empty()) {
+			canvas.channels = image.channels;
+			canvas.bits = image.bits;
+			canvas.samples.assign(size_t(canvas.width) * canvas.height * canvas.channels, 0);
+		}
+		previous = canvas;
+		for(int y=0; y<height; y++)
+			for(int x=0; x<width; x++)
+				for(int c=0; c<canvas.channels; c++)
+					canvas.at(x0 + x, y0 + y, c) = image.at(x, y, c);
+		shown.push_back({canvas, double(delayNum) / (delayDen ? delayDen : 100)});
+		if(dispose == 1) {
+			for(int y=0; y<height; y++)
+				for(int x=0; x<width; x++)
+					for(int c=0; c<canvas.channels; c++)
+						canvas.at(x0 + x, y0 + y, c) = 0;
+		} else if(dispose == 2) {
+			canvas = previous;
+		}
+		frameControl.clear();
+		frameData.clear();
+		return true;
+	};
+
+	for(size_t i=1; i<chunks.size(); i++) {
+		const PngChunk& chunk = chunks[i];
+		if(chunk.type == "acTL") {
+			numFrames = readBE32(chunk.data, 0);
+			plays = readBE32(chunk.data, 4);
+		} else if(chunk.type == "fcTL") {
+			if(!finishFrame()) return false;
+			if(readBE32(chunk.data, 0) != sequence++) {
+				error = "fcTL out of sequence";
+				return false;
+			}
+			frameControl = chunk.data;
+		} else if(chunk.type == "IDAT") {
+			seenIdat = true;
+			frameData += chunk.data;
+		} else if(chunk.type == "fdAT") {
+			if(readBE32(chunk.data, 0) != sequence++) {
+				error = "fdAT out of sequence";
+				return false;
+			}
+			frameData += chunk.data.substr(4);
+		} else if(chunk.type == "IEND") {
+			if(!finishFrame()) return false;
+		} else if(!seenIdat) {
+			header += writePngChunk(chunk.type.c_str(), chunk.data);
+		}
+		// a default image which isn't part of the animation
+		if(chunk.type == "IDAT" && frameControl.empty())
+			frameData.clear();
+	}
+	if(shown.size() != numFrames) {
+		error = "acTL has " + std::to_string(numFrames) + " frames, but found " + std::to_string(shown.size());
+		return false;
+	}
+	return true;
+}
+
+static void testApng() {
+	struct {
+		int colorFamily, bits;
+		bool alpha;
+		int width, height;
+	} cases[] = {
+		{cfRGB, 8, false, 64, 48}, {cfRGB, 8, true, 33, 17}, {cfGray, 8, false, 70, 31}, {cfGray, 10, true, 20, 20},
+		{cfRGB, 16, false, 9, 7}, {cfRGB, 12, true, 130, 65}, {cfRGB, 8, false, 1, 1}, {cfRGB, 8, true, 2, 3},
+	};
+	for(const auto& test : cases) {
+		std::vector<const VSFrame*> alphas;
+		std::vector<const VSFrame*> frames = makeSequence(test.colorFamily, test.bits, test.width, test.height, test.alpha, alphas);
+		VSNode* clip = newClip(frames, 24, 1);
+		VSNode* alphaClip = test.alpha ? newClip(alphas, 24, 1) : nullptr;
+		for(int effort : {1, 4, 6}) {
+			char name[100];
+			snprintf(name, sizeof(name), "APNG %dx%d cf%d %d-bit alpha=%d effort=%d", test.width, test.height, test.colorFamily, test.bits, test.alpha, effort);
+			std::string error;
+			std::string png = encodeAnimation(clip, alphaClip, "PNG", {{"effort", effort}, {"loop", 3}}, &error);
+			std::vector<Shown> shown;
+			int plays = -1;
+			if(png.empty() || !decodeApng(png, shown, plays, error)) {
+				CHECK(false, "%s: %s", name, error.c_str());
+				continue;
+			}
+			CHECK(plays == 3, "%s: %d plays", name, plays);
+			CHECK(shown.size() == frames.size(), "%s: %d frames", name, int(shown.size()));
+			for(size_t i=0; i<shown.size() && i<frames.size(); i++) {
+				CHECK(sameImage(shown[i].image, frames[i], test.alpha ? alphas[i] : nullptr), "%s: frame %d differs", name, int(i));
+				CHECK(std::abs(shown[i].delay - 1 / 24.0) < 1e-9, "%s: frame %d delay %f", name, int(i), shown[i].delay);
+			}
+		}
+		// frames must share one pixel format, so can't be reduced
+		std::string error;
+		CHECK(encodeAnimation(clip, alphaClip, "PNG", {{"reduce", 1}}, &error).empty(), "APNG accepted reduce");
+		vsapi->freeNode(clip);
+		vsapi->freeNode(alphaClip);
+		freeFrames(frames);
+		freeFrames(alphas);
+	}
+}
+
+#ifdef HAVE_WEBP
+static uint32_t readLE(const std::string& data, size_t pos, int bytes) {
+	uint32_t value = 0;
+	for(int i=0; i<bytes; i++)
+		value |= uint32_t(uint8_t(data[pos + i])) << (i*8);
+	return value;
+}
+
+// decodes an animated WebP, checking its VP8X and ANIM headers, by turning each ANMF frame into a standalone WebP for
+// libwebp, and compositing it onto an RGBA canvas
+static bool decodeWebPAnimation(const std::string& webp, bool hasAlpha, std::vector<Shown>& shown, int& loops, std::string& error) {
+	if(webp.size() < 44 || webp.compare(0, 4, "RIFF") || webp.compare(8, 4, "WEBP") || readLE(webp, 4, 4) != webp.size() - 8) {
+		error = "bad RIFF header";
+		return false;
+	}
+	if(webp.compare(12, 4, "VP8X") || readLE(webp, 16, 4) != 10) {
+		error = "no VP8X chunk";
+		return false;
+	}
+	int flags = uint8_t(webp[20]);
+	if(!(flags & 0x02) || !!(flags & 0x10) != hasAlpha) {
+		error = "wrong VP8X flags";
+		return false;
+	}
+	Image canvas;
+	canvas.width = readLE(webp, 24, 3) + 1;
+	canvas.height = readLE(webp, 27, 3) + 1;
+	canvas.channels = 4;
+	canvas.bits = 8;
+	canvas.samples.assign(size_t(canvas.width) * canvas.height * 4, 0);
+	if(webp.compare(30, 4, "ANIM") || readLE(webp, 34, 4) != 6) {
+		error = "no ANIM chunk";
+		return false;
+	}
+	loops = readLE(webp, 42, 2);
+	for(size_t pos = 44; pos < webp.size(); ) {
+		uint32_t length = readLE(webp, pos + 4, 4);
+		if(webp.compare(pos, 4, "ANMF") || length < 16 || pos + 8 + length > webp.size()) {
+			error = "expected an ANMF chunk";
+			return false;
+		}
+		size_t frame = pos + 8;
+		int x0 = readLE(webp, frame, 3) * 2, y0 = readLE(webp, frame + 3, 3) * 2;
+		int width = readLE(webp, frame + 6, 3) + 1, height = readLE(webp, frame + 9, 3) + 1;
+		int duration = readLE(webp, frame + 12, 3);
+		if(uint8_t(webp[frame + 15]) != 0x02) { // no blending, no disposal
+			error = "unexpected ANMF flags";
+			return false;
+		}
+		if(x0 + width > canvas.width || y0 + height > canvas.height) {
+			error = "frame outside the canvas";
+			return false;
+		}
+		std::string vp8x("VP8X\x0a\0\0\0\x10\0\0\0", 12);
+		for(int size : {width - 1, height - 1})
+			for(int i=0; i<3; i++)
+				vp8x += char(size >> (i*8));
+		std::string file = "RIFF....WEBP" + vp8x + webp.substr(frame + 16, length - 16);
+		uint32_t riffSize = uint32_t(file.size() - 8);
+		for(int i=0; i<4; i++)
+			file[4 + i] = char(riffSize >> (i*8));
+		int decodedWidth, decodedHeight;
+		uint8_t* pixels = WebPDecodeRGBA(reinterpret_cast<const uint8_t*>(file.data()), file.size(), &decodedWidth, &decodedHeight);
+		if(!pixels || decodedWidth != width || decodedHeight != height) {
+			WebPFree(pixels);
+			error = "libwebp failed to decode frame " + std::to_string(shown.size());
+			return false;
+		}
+		for(int y=0; y<height; y++)
+			for(int x=0; x<width; x++)
+				for(int c=0; c<4; c++)
+					canvas.at(x0 + x, y0 + y, c) = pixels[(size_t(y) * width + x) * 4 + c];
+		WebPFree(pixels);
+		shown.push_back({canvas, duration / 1000.0});
+		pos += 8 + ((length + 1) & ~1u);
+	}
+	return true;
+}
+
+// lossless frames decode to the source, except for the colour of fully transparent pixels
+static bool sameRGBA(const Image& image, const VSFrame* frame, const VSFrame* alpha) {
+	for(int y=0; y<image.height; y++)
+		for(int x=0; x<image.width; x++) {
+			int a = alpha ? getSample(alpha, 0, x, y) : 255;
+			if(image.at(x, y, 3) != a) return false;
+			if(a == 0) continue;
+			for(int c=0; c<3; c++)
+				if(image.at(x, y, c) != getSample(frame, c, x, y)) return false;
+		}
+	return true;
+}
+
+static bool sameFrame(const VSFrame* a, const VSFrame* b) {
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(a);
+	for(int p=0; p<fi->numPlanes; p++)
+		for(int y=0; y<vsapi->getFrameHeight(a, p); y++)
+			for(int x=0; x<vsapi->getFrameWidth(a, p); x++)
+				if(getSample(a, p, x, y) != getSample(b, p, x, y)) return false;
+	return true;
+}
+
+static void testWebPAnimation() {
+	struct {
+		bool alpha;
+		int width, height;
+	} cases[] = {
+		{false, 64, 48}, {true, 33, 17}, {false, 1, 1}, {true, 2, 3}, {false, 300, 200},
+	};
+	for(const auto& test : cases) {
+		std::vector<const VSFrame*> alphas;
+		std::vector<const VSFrame*> frames = makeSequence(cfRGB, 8, test.width, test.height, test.alpha, alphas);
+		VSNode* clip = newClip(frames, 24, 1);
+		VSNode* alphaClip = test.alpha ? newClip(alphas, 24, 1) : nullptr;
+		// a frame identical to the previous one is merged into it, extending its duration
+		std::vector<size_t> kept;
+		for(size_t i=0; i<frames.size(); i++)
+			if(!i || !sameFrame(frames[i], frames[i-1]) || (test.alpha && !sameFrame(alphas[i], alphas[i-1])))
+				kept.push_back(i);
+
+		char name[100];
+		snprintf(name, sizeof(name), "WebP %dx%d alpha=%d", test.width, test.height, test.alpha);
+		std::string error;
+		std::string webp = encodeAnimation(clip, alphaClip, "WEBP", {{"loop", 3}}, &error);
+		std::vector<Shown> shown;
+		int loops = -1;
+		if(!webp.empty() && decodeWebPAnimation(webp, test.alpha, shown, loops, error)) {
+			CHECK(loops == 3, "%s: %d loops", name, loops);
+			CHECK(shown.size() == kept.size(), "%s: %d frames, expected %d", name, int(shown.size()), int(kept.size()));
+			for(size_t i=0; i<shown.size() && i<kept.size(); i++) {
+				size_t n = kept[i], next = i + 1 < kept.size() ? kept[i+1] : frames.size();
+				double duration = (std::llround(next * 1000 / 24.0) - std::llround(n * 1000 / 24.0)) / 1000.0;
+				CHECK(sameRGBA(shown[i].image, frames[n], test.alpha ? alphas[n] : nullptr), "%s: frame %d differs", name, int(i));
+				CHECK(std::abs(shown[i].delay - duration) < 1e-9, "%s: frame %d duration %f, expected %f", name, int(i), shown[i].delay, duration);
+			}
+		} else {
+			CHECK(false, "%s: %s", name, error.c_str());
+		}
+
+		shown.clear();
+		webp = encodeAnimation(clip, alphaClip, "WEBP-VP8", {}, &error);
+		CHECK(!webp.empty() && decodeWebPAnimation(webp, test.alpha, shown, loops, error), "lossy %s: %s", name, error.c_str());
+		CHECK(shown.size() == kept.size(), "lossy %s: %d frames, expected %d", name, int(shown.size()), int(kept.size()));
+		vsapi->freeNode(clip);
+		vsapi->freeNode(alphaClip);
+		freeFrames(frames);
+		freeFrames(alphas);
+	}
+}
+#endif
+
+int main(int argc, char** argv) {
+	if(!initCore(argc, argv)) return 1;
+	testApng();
+#ifdef HAVE_WEBP
+	testWebPAnimation();
+#endif
+	freeCore();
+	return failures() != 0;
+}
@@ -0,0 +1,290 @@
+#include "common.h"
+#include <png.h>
+#include <zlib.h>
+#include <csetjmp>
+#include <cstring>
+
+static int numFailures = 0;
+
+void testFailed() {
+	numFailures++;
+}
+int failures() {
+	return numFailures;
+}
+
+const VSAPI* vsapi = nullptr;
+VSCore* core = nullptr;
+static VSPlugin* plugin = nullptr;
+
+bool initCore(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s <path to plugin>\n", argv[0]);
+		return false;
+	}
+	vsapi = getVapourSynthAPI(VAPOURSYNTH_API_VERSION);
+	if(!vsapi) {
+		fprintf(stderr, "VapourSynth API v%d not available\n", VAPOURSYNTH_API_MAJOR);
+		return false;
+	}
+	// without autoloading, so that an installed copy of the plugin doesn't get in the way
+	core = vsapi->createCore(ccfDisableAutoLoading);
+	VSMap* args = vsapi->createMap();
+	vsapi->mapSetData(args, "path", argv[1], -1, dtUtf8, maReplace);
+	VSMap* ret = vsapi->invoke(vsapi->getPluginByID(VSH_STD_PLUGIN_ID, core), "LoadPlugin", args);
+	vsapi->freeMap(args);
+	if(vsapi->mapGetError(ret)) {
+		fprintf(stderr, "Failed to load %s: %s\n", argv[1], vsapi->mapGetError(ret));
+		vsapi->freeMap(ret);
+		return false;
+	}
+	vsapi->freeMap(ret);
+	plugin = vsapi->getPluginByID("animetosho.encodeframe", core);
+	return plugin != nullptr;
+}
+
+void freeCore() {
+	vsapi->freeCore(core);
+	core = nullptr;
+}
+
+
+/// frames
+
+VSFrame* newFrame(int colorFamily, int bits, int width, int height, int subSamplingW, int subSamplingH) {
+	VSVideoFormat format;
+	vsapi->queryVideoFormat(&format, colorFamily, stInteger, bits, subSamplingW, subSamplingH, core);
+	return vsapi->newVideoFrame(&format, width, height, nullptr, core);
+}
+
+int getSample(const VSFrame* frame, int plane, int x, int y) {
+	const uint8_t* row = vsapi->getReadPtr(frame, plane) + vsapi->getStride(frame, plane) * y;
+	if(vsapi->getVideoFrameFormat(frame)->bytesPerSample == 2)
+		return reinterpret_cast<const uint16_t*>(row)[x];
+	return row[x];
+}
+
+void setSample(VSFrame* frame, int plane, int x, int y, int value) {
+	uint8_t* row = vsapi->getWritePtr(frame, plane) + vsapi->getStride(frame, plane) * y;
+	if(vsapi->getVideoFrameFormat(frame)->bytesPerSample == 2)
+		reinterpret_cast<uint16_t*>(row)[x] = value;
+	else
+		row[x] = value;
+}
+
+void fillFrame(VSFrame* frame, uint32_t seed, int levels) {
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
+	int maxValue = (1 << fi->bitsPerSample) - 1;
+	uint32_t state = seed * 2654435761u + 1;
+	auto next = [&]() {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	};
+	for(int p=0; p<fi->numPlanes; p++) {
+		int width = vsapi->getFrameWidth(frame, p);
+		int height = vsapi->getFrameHeight(frame, p);
+		for(int y=0; y<height; y++) {
+			int value = 0;
+			for(int x=0; x<width; x++) {
+				// runs of noise, flat areas and gradients
+				if(x % 37 == 0) value = next() & 3;
+				uint32_t r = next();
+				int v = value == 0 ? int(r) : value == 1 ? int(seed + y) : int(x + y * 3 + p * 40);
+				if(levels)
+					v = (v & INT32_MAX) % levels * (maxValue / (levels > 1 ? levels - 1 : 1));
+				setSample(frame, p, x, y, v & maxValue);
+			}
+		}
+	}
+}
+
+struct ClipData {
+	std::vector<const VSFrame*> frames;
+};
+
+static const VSFrame* VS_CC clipGetFrame(int n, int activationReason, void* instanceData, void**, VSFrameContext*, VSCore*, const VSAPI* vsapi) {
+	if(activationReason != arInitial) return nullptr;
+	return vsapi->addFrameRef(static_cast<ClipData*>(instanceData)->frames[n]);
+}
+
+static void VS_CC clipFree(void* instanceData, VSCore*, const VSAPI* vsapi) {
+	ClipData* d = static_cast<ClipData*>(instanceData);
+	for(const VSFrame* frame : d->frames)
+		vsapi->freeFrame(frame);
+	delete d;
+}
+
+VSNode* newClip(const std::vector<const VSFrame*>& frames, int64_t fpsNum, int64_t fpsDen) {
+	ClipData* d = new ClipData;
+	for(const VSFrame* frame : frames)
+		d->frames.push_back(vsapi->addFrameRef(frame));
+	VSVideoInfo vi;
+	vi.format = *vsapi->getVideoFrameFormat(frames[0]);
+	vi.fpsNum = fpsNum;
+	vi.fpsDen = fpsDen;
+	vi.width = vsapi->getFrameWidth(frames[0], 0);
+	vi.height = vsapi->getFrameHeight(frames[0], 0);
+	vi.numFrames = int(frames.size());
+	return vsapi->createVideoFilter2("TestClip", &vi, clipGetFrame, clipFree, fmParallel, nullptr, 0, d, core);
+}
+
+
+/// plugin calls
+
+static std::string invokeEncode(const char* name, VSMap* args, const char* format, const std::vector<Option>& options, std::string* error) {
+	vsapi->mapSetData(args, "imgformat", format, -1, dtUtf8, maReplace);
+	for(const Option& option : options)
+		vsapi->mapSetInt(args, option.name, option.value, maReplace);
+	VSMap* ret = vsapi->invoke(plugin, name, args);
+	vsapi->freeMap(args);
+	std::string result;
+	if(vsapi->mapGetError(ret)) {
+		if(error) *error = vsapi->mapGetError(ret);
+	} else {
+		result.assign(vsapi->mapGetData(ret, "bytes", 0, nullptr), vsapi->mapGetDataSize(ret, "bytes", 0, nullptr));
+	}
+	vsapi->freeMap(ret);
+	return result;
+}
+
+std::string encodeFrame(const VSFrame* frame, const VSFrame* alpha, const char* format, const std::vector<Option>& options, std::string* error) {
+	VSMap* args = vsapi->createMap();
+	vsapi->mapSetFrame(args, "frame", frame, maReplace);
+	if(alpha) vsapi->mapSetFrame(args, "alpha", alpha, maReplace);
+	return invokeEncode("EncodeFrame", args, format, options, error);
+}
+
+std::string encodeAnimation(VSNode* clip, VSNode* alpha, const char* format, const std::vector<Option>& options, std::string* error) {
+	VSMap* args = vsapi->createMap();
+	vsapi->mapSetNode(args, "clip", clip, maReplace);
+	if(alpha) vsapi->mapSetNode(args, "alpha", alpha, maReplace);
+	return invokeEncode("EncodeAnimation", args, format, options, error);
+}
+
+std::vector<std::string> encodeFrames(const std::vector<const VSFrame*>& frames, const char* format, const std::vector<Option>& options, std::string* error) {
+	VSMap* args = vsapi->createMap();
+	for(const VSFrame* frame : frames)
+		vsapi->mapSetFrame(args, "frames", frame, maAppend);
+	vsapi->mapSetData(args, "imgformat", format, -1, dtUtf8, maReplace);
+	for(const Option& option : options)
+		vsapi->mapSetInt(args, option.name, option.value, maReplace);
+	VSMap* ret = vsapi->invoke(plugin, "EncodeFrames", args);
+	vsapi->freeMap(args);
+	std::vector<std::string> result;
+	if(vsapi->mapGetError(ret)) {
+		if(error) *error = vsapi->mapGetError(ret);
+	} else {
+		for(int i=0; i<vsapi->mapNumElements(ret, "bytes"); i++)
+			result.emplace_back(vsapi->mapGetData(ret, "bytes", i, nullptr), vsapi->mapGetDataSize(ret, "bytes", i, nullptr));
+	}
+	vsapi->freeMap(ret);
+	return result;
+}
+
+
+/// checks
+
+bool sameImage(const Image& image, const VSFrame* frame, const VSFrame* alpha) {
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
+	int colorChannels = fi->colorFamily == cfGray ? 1 : 3;
+	int shift = fi->bitsPerSample > 8 ? 16 - fi->bitsPerSample : 0;
+	if(image.width != vsapi->getFrameWidth(frame, 0) || image.height != vsapi->getFrameHeight(frame, 0)
+		|| image.channels != colorChannels + (alpha ? 1 : 0))
+		return false;
+	for(int y=0; y<image.height; y++)
+		for(int x=0; x<image.width; x++) {
+			for(int c=0; c<colorChannels; c++)
+				if(image.at(x, y, c) != getSample(frame, c, x, y) << shift) return false;
+			if(alpha && image.at(x, y, colorChannels) != getSample(alpha, 0, x, y) << shift) return false;
+		}
+	return true;
+}
+
+uint32_t readBE32(const std::string& data, size_t pos) {
+	const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data()) + pos;
+	return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+void appendBE32(std::string& data, uint32_t value) {
+	for(int i=3; i>=0; i--)
+		data += char(value >> (i*8));
+}
+
+bool readPngChunks(const std::string& png, std::vector<PngChunk>& chunks) {
+	if(png.compare(0, 8, "\x89PNG\r\n\x1a\n", 8) != 0) return false;
+	chunks.clear();
+	size_t pos = 8;
+	while(pos + 12 <= png.size()) {
+		uint32_t length = readBE32(png, pos);
+		if(pos + 12 + length > png.size()) return false;
+		uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(png.data()) + pos + 4, length + 4);
+		if(crc != readBE32(png, pos + 8 + length)) return false;
+		chunks.push_back({png.substr(pos + 4, 4), png.substr(pos + 8, length)});
+		pos += 12 + length;
+	}
+	return pos == png.size() && !chunks.empty() && chunks.back().type == "IEND";
+}
+
+std::string writePngChunk(const char* type, const std::string& data) {
+	std::string chunk;
+	appendBE32(chunk, uint32_t(data.size()));
+	chunk += type;
+	chunk += data;
+	appendBE32(chunk, crc32(0, reinterpret_cast<const Bytef*>(chunk.data()) + 4, uInt(data.size() + 4)));
+	return chunk;
+}
+
+struct PngSource {
+	const std::string* data;
+	size_t pos;
+};
+
+static void pngRead(png_structp png, png_bytep out, png_size_t size) {
+	PngSource* src = static_cast<PngSource*>(png_get_io_ptr(png));
+	if(src->pos + size > src->data->size())
+		png_error(png, "Unexpected end of file");
+	memcpy(out, src->data->data() + src->pos, size);
+	src->pos += size;
+}
+
+static void pngWarning(png_structp png, png_const_charp message) {
+	*static_cast<std::string*>(png_get_error_ptr(png)) = message;
+}
+
+bool decodePng(const std::string& data, Image& image) {
+	PngSource src{&data, 0};
+	std::string warning;
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &warning, nullptr, pngWarning);
+	png_infop info = png_create_info_struct(png);
+	std::vector<std::vector<uint8_t>> rows;
+	std::vector<png_bytep> rowPtrs;
+	if(setjmp(png_jmpbuf(png))) {
+		png_destroy_read_struct(&png, &info, nullptr);
+		return false;
+	}
+	png_set_read_fn(png, &src, pngRead);
+	png_read_info(png, info);
+	png_set_expand(png);
+	png_read_update_info(png, info);
+	image.width = png_get_image_width(png, info);
+	image.height = png_get_image_height(png, info);
+	image.channels = png_get_channels(png, info);
+	image.bits = png_get_bit_depth(png, info);
+	bool wide = image.bits == 16;
+	rows.assign(image.height, std::vector<uint8_t>(png_get_rowbytes(png, info)));
+	for(auto& row : rows)
+		rowPtrs.push_back(row.data());
+	png_read_image(png, rowPtrs.data());
+	png_read_end(png, nullptr);
+	png_destroy_read_struct(&png, &info, nullptr);
+	if(!warning.empty()) return false;
+
+	image.samples.resize(size_t(image.width) * image.height * image.channels);
+	size_t i = 0;
+	for(const auto& row : rows)
+		for(int x=0; x<image.width * image.channels; x++)
+			image.samples[i++] = wide ? row[x*2] << 8 | row[x*2 + 1] : row[x];
+	return true;
+}
@@ -0,0 +1,77 @@
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+#include <VapourSynth4.h>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// reports a failed check and carries on, so that a run lists every failure; tests return `failures() != 0`
+#define CHECK(cond, ...) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fputc('\n', stderr); \
+		testFailed(); \
+	} \
+} while(0)
+
+void testFailed();
+int failures();
+
+extern const VSAPI* vsapi;
+extern VSCore* core;
+
+// creates a core and loads the plugin, whose path is the test's first argument
+bool initCore(int argc, char** argv);
+void freeCore();
+
+VSFrame* newFrame(int colorFamily, int bits, int width, int height, int subSamplingW = 0, int subSamplingH = 0);
+int getSample(const VSFrame* frame, int plane, int x, int y);
+void setSample(VSFrame* frame, int plane, int x, int y, int value);
+// fills every plane with values from a fixed pseudo-random sequence, limited to `levels` distinct values per plane
+// (0 = any value); smooth areas are left in, so that the encoders' filters and matching get exercised
+void fillFrame(VSFrame* frame, uint32_t seed, int levels = 0);
+
+// a clip of the given frames, all of which must share a format and dimensions
+VSNode* newClip(const std::vector<const VSFrame*>& frames, int64_t fpsNum, int64_t fpsDen);
+
+struct Option {
+	const char* name;
+	int64_t value;
+};
+// calls the plugin's EncodeFrame/EncodeAnimation; on failure, returns an empty string, with the message in `error`
+std::string encodeFrame(const VSFrame* frame, const VSFrame* alpha, const char* format, const std::vector<Option>& options, std::string* error = nullptr);
+std::string encodeAnimation(VSNode* clip, VSNode* alpha, const char* format, const std::vector<Option>& options, std::string* error = nullptr);
+// calls EncodeFrames, which encodes the frames as a sequence (for `temporal`); empty on failure
+std::vector<std::string> encodeFrames(const std::vector<const VSFrame*>& frames, const char* format, const std::vector<Option>& options, std::string* error = nullptr);
+
+// decoded image, one int per sample, channels interleaved
+struct Image {
+	int width, height, channels;
+	int bits; // per sample, after expanding any palette
+	std::vector<int> samples;
+
+	int& at(int x, int y, int c) { return samples[(size_t(y) * width + x) * channels + c]; }
+	int at(int x, int y, int c) const { return samples[(size_t(y) * width + x) * channels + c]; }
+};
+// true if `image` holds `frame` (+ `alpha`) exactly, as Gray/GrayA/RGB/RGBA; samples of >8-bit frames are compared
+// shifted up to 16 bits, as they're stored in a PNG
+bool sameImage(const Image& image, const VSFrame* frame, const VSFrame* alpha);
+
+// PNG chunks, with their CRCs checked
+struct PngChunk {
+	std::string type;
+	std::string data;
+};
+bool readPngChunks(const std::string& png, std::vector<PngChunk>& chunks);
+std::string writePngChunk(const char* type, const std::string& data);
+uint32_t readBE32(const std::string& data, size_t pos);
+void appendBE32(std::string& data, uint32_t value);
+
+// decodes a PNG with libpng, expanding palette and tRNS entries; samples are 16-bit if the PNG is. Fails on any
+// warning, as libpng only warns about a bad zlib checksum or excess image data
+bool decodePng(const std::string& png, Image& image);
+
+#endif
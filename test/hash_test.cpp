@@ -0,0 +1,93 @@
+// hashRows keys the image caches, including the disk cache shared between processes, so must give the same result on
+// every instruction set; checked directly against each build of the kernels the CPU supports
+
+#include "interleave.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+		fprintf(stderr, __VA_ARGS__); \
+		fputc('\n', stderr); \
+		failures++; \
+	} \
+} while(0)
+
+struct Isa {
+	const char* name;
+	const InterleaveKernels* kernels;
+	bool supported;
+};
+
+int main() {
+	__builtin_cpu_init();
+	bool avx512 = __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq");
+	const Isa isas[] = {
+		{"sse41", &interleaveKernels_sse41, bool(__builtin_cpu_supports("sse4.1"))},
+		{"avx2", &interleaveKernels_avx2, bool(__builtin_cpu_supports("avx2"))},
+		{"avx512", &interleaveKernels_avx512, avx512},
+		{"avx512vbmi", &interleaveKernels_avx512vbmi, avx512 && __builtin_cpu_supports("avx512vbmi")},
+	};
+	if(!isas[0].supported) {
+		printf("SSE4.1 not supported, skipping\n");
+		return 77; // meson's skip code
+	}
+	for(const Isa& isa : isas)
+		if(!isa.supported) printf("%s not supported, not checked\n", isa.name);
+
+	// rows at every offset from an aligned address, so that each path through the kernels (vector body, partial
+	// vectors, scalar tail) is covered
+	std::vector<uint8_t> buffer(70000);
+	uint32_t state = 1;
+	for(uint8_t& b : buffer) {
+		state = state * 1103515245 + 12345;
+		b = state >> 16;
+	}
+	const size_t rowSizes[] = {0, 1, 2, 3, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 127, 128, 129, 191, 255, 256, 257, 1000, 4095, 4096, 4097, 9999};
+	for(size_t rowSize : rowSizes)
+		for(int rows : {1, 2, 5})
+			for(size_t offset : {0, 1, 3, 8, 63}) {
+				ptrdiff_t stride = rowSize + 13;
+				const uint8_t* src = buffer.data() + offset;
+				uint64_t reference[8];
+				for(int i=0; i<8; i++)
+					reference[i] = i * 0x9e3779b97f4a7c15ULL;
+				isas[0].kernels->hashRows(reference, src, stride, rowSize, rows);
+				for(const Isa& isa : isas) {
+					if(!isa.supported) continue;
+					uint64_t hash[8];
+					for(int i=0; i<8; i++)
+						hash[i] = i * 0x9e3779b97f4a7c15ULL;
+					isa.kernels->hashRows(hash, src, stride, rowSize, rows);
+					CHECK(memcmp(hash, reference, sizeof(hash)) == 0, "%s: row size %d, %d rows, offset %d differs from sse41", isa.name, int(rowSize), rows, int(offset));
+				}
+			}
+
+	// bytes between rows (the stride's padding) aren't hashed, whilst any change within a row is
+	for(const Isa& isa : isas) {
+		if(!isa.supported) continue;
+		const size_t rowSize = 333;
+		const int rows = 4;
+		const ptrdiff_t stride = 384;
+		std::vector<uint8_t> image(buffer.begin(), buffer.begin() + stride * rows);
+		uint64_t before[8] = {}, after[8] = {};
+		isa.kernels->hashRows(before, image.data(), stride, rowSize, rows);
+		for(int y=0; y<rows; y++)
+			for(size_t x=rowSize; x<size_t(stride); x++)
+				image[y * stride + x] ^= 0x55;
+		isa.kernels->hashRows(after, image.data(), stride, rowSize, rows);
+		CHECK(memcmp(before, after, sizeof(before)) == 0, "%s: padding affects the hash", isa.name);
+		for(size_t pos : {size_t(0), rowSize - 1, stride * 2 + rowSize / 2, stride * (rows-1) + rowSize - 1}) {
+			image[pos] ^= 1;
+			memset(after, 0, sizeof(after));
+			isa.kernels->hashRows(after, image.data(), stride, rowSize, rows);
+			CHECK(memcmp(before, after, sizeof(before)) != 0, "%s: change at %d not hashed", isa.name, int(pos));
+			image[pos] ^= 1;
+		}
+	}
+	return failures != 0;
+}
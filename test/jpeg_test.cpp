@@ -0,0 +1,174 @@
+// JPEG output, decoded with libjpeg
+
+#include "common.h"
+#include <algorithm>
+#include <csetjmp>
+#include <jpeglib.h>
+
+struct JpegError {
+	jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr cinfo) {
+	longjmp(reinterpret_cast<JpegError*>(cinfo->err)->jump, 1);
+}
+
+// decodes to interleaved samples, failing on any error or warning (libjpeg warns about corrupt entropy data, such as
+// a missing or out of sequence restart marker, rather than failing)
+static bool decodeJpeg(const std::string& jpeg, Image& image) {
+	jpeg_decompress_struct cinfo;
+	JpegError err;
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpegErrorExit;
+	if(setjmp(err.jump)) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, reinterpret_cast<const unsigned char*>(jpeg.data()), jpeg.size());
+	jpeg_read_header(&cinfo, TRUE);
+	jpeg_start_decompress(&cinfo);
+	image.width = cinfo.output_width;
+	image.height = cinfo.output_height;
+	image.channels = cinfo.output_components;
+	image.bits = 8;
+	std::vector<JSAMPLE> row(size_t(image.width) * image.channels);
+	image.samples.clear();
+	while(cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW rowPtr = row.data();
+		jpeg_read_scanlines(&cinfo, &rowPtr, 1);
+		image.samples.insert(image.samples.end(), row.begin(), row.end());
+	}
+	jpeg_finish_decompress(&cinfo);
+	bool ok = err.mgr.num_warnings == 0;
+	jpeg_destroy_decompress(&cinfo);
+	return ok;
+}
+
+// markers of interest in a baseline JPEG
+struct JpegLayout {
+	int width, height;
+	int mcuWidth, mcuHeight;
+	int restartInterval; // 0 = no DRI
+	std::vector<int> restarts; // n of each RSTn in the scan, in order
+};
+
+static bool parseJpeg(const std::string& jpeg, JpegLayout& layout) {
+	const uint8_t* data = reinterpret_cast<const uint8_t*>(jpeg.data());
+	size_t size = jpeg.size();
+	if(size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+	layout.width = layout.height = 0;
+	layout.restartInterval = 0;
+	layout.restarts.clear();
+	size_t pos = 2;
+	// header segments, up to and including SOS
+	for(;;) {
+		if(pos + 4 > size || data[pos] != 0xFF) return false;
+		int marker = data[pos + 1];
+		size_t length = data[pos + 2] << 8 | data[pos + 3];
+		if(pos + 2 + length > size) return false;
+		const uint8_t* segment = data + pos + 4;
+		if(marker == 0xC0) {
+			layout.height = segment[1] << 8 | segment[2];
+			layout.width = segment[3] << 8 | segment[4];
+			int components = segment[5];
+			int maxH = 1, maxV = 1;
+			for(int c=0; c<components; c++) {
+				maxH = std::max(maxH, segment[7 + c*3] >> 4);
+				maxV = std::max(maxV, segment[7 + c*3] & 15);
+			}
+			layout.mcuWidth = maxH * 8;
+			layout.mcuHeight = maxV * 8;
+		} else if(marker >= 0xC1 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			return false; // not baseline
+		} else if(marker == 0xDD) {
+			layout.restartInterval = segment[0] << 8 | segment[1];
+		}
+		pos += 2 + length;
+		if(marker == 0xDA) break;
+	}
+	// entropy-coded data, which only contains stuffed bytes (FF 00) and RSTn markers, up to EOI
+	for(; pos + 1 < size; pos++) {
+		if(data[pos] != 0xFF) continue;
+		int marker = data[pos + 1];
+		if(marker == 0x00) {
+			pos++;
+		} else if(marker >= 0xD0 && marker <= 0xD7) {
+			layout.restarts.push_back(marker - 0xD0);
+			pos++;
+		} else if(marker == 0xD9) {
+			return pos + 2 == size;
+		} else {
+			return false;
+		}
+	}
+	return false;
+}
+
+// encodes `frame` with each stripe count, and checks that the bands are joined into a valid JPEG, with a restart
+// marker between each, and decode to the same image as a single band
+static void checkBands(const VSFrame* frame, const char* name) {
+	int width = vsapi->getFrameWidth(frame, 0);
+	int height = vsapi->getFrameHeight(frame, 0);
+	std::string error;
+	std::string reference = encodeFrame(frame, nullptr, "JPEG", {{"stripes", 1}}, &error);
+	Image referenceImage;
+	JpegLayout layout;
+	CHECK(!reference.empty(), "%s: %s", name, error.c_str());
+	CHECK(decodeJpeg(reference, referenceImage), "%s: libjpeg failed to decode single band", name);
+	CHECK(parseJpeg(reference, layout) && layout.restartInterval == 0 && layout.restarts.empty(), "%s: single band has restarts", name);
+
+	for(int stripes : {0, 2, 3, 7, 1000}) {
+		std::string jpeg = encodeFrame(frame, nullptr, "JPEG", {{"stripes", stripes}}, &error);
+		Image image;
+		CHECK(!jpeg.empty(), "%s stripes=%d: %s", name, stripes, error.c_str());
+		if(!parseJpeg(jpeg, layout)) {
+			CHECK(false, "%s stripes=%d: bad marker layout", name, stripes);
+			continue;
+		}
+		CHECK(layout.width == width && layout.height == height, "%s stripes=%d: SOF has %dx%d", name, stripes, layout.width, layout.height);
+		int mcuRows = (height + layout.mcuHeight - 1) / layout.mcuHeight;
+		int mcusPerRow = (width + layout.mcuWidth - 1) / layout.mcuWidth;
+		if(stripes > 1 && mcuRows > 1)
+			CHECK(layout.restartInterval > 0, "%s stripes=%d: no DRI", name, stripes);
+		if(layout.restartInterval) {
+			CHECK(layout.restartInterval % mcusPerRow == 0, "%s stripes=%d: restart interval %d isn't whole MCU rows", name, stripes, layout.restartInterval);
+			size_t intervals = (size_t(mcuRows) * mcusPerRow + layout.restartInterval - 1) / layout.restartInterval;
+			CHECK(layout.restarts.size() == intervals - 1, "%s stripes=%d: %d restarts for %d intervals", name, stripes, int(layout.restarts.size()), int(intervals));
+			for(size_t i=0; i<layout.restarts.size(); i++)
+				CHECK(layout.restarts[i] == int(i & 7), "%s stripes=%d: RST%d out of sequence", name, stripes, layout.restarts[i]);
+		}
+		CHECK(decodeJpeg(jpeg, image), "%s stripes=%d: libjpeg failed to decode", name, stripes);
+		CHECK(image.samples == referenceImage.samples, "%s stripes=%d: decodes differently to a single band", name, stripes);
+	}
+}
+
+static void testBands() {
+	const int sizes[][2] = {{16, 8}, {34, 18}, {334, 98}, {1920, 1080}};
+	for(const auto& size : sizes) {
+		char name[100];
+		for(int colorFamily : {cfGray, cfRGB}) {
+			VSFrame* frame = newFrame(colorFamily, 8, size[0], size[1]);
+			fillFrame(frame, size[0]);
+			snprintf(name, sizeof(name), "%dx%d cf%d", size[0], size[1], colorFamily);
+			checkBands(frame, name);
+			vsapi->freeFrame(frame);
+		}
+		const int subsampling[][2] = {{0, 0}, {1, 0}, {1, 1}};
+		for(const auto& ss : subsampling) {
+			VSFrame* frame = newFrame(cfYUV, 8, size[0], size[1], ss[0], ss[1]);
+			fillFrame(frame, size[1]);
+			snprintf(name, sizeof(name), "%dx%d YUV ss%d%d", size[0], size[1], ss[0], ss[1]);
+			checkBands(frame, name);
+			vsapi->freeFrame(frame);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	if(!initCore(argc, argv)) return 1;
+	testBands();
+	freeCore();
+	return failures() != 0;
+}
@@ -0,0 +1,229 @@
+// PNG output, decoded with libpng
+
+#include "common.h"
+#include <algorithm>
+
+// encodes `frame` (+ `alpha`) and checks that it decodes back to the same image
+static void checkRoundTrip(const VSFrame* frame, const VSFrame* alpha, const std::vector<Option>& options, const char* what) {
+	std::string error;
+	std::string png = encodeFrame(frame, alpha, "PNG", options, &error);
+	std::vector<PngChunk> chunks;
+	Image image;
+	CHECK(!png.empty(), "%s: %s", what, error.c_str());
+	CHECK(readPngChunks(png, chunks), "%s: bad chunk layout", what);
+	CHECK(decodePng(png, image), "%s: libpng failed to decode", what);
+	CHECK(sameImage(image, frame, alpha), "%s: decoded image differs", what);
+}
+
+// stripes are deflated separately and joined into one zlib stream, so check every join decodes, including stripes
+// of a single row, and more stripes than rows
+static void testStripes() {
+	const int sizes[][2] = {{1, 1}, {7, 3}, {33, 17}, {640, 257}};
+	for(const auto& size : sizes)
+		for(int colorFamily : {cfGray, cfRGB})
+			for(int bits : {8, 10, 16})
+				for(int hasAlpha=0; hasAlpha<2; hasAlpha++) {
+					VSFrame* frame = newFrame(colorFamily, bits, size[0], size[1]);
+					VSFrame* alpha = hasAlpha ? newFrame(cfGray, bits, size[0], size[1]) : nullptr;
+					fillFrame(frame, size[0] + bits);
+					if(alpha) fillFrame(alpha, size[1] + bits, 3);
+					for(int stripes : {1, 2, 3, 16, 1000})
+						for(int effort : {1, 5}) {
+							char what[100];
+							snprintf(what, sizeof(what), "%dx%d cf%d %d-bit alpha=%d stripes=%d effort=%d", size[0], size[1], colorFamily, bits, hasAlpha, stripes, effort);
+							checkRoundTrip(frame, alpha, {{"stripes", stripes}, {"effort", effort}}, what);
+						}
+					vsapi->freeFrame(frame);
+					vsapi->freeFrame(alpha);
+				}
+
+	// 0 picks the number of stripes from the frame size and thread count
+	VSFrame* frame = newFrame(cfRGB, 8, 1920, 1080);
+	fillFrame(frame, 1);
+	checkRoundTrip(frame, nullptr, {{"stripes", 0}}, "1920x1080 automatic stripes");
+	vsapi->freeFrame(frame);
+}
+
+// at effort 5 and up, a range of rows may be coded as several blocks, chosen from samples of groups of a few rows; wide,
+// short frames (or stripes, or APNG regions) give ranges with only a few rows per group, and the last group ends at
+// the bottom of the frame
+static void testWideRows() {
+	for(int height : {8, 12, 28})
+		for(int bits : {8, 16}) {
+			VSFrame* frame = newFrame(cfRGB, bits, 2800, height);
+			fillFrame(frame, height + bits);
+			for(int stripes : {1, 2, 3})
+				for(int effort : {5, 6}) {
+					char what[100];
+					snprintf(what, sizeof(what), "2800x%d %d-bit stripes=%d effort=%d", height, bits, stripes, effort);
+					checkRoundTrip(frame, nullptr, {{"stripes", stripes}, {"effort", effort}}, what);
+				}
+			vsapi->freeFrame(frame);
+		}
+}
+
+// with temporal, each frame of a sequence may reuse the Huffman codes of the one before, where they still fit
+static void testTemporal() {
+	std::vector<const VSFrame*> frames;
+	for(int i=0; i<6; i++) {
+		VSFrame* frame = newFrame(cfRGB, 8, 700, 90);
+		// mostly the same content, then a different kind of frame, then back again
+		fillFrame(frame, i < 3 || i == 5 ? 1 : i, i == 3 ? 4 : 0);
+		setSample(frame, 0, i, i, i * 40);
+		frames.push_back(frame);
+	}
+	for(int stripes : {1, 3})
+		for(int effort : {1, 5, 6}) {
+			std::string error;
+			std::vector<std::string> pngs = encodeFrames(frames, "PNG", {{"temporal", 1}, {"stripes", stripes}, {"effort", effort}}, &error);
+			CHECK(pngs.size() == frames.size(), "temporal stripes=%d effort=%d: %s", stripes, effort, error.c_str());
+			for(size_t i=0; i<pngs.size(); i++) {
+				Image image;
+				CHECK(decodePng(pngs[i], image), "temporal stripes=%d effort=%d: libpng failed to decode frame %d", stripes, effort, int(i));
+				CHECK(sameImage(image, frames[i], nullptr), "temporal stripes=%d effort=%d: frame %d differs", stripes, effort, int(i));
+			}
+		}
+	for(const VSFrame* frame : frames)
+		vsapi->freeFrame(frame);
+}
+
+// true if `image`, which may have been reduced, still holds `frame` (+ `alpha`): an RGB frame may have become
+// grayscale (and a grayscale palette expands to RGB), an opaque alpha may have been dropped, and >8-bit samples may
+// have been narrowed to 8 bits
+static bool sameReducedImage(const Image& image, const VSFrame* frame, const VSFrame* alpha) {
+	const VSVideoFormat* fi = vsapi->getVideoFrameFormat(frame);
+	int colorChannels = fi->colorFamily == cfGray ? 1 : 3;
+	int maxValue = (1 << fi->bitsPerSample) - 1;
+	int shift = fi->bitsPerSample > 8 ? 16 - fi->bitsPerSample : 0;
+	int scale = fi->bitsPerSample > 8 && image.bits == 8 ? 257 : 1;
+	bool hasAlpha = image.channels == 2 || image.channels == 4;
+	int imageColorChannels = hasAlpha ? image.channels - 1 : image.channels;
+	if(image.width != vsapi->getFrameWidth(frame, 0) || image.height != vsapi->getFrameHeight(frame, 0)
+		|| (hasAlpha && !alpha))
+		return false;
+	for(int y=0; y<image.height; y++)
+		for(int x=0; x<image.width; x++) {
+			for(int c=0; c<std::max(colorChannels, imageColorChannels); c++)
+				if(image.at(x, y, imageColorChannels == 1 ? 0 : c) * scale != getSample(frame, colorChannels == 1 ? 0 : c, x, y) << shift) return false;
+			if(hasAlpha && image.at(x, y, imageColorChannels) * scale != getSample(alpha, 0, x, y) << shift) return false;
+			if(alpha && !hasAlpha && getSample(alpha, 0, x, y) != maxValue) return false;
+		}
+	return true;
+}
+
+struct ReduceCase {
+	const char* name;
+	int colorFamily, bits;
+	int colors; // distinct colours, 0 = any
+	int alpha; // 0 = none, 1 = opaque, 2 = varying
+	bool grayish; // RGB with identical channels
+	bool scaled8; // >8-bit samples which are 8-bit values scaled up
+	int colorType, depth; // expected IHDR
+};
+
+// with reduce, the PNG takes the smallest colour type and depth which hold the frame exactly; PLTE and tRNS hold the
+// colours, and the packed indices must expand back to the same pixels
+static void testReduce() {
+	const ReduceCase cases[] = {
+		{"2 colours", cfRGB, 8, 2, 0, false, false, 3, 1},
+		{"4 colours", cfRGB, 8, 4, 0, false, false, 3, 2},
+		{"16 colours", cfRGB, 8, 16, 0, false, false, 3, 4},
+		{"200 colours", cfRGB, 8, 200, 0, false, false, 3, 8},
+		{"200 colours, translucent", cfRGB, 8, 200, 2, false, false, 3, 8},
+		{"many colours", cfRGB, 8, 0, 0, false, false, 2, 8},
+		{"many colours, opaque alpha", cfRGB, 8, 0, 1, false, false, 2, 8},
+		{"many colours, translucent", cfRGB, 8, 0, 2, false, false, 6, 8},
+		{"gray 4 levels", cfGray, 8, 4, 0, false, false, 3, 2},
+		{"gray many levels", cfGray, 8, 0, 0, false, false, 0, 8},
+		{"gray RGB", cfRGB, 8, 0, 0, true, false, 0, 8},
+		{"gray RGB, translucent", cfRGB, 8, 0, 2, true, false, 4, 8},
+		{"16-bit scaled 8-bit", cfRGB, 16, 0, 0, false, true, 2, 8},
+		{"16-bit", cfRGB, 16, 0, 0, false, false, 2, 16},
+		{"10-bit gray, opaque alpha", cfGray, 10, 0, 1, false, false, 0, 16},
+	};
+	for(const ReduceCase& test : cases) {
+		const int width = 61, height = 23;
+		int maxValue = (1 << test.bits) - 1;
+		VSFrame* frame = newFrame(test.colorFamily, test.bits, width, height);
+		VSFrame* alpha = test.alpha ? newFrame(cfGray, test.bits, width, height) : nullptr;
+		int numPlanes = test.colorFamily == cfGray ? 1 : 3;
+		uint32_t state = 12345;
+		auto next = [&]() {
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return state;
+		};
+		auto sample = [&]() {
+			int v = next() & 255;
+			return test.bits == 8 ? v : test.scaled8 ? v * 257 : int(next()) & maxValue;
+		};
+		// colour 0..3 = R, G, B, A
+		std::vector<std::vector<int>> palette(test.colors ? test.colors : width * height, std::vector<int>(4));
+		for(auto& color : palette) {
+			for(int c=0; c<3; c++)
+				color[c] = test.grayish && c ? color[0] : sample();
+			color[3] = test.alpha == 2 ? sample() : maxValue;
+		}
+		for(int y=0; y<height; y++)
+			for(int x=0; x<width; x++) {
+				const auto& color = palette[test.colors ? (x * 7 + y * 3 + (next() % 3 == 0 ? next() : 0)) % test.colors : y * width + x];
+				for(int p=0; p<numPlanes; p++)
+					setSample(frame, p, x, y, color[p]);
+				if(alpha) setSample(alpha, 0, x, y, color[3]);
+			}
+
+		for(int stripes : {1, 3}) {
+			std::string error;
+			std::string png = encodeFrame(frame, alpha, "PNG", {{"reduce", 1}, {"stripes", stripes}}, &error);
+			std::vector<PngChunk> chunks;
+			Image image;
+			CHECK(!png.empty(), "%s: %s", test.name, error.c_str());
+			if(!readPngChunks(png, chunks)) {
+				CHECK(false, "%s: bad chunk layout", test.name);
+				continue;
+			}
+			int colorType = uint8_t(chunks[0].data[9]), depth = uint8_t(chunks[0].data[8]);
+			CHECK(colorType == test.colorType && depth == test.depth, "%s: colour type %d, depth %d; expected %d, %d", test.name, colorType, depth, test.colorType, test.depth);
+			const PngChunk* plte = nullptr;
+			const PngChunk* trns = nullptr;
+			for(const PngChunk& chunk : chunks) {
+				if(chunk.type == "PLTE") plte = &chunk;
+				if(chunk.type == "tRNS") trns = &chunk;
+			}
+			if(colorType == 3) {
+				CHECK(plte && plte->data.size() % 3 == 0 && plte->data.size() / 3 <= size_t(1) << depth, "%s: bad PLTE", test.name);
+				CHECK(!trns == (test.alpha != 2), "%s: tRNS %s", test.name, trns ? "present" : "missing");
+				if(plte && trns)
+					CHECK(trns->data.size() <= plte->data.size() / 3, "%s: tRNS longer than PLTE", test.name);
+			} else {
+				CHECK(!plte && !trns, "%s: PLTE/tRNS on colour type %d", test.name, colorType);
+			}
+			CHECK(decodePng(png, image), "%s: libpng failed to decode", test.name);
+			CHECK(sameReducedImage(image, frame, alpha), "%s stripes=%d: decoded image differs", test.name, stripes);
+		}
+
+		// without reduce, the PNG keeps the frame's format
+		std::string png = encodeFrame(frame, alpha, "PNG", {});
+		std::vector<PngChunk> chunks;
+		if(readPngChunks(png, chunks)) {
+			int channels = numPlanes + (alpha ? 1 : 0);
+			int colorType = channels == 1 ? 0 : channels == 2 ? 4 : channels == 3 ? 2 : 6;
+			CHECK(uint8_t(chunks[0].data[9]) == colorType && uint8_t(chunks[0].data[8]) == (test.bits > 8 ? 16 : 8), "%s: reduced by default", test.name);
+		} else {
+			CHECK(false, "%s: bad chunk layout without reduce", test.name);
+		}
+		vsapi->freeFrame(frame);
+		vsapi->freeFrame(alpha);
+	}
+}
+
+int main(int argc, char** argv) {
+	if(!initCore(argc, argv)) return 1;
+	testStripes();
+	testWideRows();
+	testTemporal();
+	testReduce();
+	freeCore();
+	return failures() != 0;
+}
@@ -0,0 +1,89 @@
+#include "threadpool.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+ThreadPool::ThreadPool(unsigned numThreads) : stopping(false) {
+	workers.reserve(numThreads);
+	for(unsigned i=0; i<numThreads; i++)
+		workers.emplace_back(&ThreadPool::worker, this);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		stopping = true;
+	}
+	cond.notify_all();
+	for(auto& t : workers)
+		t.join();
+}
+
+void ThreadPool::worker() {
+	while(1) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lk(mutex);
+			cond.wait(lk, [this] { return stopping || !queue.empty(); });
+			if(queue.empty()) return; // stopping
+			task = std::move(queue.front());
+			queue.pop_front();
+		}
+		task();
+	}
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		queue.push_back(std::move(task));
+	}
+	cond.notify_one();
+}
+
+namespace {
+struct ParallelJob {
+	std::atomic<size_t> next;
+	std::atomic<size_t> done;
+	size_t count;
+	const std::function<void(size_t)>* fn; // only dereferenced whilst items remain, which the caller waits on
+	std::mutex mutex;
+	std::condition_variable cond;
+	
+	ParallelJob(size_t count, const std::function<void(size_t)>* fn) : next(0), done(0), count(count), fn(fn) {}
+	void run() {
+		size_t i;
+		while((i = next.fetch_add(1)) < count) {
+			(*fn)(i);
+			if(done.fetch_add(1) + 1 == count) {
+				std::lock_guard<std::mutex> lk(mutex);
+				cond.notify_all();
+			}
+		}
+	}
+};
+}
+
+void ThreadPool::parallelFor(size_t count, unsigned maxThreads, const std::function<void(size_t)>& fn) {
+	size_t helpers = std::min<size_t>(size(), count ? count-1 : 0);
+	if(maxThreads) helpers = std::min<size_t>(helpers, maxThreads-1);
+	if(helpers == 0) {
+		for(size_t i=0; i<count; i++)
+			fn(i);
+		return;
+	}
+	
+	// helpers may only get to run after we've returned, so the job is shared with them
+	auto job = std::make_shared<ParallelJob>(count, &fn);
+	for(size_t i=0; i<helpers; i++)
+		submit([job] { job->run(); });
+	job->run();
+	
+	std::unique_lock<std::mutex> lk(job->mutex);
+	job->cond.wait(lk, [&] { return job->done.load() == count; });
+}
+
+ThreadPool& ThreadPool::global() {
+	static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+	return pool;
+}
@@ -0,0 +1,37 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> queue;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool stopping;
+	
+	void worker();
+public:
+	explicit ThreadPool(unsigned numThreads);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	
+	unsigned size() const { return static_cast<unsigned>(workers.size()); }
+	void submit(std::function<void()> task);
+	
+	// runs fn(0) .. fn(count-1), on at most `maxThreads` threads (including the calling thread; 0 = no limit)
+	// the calling thread takes part in the work and only waits on items already picked up by a worker, so this
+	// is safe to call from within a pool task
+	void parallelFor(size_t count, unsigned maxThreads, const std::function<void(size_t)>& fn);
+	
+	// shared pool, sized to the number of hardware threads, created on first use
+	static ThreadPool& global();
+};
+
+#endif